@@ -0,0 +1,200 @@
+/*
+activations.hpp
+
+Activation functions and their derivatives as small function objects, for use
+with applyFunction() and dense_forward() in matrix.hpp.
+
+Each one is a struct with an inline, branch free operator(), so when it is
+passed as a template argument the call is inlined into the loop and the
+compiler can vectorize it (a plain function pointer can't be inlined).
+operator() is a template, so the same functor works on double and on float
+(computing in float throughout).
+Derivatives are written in terms of the pre-activation z, like
+leaky_ReLU_deriv(z) in nn.cpp.
+
+Activations:                        Derivatives:
+    act_identity                        act_identity_deriv
+    act_relu                            act_relu_deriv
+    act_leaky_relu(leak)                act_leaky_relu_deriv(leak)
+    act_sigmoid                         act_sigmoid_deriv
+    act_tanh                            act_tanh_deriv
+    act_fast_sigmoid                    act_fast_sigmoid_deriv
+    act_fast_tanh                       act_fast_tanh_deriv
+
+act_sigmoid and act_tanh call the C library exp()/tanh() (exact, but usually
+not vectorized). The fast_ versions use fast_exp(), a polynomial approximation
+(relative error about 1e-8 in double, 2e-7 in float) made only of
+multiplies, adds and integer bit operations, which does vectorize.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef ACTIVATIONS
+#define ACTIVATIONS
+
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+
+inline double fast_exp(double x)
+{
+    /*
+    Input: x
+    Output: approximately exp(x)
+    Description:
+        x = k*ln(2) + r with k an integer and |r| <= ln(2)/2, then
+        exp(x) = 2^k * exp(r), exp(r) from a degree 7 Taylor polynomial
+        and 2^k added straight into the exponent bits.
+        Inputs are clamped to [-708, 709] (the range of normal doubles).
+    */
+    const double log2e = 1.4426950408889634;
+    const double ln2_hi = 6.93145751953125e-1, ln2_lo = 1.42860682030941723212e-6;
+    const double shift = 6755399441055744.0; // 1.5*2^52, rounds to an integer
+
+    x = (x < -708.0) ? -708.0 : x;
+    x = (x > 709.0) ? 709.0 : x;
+
+    double kd = x*log2e + shift;  // k ends up in the low bits of kd
+    uint64_t ki;
+    memcpy(&ki, &kd, sizeof(ki));
+    kd -= shift;
+    const double r = (x - kd*ln2_hi) - kd*ln2_lo;
+
+    double p = 1.0 + r*(1.0 + r*(1.0/2 + r*(1.0/6 + r*(1.0/24 + r*(1.0/120
+        + r*(1.0/720 + r*(1.0/5040)))))));
+
+    uint64_t bits;
+    memcpy(&bits, &p, sizeof(bits));
+    bits += ki << 52;  // multiply by 2^k
+    memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+inline float fast_exp(float x)
+{
+    /*
+    Input: x
+    Output: approximately exp(x), in float
+    Description:
+        Same method as the double version with float constants.
+        Inputs are clamped to [-86, 88] so 2^k*exp(r) stays a normal float.
+    */
+    const float log2e = 1.44269504f;
+    const float ln2_hi = 6.93145751953125e-1f, ln2_lo = 1.428606820309417e-6f;
+    const float shift = 12582912.0f; // 1.5*2^23, rounds to an integer
+
+    x = (x < -86.0f) ? -86.0f : x;
+    x = (x > 88.0f) ? 88.0f : x;
+
+    float kd = x*log2e + shift;
+    uint32_t ki;
+    memcpy(&ki, &kd, sizeof(ki));
+    kd -= shift;
+    const float r = (x - kd*ln2_hi) - kd*ln2_lo;
+
+    float p = 1.0f + r*(1.0f + r*(1.0f/2 + r*(1.0f/6 + r*(1.0f/24 + r*(1.0f/120
+        + r*(1.0f/720 + r*(1.0f/5040)))))));
+
+    uint32_t bits;
+    memcpy(&bits, &p, sizeof(bits));
+    bits += ki << 23;  // multiply by 2^k
+    memcpy(&p, &bits, sizeof(p));
+    return p;
+}
+
+// ------------------------------ activations ------------------------------------
+//  (T is double or float, constants are converted to T so float stays float)
+
+struct act_identity
+{
+    template <class T> T operator()(const T z) const { return z; }
+};
+
+struct act_identity_deriv
+{
+    template <class T> T operator()(const T z) const { return 1; }
+};
+
+struct act_relu
+{
+    template <class T> T operator()(const T z) const { return (z > 0) ? z : T(0); }
+};
+
+struct act_relu_deriv
+{
+    template <class T> T operator()(const T z) const { return (z > 0) ? T(1) : T(0); }
+};
+
+struct act_leaky_relu
+{
+    double leak;  // slope for z <= 0
+    explicit act_leaky_relu(const double leak) : leak(leak) {}
+    template <class T> T operator()(const T z) const { return (z > 0) ? z : T(leak)*z; }
+};
+
+struct act_leaky_relu_deriv
+{
+    double leak;
+    explicit act_leaky_relu_deriv(const double leak) : leak(leak) {}
+    template <class T> T operator()(const T z) const { return (z > 0) ? T(1) : T(leak); }
+};
+
+struct act_sigmoid
+{
+    template <class T> T operator()(const T z) const { return T(1)/(T(1) + std::exp(-z)); }
+};
+
+struct act_sigmoid_deriv
+{
+    template <class T> T operator()(const T z) const
+    {
+        const T s = T(1)/(T(1) + std::exp(-z));
+        return s*(T(1) - s);
+    }
+};
+
+struct act_tanh
+{
+    template <class T> T operator()(const T z) const { return std::tanh(z); }
+};
+
+struct act_tanh_deriv
+{
+    template <class T> T operator()(const T z) const
+    {
+        const T t = std::tanh(z);
+        return T(1) - t*t;
+    }
+};
+
+struct act_fast_sigmoid
+{
+    template <class T> T operator()(const T z) const { return T(1)/(T(1) + fast_exp(-z)); }
+};
+
+struct act_fast_sigmoid_deriv
+{
+    template <class T> T operator()(const T z) const
+    {
+        const T s = T(1)/(T(1) + fast_exp(-z));
+        return s*(T(1) - s);
+    }
+};
+
+struct act_fast_tanh
+{
+    // tanh(z) = 2*sigmoid(2z) - 1
+    template <class T> T operator()(const T z) const { return T(2)/(T(1) + fast_exp(-T(2)*z)) - T(1); }
+};
+
+struct act_fast_tanh_deriv
+{
+    template <class T> T operator()(const T z) const
+    {
+        const T t = T(2)/(T(1) + fast_exp(-T(2)*z)) - T(1);
+        return T(1) - t*t;
+    }
+};
+
+#endif
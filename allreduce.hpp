@@ -0,0 +1,61 @@
+/*
+allreduce.hpp
+
+Sums of per-thread partial results (gradients of the slices of a mini-batch)
+added up in an order fixed in advance, so the total has the same bits no
+matter how many threads computed the parts or which finished first.
+
+    tree_reduce(n, grain, add):
+        add(i, j) adds part j into part i, for a binary tree over parts
+        0..n-1: first (0,1), (2,3), (4,5), ..., then (0,2), (4,6), ...,
+        then (0,4), ... until part 0 holds the sum of all of them. The
+        pairs of one level are independent and go to the thread pool
+        (at least grain pairs per thread), the levels run one after another.
+    add_into(a, b):
+        a = a + b, element by element, the usual add for tree_reduce()
+
+Floating point addition isn't associative, so a sum over a different tree
+(or in the order the threads happen to finish) can differ in the last bits.
+Here the tree depends only on n: cut the work into the same parts, whatever
+the thread count, and the result is reproducible. The pairwise order also
+keeps the rounding error down to O(log n) additions per element, where a
+running sum would have O(n).
+
+Every thread can read the sum from part 0 once tree_reduce() returns, which
+is all an all-reduce has to do when the threads share memory.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef ALLREDUCE
+#define ALLREDUCE
+
+#include "arrayt.hpp"
+#include "threadpool.hpp"
+
+using namespace std;
+
+template <class F>
+void tree_reduce(const int n, const int grain, F add)
+{
+    for(int stride=1; stride < n; stride *= 2)
+    {
+        // pairs (k*2*stride, k*2*stride + stride), the last part may have no partner
+        const int n_pairs = (n - stride + 2*stride - 1)/(2*stride);
+        parallel_for(n_pairs, grain, [&](const int k0, const int k1)
+        {
+            for(int k=k0; k < k1; k++) add(2*stride*k, 2*stride*k + stride);
+        });
+    }
+}
+
+template <class T>
+inline void add_into(arrayt<T>& a, const arrayt<T>& b)
+{
+    T *pa = a.data();
+    const T *pb = b.data();
+    for(int i=0; i < a.n(); i++) pa[i] += pb[i];
+}
+
+#endif
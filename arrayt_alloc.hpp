@@ -0,0 +1,272 @@
+/* ---------------- arrayt_alloc.hpp -----------------------
+
+   storage for arrayt (arrayt.hpp or bigarrayt.hpp)
+
+   every block is aligned to ARRAYT_ALIGN bytes and comes from the
+   allocator that is current in this thread when it is allocated:
+
+     heap (the default)  : aligned malloc()/free()
+     arrayt_arena        : bump allocator, free does nothing, reset()
+                           makes all of it available again
+     arrayt_pool         : free lists of power of 2 size classes,
+                           freed blocks are kept for reuse
+
+   a block remembers where it came from (in a small header just
+   in front of it) so it is always given back to the right place
+
+   usage:
+
+     arrayt_arena arena;
+     for( ... ) {
+         arena.reset();                  // everything from the last step is gone
+         arrayt_use_allocator use( arena );
+         ... arrays made here come from the arena ...
+     }
+
+   arrayt_stats() counts every allocation and free in this thread,
+   by kind, so a program can check that a loop running on an arena or pool does
+   not touch the heap at all once it has warmed up
+
+  NOTE: an array that comes from an arena or pool must be gone before
+      the arena is reset or destroyed (or the pool destroyed); keep
+      long lived arrays (weights etc.) out of the scope that uses them
+
+  NOTE: the current allocator is per thread, the arena and pool
+      themselves are not thread safe, use one per thread
+
+  -------------------------------------------------
+
+   started 16-oct-2026 cf
+*/
+
+#ifndef ARRAYT_ALLOC_HPP
+#define ARRAYT_ALLOC_HPP
+
+// storage is aligned to this many bytes (a power of 2, at least
+//   sizeof(void*)), 64 = one cache line = one AVX-512 register
+#ifndef ARRAYT_ALIGN
+#define ARRAYT_ALIGN 64
+#endif
+
+#include <cstdlib>
+#include <cstddef>
+#include <iostream>	//  stream IO
+#ifdef _WIN32
+#include <malloc.h>	// for _aligned_malloc()
+#endif
+
+using namespace std;
+
+//--- allocation counters ------------------------------------------
+
+struct arrayt_counters {
+	long heap_allocs, heap_frees;		// calls to the system allocator
+	long arena_allocs, pool_allocs;		// served by an arena or a pool
+	long pool_reuses;					// pool allocations served from a free list
+};
+
+inline arrayt_counters& arrayt_stats()
+{
+	static thread_local arrayt_counters c = { 0, 0, 0, 0, 0 };
+	return c;
+}
+
+//--- raw aligned memory ----------------------------------------------
+
+inline void* arrayt_heap_alloc( const size_t bytes )
+{
+	void *v = NULL;
+#ifdef _WIN32
+	v = _aligned_malloc( bytes, ARRAYT_ALIGN );
+#else
+	if( posix_memalign( &v, ARRAYT_ALIGN, bytes ) != 0 ) v = NULL;
+#endif
+	if( NULL == v ) {
+		cout << "Cannot allocate memory for arrayt, bytes = " << bytes << endl;
+		exit( EXIT_FAILURE );
+	}
+	arrayt_stats().heap_allocs++;
+	return v;
+}
+
+inline void arrayt_heap_free( void *v )
+{
+	arrayt_stats().heap_frees++;
+#ifdef _WIN32
+	_aligned_free( v );
+#else
+	free( v );
+#endif
+}
+
+//--- allocator interface -------------------------------------------
+
+class arrayt_allocator {
+public:
+	virtual ~arrayt_allocator() { }
+	// bytes is the whole block including the header, result aligned to ARRAYT_ALIGN
+	virtual void* allocate( const size_t bytes ) = 0;
+	virtual void deallocate( void *v, const size_t bytes ) = 0;
+};
+
+//  every block starts with one ARRAYT_ALIGN sized header
+struct arrayt_block {
+	arrayt_allocator *owner;	// NULL = heap
+	size_t bytes;				// size of the whole block
+};
+
+inline arrayt_allocator*& arrayt_current_allocator()
+{
+	// allocator used by arrayt_alloc() in this thread, NULL = heap
+	static thread_local arrayt_allocator *a = NULL;
+	return a;
+}
+
+//  sets the current allocator for the life of this object
+class arrayt_use_allocator {
+public:
+	arrayt_use_allocator( arrayt_allocator &a ) : old( arrayt_current_allocator() )
+		{ arrayt_current_allocator() = &a; }
+	~arrayt_use_allocator() { arrayt_current_allocator() = old; }
+private:
+	arrayt_allocator *old;
+	arrayt_use_allocator( const arrayt_use_allocator& );
+	arrayt_use_allocator& operator=( const arrayt_use_allocator& );
+};
+
+//--- storage for arrayt -------------------------------------------
+//
+//  raw memory, so T should be a plain data type (memcpy() is used
+//  to copy it anyway)
+//
+template < class T >
+inline T* arrayt_alloc( const int n )
+{
+	const size_t bytes = ARRAYT_ALIGN + n*sizeof(T);
+	arrayt_allocator *a = arrayt_current_allocator();
+	char *v = (char*) ( (a == NULL) ? arrayt_heap_alloc( bytes ) : a->allocate( bytes ) );
+	arrayt_block *b = (arrayt_block*) v;
+	b->owner = a;
+	b->bytes = bytes;
+	return (T*) ( v + ARRAYT_ALIGN );
+}
+
+inline void arrayt_free( void *p )
+{
+	if( NULL == p ) return;
+	char *v = (char*) p - ARRAYT_ALIGN;
+	arrayt_block *b = (arrayt_block*) v;
+	if( NULL == b->owner ) arrayt_heap_free( v );
+	else b->owner->deallocate( v, b->bytes );
+}
+
+//--- bump arena -----------------------------------------------------
+
+class arrayt_arena : public arrayt_allocator {
+public:
+	//  starts with one chunk of the given size (bytes), grows as needed
+	arrayt_arena( const size_t chunk=1<<20 ) : size( chunk ), used( 0 ), overflow( 0 ), extra( NULL )
+		{ base = (char*) arrayt_heap_alloc( size ); }
+	~arrayt_arena() { release_extra(); arrayt_heap_free( base ); }
+
+	void* allocate( const size_t bytes ) {
+		const size_t n = round( bytes );
+		arrayt_stats().arena_allocs++;
+		if( used + n <= size ) {
+			void *v = base + used;
+			used += n;
+			return v;
+		}
+		// out of room: take a separate chunk for now, and remember how
+		//   much we needed so reset() can make the main chunk big enough
+		overflow += n;
+		chunk *c = (chunk*) arrayt_heap_alloc( ARRAYT_ALIGN + n );
+		c->next = extra;
+		extra = c;
+		return (char*) c + ARRAYT_ALIGN;
+	}
+	void deallocate( void*, size_t ) { }
+
+	//  everything allocated so far is gone
+	void reset() {
+		if( extra != NULL ) {
+			release_extra();
+			arrayt_heap_free( base );
+			size = 2*(size + overflow);
+			base = (char*) arrayt_heap_alloc( size );
+		}
+		used = overflow = 0;
+	}
+
+	size_t capacity() const { return size; }
+	size_t in_use() const { return used + overflow; }
+
+private:
+	struct chunk { chunk *next; };
+	char *base;
+	size_t size, used, overflow;
+	chunk *extra;
+
+	static size_t round( const size_t bytes )
+		{ return (bytes + ARRAYT_ALIGN-1) & ~(size_t) (ARRAYT_ALIGN-1); }
+	void release_extra() {
+		while( extra != NULL ) {
+			chunk *c = extra;
+			extra = c->next;
+			arrayt_heap_free( c );
+		}
+	}
+	arrayt_arena( const arrayt_arena& );
+	arrayt_arena& operator=( const arrayt_arena& );
+};
+
+//--- size classed pool ------------------------------------------------
+
+class arrayt_pool : public arrayt_allocator {
+public:
+	arrayt_pool() { for( int i=0; i<NCLASS; i++) freelist[i] = NULL; }
+	~arrayt_pool() { trim(); }
+
+	void* allocate( const size_t bytes ) {
+		const int c = size_class( bytes );
+		arrayt_stats().pool_allocs++;
+		if( freelist[c] != NULL ) {
+			node *v = freelist[c];
+			freelist[c] = v->next;
+			arrayt_stats().pool_reuses++;
+			return v;
+		}
+		return arrayt_heap_alloc( class_bytes( c ) );
+	}
+	void deallocate( void *v, const size_t bytes ) {
+		const int c = size_class( bytes );
+		node *f = (node*) v;
+		f->next = freelist[c];
+		freelist[c] = f;
+	}
+
+	//  give all cached blocks back to the heap
+	void trim() {
+		for( int i=0; i<NCLASS; i++) while( freelist[i] != NULL ) {
+			node *v = freelist[i];
+			freelist[i] = v->next;
+			arrayt_heap_free( v );
+		}
+	}
+
+private:
+	enum { NCLASS = 48 };		// 64 bytes ... 2^53 bytes
+	struct node { node *next; };
+	node *freelist[NCLASS];
+
+	static int size_class( size_t bytes ) {
+		int c = 0;
+		while( class_bytes( c ) < bytes ) c++;
+		return c;
+	}
+	static size_t class_bytes( const int c ) { return ((size_t) 64) << c; }
+	arrayt_pool( const arrayt_pool& );
+	arrayt_pool& operator=( const arrayt_pool& );
+};
+
+#endif  // ARRAYT_ALLOC_HPP
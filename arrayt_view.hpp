@@ -0,0 +1,159 @@
+/* ---------------- arrayt_view.hpp -----------------------
+
+   non-owning 2D view (pointer, shape, strides) into the storage
+   of an arrayt, so part of an array (a row, a block of rows, a
+   column) can be handed to the kernels in matrix.hpp without
+   allocating or copying anything
+
+   element (i,j) of a view is at data()[ i*s1() + j*s2() ]
+
+   works with either arrayt.hpp or bigarrayt.hpp (uses only the
+   public interface of arrayt)
+
+   define the symbol ARRAYT_BOUNDS_CHECK before including this
+   file to enable bounds checking
+
+  ----------------------------------------------
+
+   functions:
+	n1(), n2() = return dimensions of the view
+	s1(), s2() = return strides (in elements) of each dimension
+	n()    = return total size
+	data() = return pointer to element (0,0)
+
+  arrayt_view<T>( a )     : view of all of arrayt a, a 1D array of size n
+                              is seen as an n x 1 column vector
+  arrayt_view<T>( p, n1, n2, s1, s2 ) : view of raw memory
+  arrayt_view<T>()        : empty view (0 x 0), to be assigned later
+
+  v(i,j)    : reference to element i,j
+  v(i)      : reference to element i of a vector (n x 1 or 1 x n) view
+
+  view_row( a, i )      : row i of matrix a, as an n2 x 1 column vector
+  view_rows( a, i, n )  : rows i to i+n-1 of matrix a, n x n2
+  view_col( a, j )      : column j of matrix a, as an n1 x 1 vector
+  (a may also be a view, e.g. of a mapped dataset, see dataset.hpp)
+
+  NOTE: a view does not keep the array alive, it must not outlive
+      it (or be used after the array is resized or moved from)
+
+  -------------------------------------------------
+
+   started 16-oct-2026 cf
+   add empty view and views of part of a view cf
+*/
+
+#ifndef ARRAYT_VIEW_HPP
+#define ARRAYT_VIEW_HPP
+
+#include "arrayt.hpp"
+
+//--- class definition -------------------------------------------
+
+template < class T >
+class arrayt_view {
+public:
+	// constructor functions
+	arrayt_view( ) : p(NULL), nn1(0), nn2(0), ss1(0), ss2(0) { }
+	arrayt_view( T *p, const int n1, const int n2, const long s1, const long s2 )
+		: p(p), nn1(n1), nn2(n2), ss1(s1), ss2(s2) { }
+	arrayt_view( arrayt<T> &a )		// whole array
+		: p(a.data()), nn1(a.n1()), nn2(a.ndim()==1 ? 1 : a.n2()),
+		  ss1(a.ndim()==1 ? 1 : a.n2()), ss2(1) { }
+
+	// member operations
+	inline T& operator()( const int i1, const int i2 ) const;		// matrix
+	inline T& operator()( const int i ) const;						// vector
+
+	// extra functions
+	inline int n1() const { return nn1; }
+	inline int n2() const { return nn2; }
+	inline long s1() const { return ss1; }
+	inline long s2() const { return ss2; }
+	inline int n() const { return nn1*nn2; }
+	inline T* data() const { return p; }
+
+private:
+	T *p;					// element (0,0), not owned
+	int nn1, nn2;			// size of each dimension
+	long ss1, ss2;			// stride of each dimension
+};
+
+// ------- member function operator () = 2D index
+template < class T >
+inline T& arrayt_view<T>::operator()( const int i1, const int i2 ) const
+{
+#ifdef ARRAYT_BOUNDS_CHECK
+	if( (i1<0) || (i1>=nn1) || (i2<0) || (i2>=nn2) ){
+		cout << "out of bounds index in arrayt_view\n"
+			<< "  size = " << nn1 << " x " << nn2 << "\n"
+			<< "  access = ("<< i1 << ", " << i2 << ")" << endl;
+		exit( EXIT_FAILURE );
+	}
+#endif
+	return *(p + i1*ss1 + i2*ss2);
+}
+
+// ------- member function operator () = 1D index
+//    along whichever dimension is not 1
+template < class T >
+inline T& arrayt_view<T>::operator()( const int i ) const
+{
+#ifdef ARRAYT_BOUNDS_CHECK
+	if( (i<0) || (i>=nn1*nn2) || ((nn1 != 1) && (nn2 != 1)) ){
+		cout << "out of bounds index in arrayt_view\n"
+			<< "  size = " << nn1 << " x " << nn2 << "\n"
+			<< "  access = " << i << endl;
+		exit( EXIT_FAILURE );
+	}
+#endif
+	return (nn2 == 1) ? *(p + i*ss1) : *(p + i*ss2);
+}
+
+//--- views of part of an arrayt -------------------------------------
+
+template < class T >
+inline arrayt_view<T> view_row( arrayt<T> &a, const int i )
+{
+	// row i of a 2D array as a column vector
+	return arrayt_view<T>( a.data() + (long) i*a.n2(), a.n2(), 1, 1, 1 );
+}
+
+template < class T >
+inline arrayt_view<T> view_rows( arrayt<T> &a, const int i, const int n )
+{
+	// n consecutive rows of a 2D array starting at row i
+	return arrayt_view<T>( a.data() + (long) i*a.n2(), n, a.n2(), a.n2(), 1 );
+}
+
+template < class T >
+inline arrayt_view<T> view_col( arrayt<T> &a, const int j )
+{
+	// column j of a 2D array as a column vector
+	return arrayt_view<T>( a.data() + j, a.n1(), 1, a.n2(), 1 );
+}
+
+//--- views of part of a view -------------------------------------
+
+template < class T >
+inline arrayt_view<T> view_row( const arrayt_view<T> &v, const int i )
+{
+	// row i of a view as a column vector
+	return arrayt_view<T>( v.data() + i*v.s1(), v.n2(), 1, v.s2(), 1 );
+}
+
+template < class T >
+inline arrayt_view<T> view_rows( const arrayt_view<T> &v, const int i, const int n )
+{
+	// n consecutive rows of a view starting at row i
+	return arrayt_view<T>( v.data() + i*v.s1(), n, v.n2(), v.s1(), v.s2() );
+}
+
+template < class T >
+inline arrayt_view<T> view_col( const arrayt_view<T> &v, const int j )
+{
+	// column j of a view as a column vector
+	return arrayt_view<T>( v.data() + j*v.s2(), v.n1(), 1, v.s1(), 1 );
+}
+
+#endif  // ARRAYT_VIEW_HPP
@@ -0,0 +1,206 @@
+/*
+bench_csv.cpp
+
+Benchmarks for loading the training data.
+
+    load: the original getline / istringstream / stod loop from prepocess()
+          against load_csv() in csv.hpp, on 1 thread up to the number of
+          hardware threads (or the number given on the command line), in
+          MB/s and rows/s, with the speedup over the original loop and
+          load_csv() on 1 thread
+    stats: load_csv() also gathering the mean, variance, min and max of
+          every column (feature_stats.hpp), and standardize() afterwards
+    binary: the same data written by write_dataset() (dataset.hpp) and
+          opened as a zero copy view, the time to open it and the time to
+          open it and read every value once
+    cache: cached_csv (csv_cache.hpp), the first open (parse, hash and
+          write the cache) and a later one (check the hash and map it)
+
+The data is a synthetic file of rows of 10 doubles, like x_prep.txt, of
+the size in MB given as the second argument (default 256), written to
+bench_csv.tmp (and bench_csv.nnd, bench_csv.tmp.nnd) in the current
+directory and deleted at the end.
+
+    bench_csv [max threads] [MB]
+
+Compile with optimization, e.g.
+    g++ -std=c++17 -O3 -march=native -pthread -o bench_csv bench_csv.cpp
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#include <cstdlib>
+#include <cstdio>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include "matrix.hpp"
+#include "csv.hpp"
+#include "dataset.hpp"
+#include "csv_cache.hpp"
+#include "feature_stats.hpp"
+
+typedef arrayt<double> mdoub;
+
+const char *bench_file = "bench_csv.tmp", *bench_binary = "bench_csv.nnd";
+
+double now()
+{
+    // wall clock time in seconds
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+long write_data(const double mb)
+{
+    // rows of 10 values in [-3, 3) with 17 significant digits, returns the row count
+    FILE *fp = fopen(bench_file, "wb");
+    if (fp == NULL){
+        cout << "can't write " << bench_file << endl;
+        exit(EXIT_FAILURE);
+    }
+    unsigned int seed = 1;
+    long rows = 0;
+    double bytes = 0.0;
+    while (bytes < mb*1e6)
+    {
+        for(int j=0; j < 10; j++)
+        {
+            seed = 1372383749u*seed + 1289706101u;
+            bytes += fprintf(fp, j < 9 ? "%.17g," : "%.17g\n", 6.0*(seed/4294967296.0 - 0.5));
+        }
+        rows++;
+    }
+    fclose(fp);
+    return rows;
+}
+
+void load_reference(mdoub& xTr)
+{
+    // the original loop from prepocess(), xTr must already have the right shape
+    ifstream infile( bench_file );
+
+    int count = 0, max = xTr.n1();
+    while (infile)
+    {
+        string s;
+        if (!getline( infile, s )) break;
+
+        istringstream ss( s );
+
+        int idx = 0;
+        while (ss)
+        {
+            string s;
+            if (!getline( ss, s, ',' )) break;
+            xTr(count, idx) = stod(s); // stod -> string to double
+            idx += 1;
+        }
+        count += 1;
+        if (count == max) break;
+    }
+    infile.close();
+}
+
+int next_threads(const int p, const int max_threads)
+{
+    // 1, 2, 4, ... and finally max_threads
+    return (2*p < max_threads) ? 2*p : max_threads;
+}
+
+void report(const char *name, const double t, const double bytes, const long rows,
+    const double t_ref, const double t1)
+{
+    // ms, MB/s (of csv text), M rows/s and speedups for one run of t seconds
+    cout << setw(18) << name << setw(10) << t*1e3 << setw(12) << bytes/t*1e-6
+        << setw(10) << rows/t*1e-6 << setw(11) << t_ref/t << "x";
+    if (t1 > 0) cout << setw(11) << t1/t << "x";
+    cout << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const int max_threads = (argc > 1) ? atoi(argv[1]) : default_num_threads();
+    const double mb = (argc > 2) ? atof(argv[2]) : 256.0;
+
+    const long rows = write_data(mb);
+
+    // a first read so every run finds the file in the page cache
+    mdoub x;
+    csv_stats stats;
+    load_csv(bench_file, x, stats);
+    const double bytes = (double) stats.bytes;
+
+    cout << "load: " << rows << " x 10 doubles (" << setprecision(4) << bytes*1e-6
+        << " MB of text), ms, MB/s, M rows/s, speedup over the original loop and over 1 thread" << endl;
+    cout << setw(18) << "" << setw(10) << "ms" << setw(12) << "MB/s" << setw(10) << "Mrows/s"
+        << setw(12) << "loop" << setw(12) << "p = 1" << endl;
+    cout << fixed << setprecision(2);
+
+    mdoub ref(rows, 10);
+    double t = now();
+    load_reference(ref);
+    const double t_ref = now() - t;
+    report("original loop", t_ref, bytes, rows, t_ref, 0.0);
+
+    double t1 = 0.0;
+    for(int p=1; ; p = next_threads(p, max_threads))
+    {
+        set_num_threads(p);
+        load_csv(bench_file, x, stats);
+        if (p == 1) t1 = stats.seconds;
+        const string name = "load_csv p = " + to_string(p);
+        report(name.c_str(), stats.seconds, bytes, rows, t_ref, t1);
+        if (memcmp(x.data(), ref.data(), x.n()*sizeof(double)) != 0) cout << "  (differs from the original loop)" << endl;
+        if (p == max_threads) break;
+    }
+
+    // column statistics in the same pass as parsing, then standardizing in place
+    feature_stats fs;
+    load_csv(bench_file, x, stats, &fs);
+    report("load_csv + stats", stats.seconds, bytes, rows, t_ref, t1);
+    t = now();
+    standardize(arrayt_view<double>(x), fs);
+    report("standardize", now() - t, bytes, rows, t_ref, t1);
+    cout << "  (column 0: mean " << fs[0].mean << ", stddev " << fs[0].stddev() << ")" << endl;
+    load_csv(bench_file, x, stats);
+
+    // binary dataset, the page cache is warm after writing it
+    write_dataset(bench_binary, x, arrayt_view<double>(), vector<string>());
+    dataset d;
+    t = now();
+    d.open(bench_binary);
+    arrayt_view<double> xv = d.x<double>();
+    const double t_open = now() - t;
+    d.close();
+    t = now();
+    d.open(bench_binary);
+    xv = d.x<double>();
+    double sum = 0.0;
+    for(int i=0; i < xv.n1(); i++)
+        for(int j=0; j < xv.n2(); j++) sum += xv(i, j);
+    const double t_read = now() - t;
+    report("binary, open", t_open, bytes, rows, t_ref, t1);
+    report("binary, read all", t_read, bytes, rows, t_ref, t1);
+    cout << "  (" << d.bytes()*1e-6 << " MB on disk, checksum " << sum << ")" << endl;
+    d.close();
+
+    // csv cache, the first open writes it, the second maps it
+    cached_csv<double> c;
+    remove(c.cache_path().c_str());
+    c.open(bench_file);
+    report("cache, first open", c.stats().seconds, bytes, rows, t_ref, t1);
+    c.open(bench_file);
+    report("cache, later open", c.stats().seconds, bytes, rows, t_ref, t1);
+    if (!c.cached()) cout << "  (the cache wasn't used)" << endl;
+    const string cache = c.cache_path();
+    c.close();
+
+    remove(bench_file);
+    remove(bench_binary);
+    remove(cache.c_str());
+    return(EXIT_SUCCESS);
+}
@@ -0,0 +1,471 @@
+/*
+bench_matrix.cpp
+
+Benchmarks for the kernels in matrix.hpp.
+
+    gemm: dot() against the original i-j-k triple loop, square and
+          tall-skinny shapes, reported in GFLOP/s
+    elementwise: '+', '-', multiply() and scalar '*' for every SIMD level
+          the CPU supports, in GB/s, checked bit for bit against scalar
+    activations: applyFunction() with a function pointer (the old interface)
+          against the inlined functors in activations.hpp, in Gelem/s, and
+          the error of the fast_ approximations
+    transpose: transpose() and transposeInPlace() against the original
+          element by element loop on square matrices from 16 x 16 to
+          8192 x 8192, in GB/s on one thread
+    precision: dot(), a + b and applyFunction() on arrayt<float> against
+          arrayt<double>, in GFLOP/s or Gelem/s
+    batch: forward and back prop of a 10-n-1 network (dense_forward_batch
+          and dense_backward) over 16384 examples in batches of 1 to 1024
+          rows, in M examples/s and speedup over batches of 1
+    threads: strong scaling of dot(), transpose(), multiply(), '+' and a
+          fused expression on fixed sizes from 1 thread up to the number of
+          hardware threads (or the number given on the command line), as
+          time per call, speedup over 1 thread and parallel efficiency
+
+Compile with optimization, e.g.
+    g++ -std=c++17 -O3 -march=native -pthread -o bench_matrix bench_matrix.cpp
+(GCC at -O2 does not vectorize the applyFunction loops)
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include "matrix.hpp"
+
+typedef arrayt<double> mdoub;
+typedef arrayt<float> mfloat;
+
+double now()
+{
+    // wall clock time in seconds
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void fill(mdoub& a, unsigned int seed)
+{
+    // fill with values in [-0.5, 0.5)
+    for(int i=0; i < a.n(); i++)
+    {
+        seed = 1372383749u*seed + 1289706101u;
+        a.data()[i] = seed/4294967296.0 - 0.5;
+    }
+}
+
+mdoub dot_reference(mdoub& a, mdoub& b)
+{
+    // the original dot() loop from matrix.hpp, kept here as the baseline
+    const int a_r = a.n1(), a_c = a.n2(), b_c = b.n2();
+    mdoub product(a_r, b_c);
+
+    for(int i=0; i < a_r; i++)
+    {
+        for(int j=0; j < b_c; j++)
+        {
+            product(i, j) = 0.0;
+            for(int k=0; k < a_c; k++)
+            {
+                product(i,j) += a(i, k)*b(k, j);
+            }
+        }
+    }
+    return product;
+}
+
+mdoub transpose_reference(mdoub& x)
+{
+    // the original transpose() loop from matrix.hpp
+    const int r = x.n1(), c = x.n2();
+    mdoub xT(c, r);
+    for(int i=0; i < r; i++)
+    {
+        for(int j=0; j < c; j++)
+        {
+            xT(j, i) = x(i, j);
+        }
+    }
+    return xT;
+}
+
+double max_diff(mdoub& a, mdoub& b)
+{
+    double d = 0.0;
+    for(int i=0; i < a.n(); i++) d = fmax(d, fabs(a.data()[i] - b.data()[i]));
+    return d;
+}
+
+void bench_gemm(const int m, const int k, const int n)
+{
+    // time C(m x n) = A(m x k) B(k x n) both ways, repeat until ~0.2 s has passed
+    mdoub a(m, k), b(k, n);
+    fill(a, 1);
+    fill(b, 2);
+    const double flops = 2.0*m*n*k;
+
+    double t0 = now(), t, t_ref, t_dot;
+    int reps = 0;
+    mdoub c_ref = dot_reference(a, b);
+    do { c_ref = dot_reference(a, b); reps++; t = now(); } while (t - t0 < 0.2);
+    t_ref = (t - t0)/reps;
+
+    t0 = now(); reps = 0;
+    mdoub c = dot(a, b);
+    do { c = dot(a, b); reps++; t = now(); } while (t - t0 < 0.2);
+    t_dot = (t - t0)/reps;
+
+    cout << setw(6) << m << " x" << setw(6) << k << " x" << setw(6) << n
+        << setw(12) << flops/t_ref*1e-9
+        << setw(12) << flops/t_dot*1e-9
+        << setw(10) << t_ref/t_dot
+        << setw(14) << max_diff(c, c_ref) << endl;
+}
+
+bool same_bits(mdoub& a, mdoub& b)
+{
+    return memcmp(a.data(), b.data(), a.n()*sizeof(double)) == 0;
+}
+
+void bench_elementwise(const int n)
+{
+    // time each element-wise op at each SIMD level on n x 1 vectors
+    mdoub a(n, 1), b(n, 1);
+    fill(a, 3);
+    fill(b, 4);
+    const char *ops[] = {"+", "-", "multiply", "s*a"};
+
+    simd_set_level(SIMD_SCALAR);
+    mdoub ref[4] = { a + b, a - b, multiply(a, b), 0.37*a };
+
+    for(int op=0; op < 4; op++)
+    {
+        cout << setw(9) << n << setw(10) << ops[op];
+        for(int level=SIMD_SCALAR; level <= SIMD_AVX512; level++)
+        {
+            if (level > simd_cpu_level()){
+                cout << setw(12) << "-";
+                continue;
+            }
+            simd_set_level((simd_level) level);
+            mdoub c(n, 1);
+            double t0 = now(), t;
+            int reps = 0;
+            do {
+                if (op == 0) c = a + b;
+                else if (op == 1) c = a - b;
+                else if (op == 2) c = multiply(a, b);
+                else c = 0.37*a;
+                reps++;
+                t = now();
+            } while (t - t0 < 0.1);
+            const double bytes = (op == 3 ? 2.0 : 3.0)*n*sizeof(double);
+            cout << setw(11) << bytes*reps/(t - t0)*1e-9 << (same_bits(c, ref[op]) ? " " : "!");
+        }
+        cout << endl;
+    }
+    simd_set_level(SIMD_AVX512);  // back to the best available
+}
+
+double leaky_ReLU_ptr(double z) { return (z > 0) ? z : 0.5*z; }
+double sigmoid_ptr(double z) { return 1.0/(1.0 + exp(-z)); }
+double tanh_ptr(double z) { return tanh(z); }
+
+template <class F>
+double time_apply(F f, mdoub& a, mdoub& out)
+{
+    // elements per second (billions) for applyFunction(f, a, out),
+    //   in batches of 100 calls so reading the clock doesn't count
+    double t0 = now(), t;
+    int reps = 0;
+    do {
+        for(int r=0; r < 100; r++) applyFunction(f, a, out);
+        reps += 100;
+        t = now();
+    } while (t - t0 < 0.1);
+    return (double) a.n()*reps/(t - t0)*1e-9;
+}
+
+void bench_activation(const char *name, double (*volatile *ptr_opaque)(double),
+    mdoub& a, mdoub& out, mdoub& ref, double rate_functor)
+{
+    // function pointer the compiler can't see through (like the old applyFunction)
+    double t0 = now(), t;
+    int reps = 0;
+    do {
+        for(int r=0; r < 100; r++)
+        {
+            double (*f)(double) = *ptr_opaque;
+            for(int i=0; i < a.n(); i++) ref.data()[i] = f(a.data()[i]);
+        }
+        reps += 100;
+        t = now();
+    } while (t - t0 < 0.1);
+    const double rate_ptr = (double) a.n()*reps/(t - t0)*1e-9;
+
+    double err = 0.0;
+    for(int i=0; i < a.n(); i++)
+        err = fmax(err, fabs(out.data()[i] - ref.data()[i])/fmax(fabs(ref.data()[i]), 1e-300));
+    cout << setw(16) << name << setw(12) << rate_ptr << setw(12) << rate_functor
+        << setw(14) << err << endl;
+}
+
+template <class F>
+double time_op(F op)
+{
+    // seconds per call of op(), repeated until ~0.2 s has passed,
+    //   in batches of at least 1 ms so reading the clock doesn't count
+    op();
+    int batch = 1;
+    double t0 = now(), t;
+    for(;;)
+    {
+        for(int r=0; r < batch; r++) op();
+        t = now();
+        if (t - t0 > 1e-3) break;
+        batch *= 2;
+        t0 = t;
+    }
+    t0 = now();
+    int reps = 0;
+    do {
+        for(int r=0; r < batch; r++) op();
+        reps += batch;
+        t = now();
+    } while (t - t0 < 0.2);
+    return (t - t0)/reps;
+}
+
+int next_threads(const int p, const int max_threads)
+{
+    // 1, 2, 4, ... and finally max_threads
+    return (2*p < max_threads) ? 2*p : max_threads;
+}
+
+void bench_scaling(const char *name, const int max_threads, void (*op)())
+{
+    // time per call on 1 thread, then speedup (and efficiency) on more
+    cout << setw(18) << name;
+    double t1 = 0.0;
+    for(int p=1; ; p = next_threads(p, max_threads))
+    {
+        set_num_threads(p);
+        const double t = time_op(op);
+        if (p == 1){
+            t1 = t;
+            cout << setw(10) << t*1e3;
+        }
+        else cout << setw(8) << t1/t << "x (" << setw(3) << (int) (100*t1/t/p) << "%)";
+        if (p == max_threads) break;
+    }
+    cout << endl;
+}
+
+// operands for the transpose runs
+mdoub ta, tb;
+void op_transpose_ref() { tb = transpose_reference(ta); }
+void op_transpose_new() { tb = transpose(ta); }
+void op_transpose_in_place() { transposeInPlace(ta); }
+
+void bench_transpose(const int n)
+{
+    // GB/s counting one read and one write of every element
+    ta.resize(n, n);
+    fill(ta, 17);
+    mdoub ref = transpose_reference(ta);
+    tb = transpose(ta);
+    bool ok = same_bits(tb, ref);
+    transposeInPlace(ta);
+    ok = ok && same_bits(ta, ref);
+
+    const double bytes = 2.0*n*n*sizeof(double);
+    const double t_ref = time_op(op_transpose_ref), t_new = time_op(op_transpose_new);
+    const double t_in = time_op(op_transpose_in_place);
+    cout << setw(6) << n << " x" << setw(6) << n
+        << setw(12) << bytes/t_ref*1e-9 << setw(12) << bytes/t_new*1e-9
+        << setw(12) << bytes/t_in*1e-9 << setw(10) << t_ref/t_new
+        << (ok ? "" : "  differs") << endl;
+}
+
+// operands for the precision runs
+mdoub pa, pb, pc;
+mfloat fa, fb, fc;
+void op_dot_d() { pc = dot(pa, pb); }
+void op_dot_f() { fc = dot(fa, fb); }
+void op_add_d() { pc = pa + pb; }
+void op_add_f() { fc = fa + fb; }
+void op_sigmoid_d() { applyFunctionInPlace(act_fast_sigmoid(), pc); }
+void op_sigmoid_f() { applyFunctionInPlace(act_fast_sigmoid(), fc); }
+
+void bench_precision(const char *name, const double work, void (*op_d)(), void (*op_f)())
+{
+    // work = flops or elements per call
+    const double rate_d = work/time_op(op_d)*1e-9, rate_f = work/time_op(op_f)*1e-9;
+    cout << setw(22) << name << setw(12) << rate_d << setw(12) << rate_f
+        << setw(10) << rate_f/rate_d << endl;
+}
+
+// operands for the batch runs: data, weights and layer buffers
+mdoub bx, by, bw0, bw1, bz, bh, byh, bd1, bd2, bg0, bg1;
+int batch_rows;
+void op_batch()
+{
+    // one pass over the data, batch_rows examples at a time
+    for(int r=0; r < bx.n1(); r += batch_rows)
+    {
+        const int n = min(batch_rows, bx.n1() - r);
+        const arrayt_view<double> x = view_rows(bx, r, n);
+        const arrayt_view<double> z = view_rows(bz, 0, n), h = view_rows(bh, 0, n);
+        const arrayt_view<double> y = view_rows(byh, 0, n);
+        const arrayt_view<double> d1 = view_rows(bd1, 0, n), d2 = view_rows(bd2, 0, n);
+        dense_forward_batch(bw0, x, 1.0, act_leaky_relu(0.5), h, z);
+        dense_forward_batch(bw1, h, 1.0, act_identity(), y, y);
+        for(int i=0; i < n; i++) d2(i, 0) = (y(i, 0) - by(r + i, 0))/n;
+        dense_backward(bw1, h, 1.0, d2, bg1, d1);
+        for(int i=0; i < n; i++)
+            for(int j=0; j < d1.n2(); j++) d1(i, j) *= (z(i, j) > 0) ? 1.0 : 0.5;
+        dense_backward(bw0, x, 1.0, d1, bg0, arrayt_view<double>());
+    }
+}
+
+void bench_batch(const int n_hidden)
+{
+    const int rows = 16384;
+    bx.resize(rows, 10); by.resize(rows, 1);
+    bw0.resize(11, n_hidden); bw1.resize(n_hidden+1, 1);
+    bg0.resize(11, n_hidden); bg1.resize(n_hidden+1, 1);
+    fill(bx, 18); fill(by, 19); fill(bw0, 20); fill(bw1, 21);
+    cout << setw(8) << n_hidden;
+    double t1 = 0.0;
+    for(batch_rows=1; batch_rows <= 1024; batch_rows *= 4)
+    {
+        bz.resize(batch_rows, n_hidden); bh.resize(batch_rows, n_hidden);
+        bd1.resize(batch_rows, n_hidden); byh.resize(batch_rows, 1); bd2.resize(batch_rows, 1);
+        const double t = time_op(op_batch);
+        if (batch_rows == 1) t1 = t;
+        cout << fixed << setprecision(2) << setw(9) << rows/t*1e-6 << " (" << setw(4)
+            << setprecision(1) << t1/t << "x)" << setprecision(6) << defaultfloat;
+    }
+    cout << endl;
+}
+
+// operands for the scaling runs
+mdoub sa, sb, sc, sv, sw, sx;
+void op_dot() { sc = dot(sa, sb); }
+void op_transpose() { sc = transpose(sa); }
+void op_multiply() { sx = multiply(sv, sw); }
+void op_add() { sx = sv + sw; }
+void op_fused() { sx = sv - 0.01*sw + sx; }
+
+int main(int argc, char *argv[])
+{
+    cout << "gemm: GFLOP/s, original loop vs dot()" << endl;
+    cout << "     m x     k x     n" << setw(12) << "loop" << setw(12) << "dot"
+        << setw(10) << "speedup" << setw(14) << "max |diff|" << endl;
+
+    // square
+    const int sq[] = {32, 64, 128, 256, 512, 1024};
+    for(int i=0; i < 6; i++) bench_gemm(sq[i], sq[i], sq[i]);
+
+    // tall-skinny: many rows (examples) times a narrow weight matrix
+    bench_gemm(10000, 10, 5);
+    bench_gemm(10000, 64, 64);
+    bench_gemm(100000, 32, 16);
+    bench_gemm(64, 10000, 64);
+
+    cout << "\nelementwise: GB/s by SIMD level (! = differs from scalar), using "
+        << simd().name << endl;
+    cout << setw(9) << "n" << setw(10) << "op" << setw(12) << "scalar" << setw(12) << "sse2"
+        << setw(12) << "avx2" << setw(12) << "avx512" << endl;
+    bench_elementwise(1000);
+    bench_elementwise(100000);
+    bench_elementwise(10000000);
+
+    cout << "\nactivations: Gelem/s, n = 10000 (in cache), max rel. error vs. C library" << endl;
+    cout << setw(16) << "function" << setw(12) << "pointer" << setw(12) << "functor"
+        << setw(14) << "rel. error" << endl;
+    {
+        const int n = 10000;
+        mdoub a(n, 1), out(n, 1), ref(n, 1);
+        fill(a, 5);
+        for(int i=0; i < n; i++) a.data()[i] *= 20.0;  // z in [-10, 10)
+        double (*volatile fp)(double);
+        double rate;
+
+        fp = leaky_ReLU_ptr;
+        rate = time_apply(act_leaky_relu(0.5), a, out);
+        bench_activation("leaky_relu", &fp, a, out, ref, rate);
+        fp = sigmoid_ptr;
+        rate = time_apply(act_sigmoid(), a, out);
+        bench_activation("sigmoid", &fp, a, out, ref, rate);
+        rate = time_apply(act_fast_sigmoid(), a, out);
+        bench_activation("fast_sigmoid", &fp, a, out, ref, rate);
+        fp = tanh_ptr;
+        rate = time_apply(act_tanh(), a, out);
+        bench_activation("tanh", &fp, a, out, ref, rate);
+        rate = time_apply(act_fast_tanh(), a, out);
+        bench_activation("fast_tanh", &fp, a, out, ref, rate);
+    }
+
+    cout << "\ntranspose: GB/s on 1 thread, original loop vs transpose() and transposeInPlace()" << endl;
+    cout << "     n x     n" << setw(12) << "loop" << setw(12) << "transpose"
+        << setw(12) << "in place" << setw(10) << "speedup" << endl;
+    set_num_threads(1);
+    for(int n=16; n <= 8192; n *= 2) bench_transpose(n);
+    ta.resize(1, 1); tb.resize(1, 1);
+    set_num_threads(default_num_threads());
+
+    cout << "\nprecision: double vs float (GFLOP/s for dot, Gelem/s otherwise)" << endl;
+    cout << setw(22) << "op" << setw(12) << "double" << setw(12) << "float"
+        << setw(10) << "speedup" << endl;
+    {
+        const int sizes[] = {256, 1024};
+        for(int i=0; i < 2; i++)
+        {
+            const int n = sizes[i];
+            pa.resize(n, n); pb.resize(n, n);
+            fill(pa, 12); fill(pb, 13);
+            fa = convert<float>(pa); fb = convert<float>(pb);
+            bench_precision(n == 256 ? "dot 256^3" : "dot 1024^3", 2.0*n*n*n, op_dot_d, op_dot_f);
+        }
+        pa.resize(4000000, 1); pb.resize(4000000, 1); pc.resize(4000000, 1);
+        fill(pa, 14); fill(pb, 15);
+        fa = convert<float>(pa); fb = convert<float>(pb); fc = convert<float>(pc);
+        bench_precision("a + b 4M", 4e6, op_add_d, op_add_f);
+        pc.resize(10000, 1);
+        fill(pc, 16);
+        fc = convert<float>(pc);
+        bench_precision("fast_sigmoid 10000", 1e4, op_sigmoid_d, op_sigmoid_f);
+    }
+
+    cout << "\nbatch: M examples/s of forward and back prop through 10-n-1, (speedup over batch 1)" << endl;
+    cout << setw(8) << "n" ;
+    for(int b=1; b <= 1024; b *= 4) cout << setw(16) << ("batch " + to_string(b));
+    cout << endl;
+    bench_batch(5);
+    bench_batch(64);
+
+    const int max_threads = (argc > 1) ? atoi(argv[1]) : default_num_threads();
+    cout << "\nthreads: strong scaling, ms per call on 1 thread, speedup (efficiency) on p threads" << endl;
+    cout << setw(18) << "p =" << setw(10) << 1;
+    for(int p=1; p < max_threads; ) { p = next_threads(p, max_threads); cout << setw(16) << p; }
+    cout << endl << fixed << setprecision(2);
+    {
+        sa.resize(1024, 1024); sb.resize(1024, 1024);
+        fill(sa, 6); fill(sb, 7);
+        bench_scaling("dot 1024^3", max_threads, op_dot);
+        sa.resize(2048, 2048);
+        fill(sa, 8);
+        bench_scaling("transpose 2048^2", max_threads, op_transpose);
+        sv.resize(4000000, 1); sw.resize(4000000, 1); sx.resize(4000000, 1);
+        fill(sv, 9); fill(sw, 10); fill(sx, 11);
+        bench_scaling("multiply 4M", max_threads, op_multiply);
+        bench_scaling("a + b 4M", max_threads, op_add);
+        bench_scaling("a - s*b + c 4M", max_threads, op_fused);
+    }
+
+    return(EXIT_SUCCESS);
+}
@@ -18,6 +18,7 @@
     n4() = return 4th dimension
     ndim() = return number of dimensions
     n()    = return total size
+    data() = return pointer to the first element (row major storage)
     resize( n1, n2, ...) = change size to n1 x n2 x ... (old data is lost)
 
   -----------------------
@@ -36,12 +37,24 @@
   a1(i,j)   : reference to element i,j of 1D array (matrix) a1
                     i ranges from 0 to n1-1 and j from 0 to n2-1
 
-  a1 = a2   : a1 gets a copy of a2 (must be the same type)
+  a1 = a2   : a1 gets a copy of a2 (must be the same type), a1 is
+                    resized to the shape of a2 if they differ
+  a1 = std::move(a2) : a1 takes over the storage of a2, a2 is left empty
 
   a1 += a2  : add a2 to a1 (element by element)
 
-  NOTE:  Binary operations such as a1=a2+a3 should NOT be used because
-      they are extremely inefficient (they create temporary arrays)
+  a1[i]     : element i of the storage, read only, any number of dimensions
+
+  a1 = e    : evaluate expression e into a1 (element by element)
+
+  NOTE:  arrayt derives from arrayt_expr<> (expression templates).
+      Binary operations such as a1=a2+s*a3 (see matrix.hpp) should return
+      an arrayt_expr<> instead of an arrayt, then the whole right hand
+      side is evaluated in one loop when it is assigned, with no temporary
+      arrays.  The element type of the expression must match a1.
+      Operations that return a plain arrayt still create temporaries.
+      Expressions are 1D or 2D only, evaluating one of 3D or 4D
+      arrayts is an error (exits).
 
   -------------------------------------------------
 
@@ -75,6 +88,12 @@
    convert error messages to streams 5-oct-2014 ejk
    merge back 3D, 4D options from bigarray.hpp for next yr. 6-jan-2014 ejk
    fix bug in operator*=() 28-oct-2015 ejk
+   add data() for raw pointer kernels (gemm.hpp) cf
+   add expression template base arrayt_expr cf
+   add move constructor/assignment, size changing operator =,
+      aligned storage (ARRAYT_ALIGN) cf
+   storage from arrayt_alloc.hpp (optional arena or pool allocators) cf
+   remove register keyword (not allowed in C++17) cf
 */
 
 #ifndef ARRAYT_HPP  // only include this file if its not already
@@ -88,26 +107,53 @@
 #include <cstdlib>
 #include <cstring>  // for memcpy()
 #include <iostream> //  stream IO
+#include "arrayt_alloc.hpp" // aligned storage, arena and pool allocators
+#include <utility>  // for std::move()
 
 using namespace std;
 
+//--- expression template base ------------------------------------
+//
+//  an arrayt or an unevaluated expression of arrayts, E must provide
+//  value_type, n1(), n2(), ndim(), n() and a flat operator[];
+//  expressions carry only 2 dimensions so 3D and 4D operands are
+//  rejected when the expression is evaluated
+//
+template < class E >
+class arrayt_expr {
+public:
+    inline const E& self() const { return *static_cast<const E*>( this ); }
+};
+
+template < class T, class E >
+inline void arrayt_eval( T *p, const int n, const arrayt_expr<E> &e );
+
 //--- class definition -------------------------------------------
 
 template < class T >
-class arrayt {
+class arrayt : public arrayt_expr< arrayt<T> > {
 public:
+    typedef T value_type;
+
     // constructor functions
     arrayt( const int n1=1 );               // for 1D vector style
     arrayt( const int n1, const int n2 );   // for 2D matrix style
     arrayt( const int n1, const int n2, const int n3 );
     arrayt( const int n1, const int n2, const int n3, const int n4 );
     arrayt( const arrayt<T> &a );
+    arrayt( arrayt<T> &&a );                // move, a is left empty
+    template < class E >
+    arrayt( const arrayt_expr<E> &e );      // evaluate an expression (1D or 2D)
 
     //  destructor function
-    inline ~arrayt() { if(nn>0) delete [] p; nn=nndim=nn1=nn2=0; }
+    inline ~arrayt() { if(nn>0) arrayt_free( p ); nn=nndim=nn1=nn2=0; }
 
     // member operations
     inline arrayt<T>& operator=( const arrayt<T> &m );
+    inline arrayt<T>& operator=( arrayt<T> &&m );
+    template < class E >
+    inline arrayt<T>& operator=( const arrayt_expr<E> &e );
+    inline const T& operator[]( const int i ) const { return p[i]; }    // flat
     inline T& operator()( const int i1, const int i2);      // matrix
     inline T& operator()( const int i );                    // vector
     inline T& operator()( const int i1, const int i2,
@@ -126,6 +172,8 @@ public:
     inline int n4() const { return nn4; }
     inline int ndim() const { return nndim; }
     inline int n() const { return nn; }
+    inline T* data() { return p; }
+    inline const T* data() const { return p; }
     void resize( const int n );                  // vector
     void resize( const int n1, const int n2 );   // matrix
     void resize( const int n1, const int n2, const int n3 );         // 3D
@@ -148,7 +196,7 @@ arrayt<T>::arrayt( const int n1 )           // 1D vector
         cout << "arrayt initialized with size = " << n1 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    p = new T [ n1 ];
+    p = arrayt_alloc<T>( n1 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = " << n1 << endl;
         exit( EXIT_FAILURE );
@@ -166,7 +214,7 @@ arrayt<T>::arrayt( const int n1, const int n2 )     // 2D matrix
                 << n1 << " x " << n2 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    p = new T [ n1*n2 ];
+    p = arrayt_alloc<T>( n1*n2 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = "
                 << n1 << " x " << n2 << endl;
@@ -187,7 +235,7 @@ arrayt<T>::arrayt( const int n1, const int n2, const int n3 ) //   3D array
               << n3 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    p = new T [ n1*n2*n3 ];
+    p = arrayt_alloc<T>( n1*n2*n3 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = "
                 << n1 << " x " << n2 << " x " << n3 << endl;
@@ -209,7 +257,7 @@ arrayt<T>::arrayt( const int n1, const int n2, const int n3, const int n4 )   //
               << n3 << " x " << n4 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    p = new T [ n1*n2*n3*n4 ];
+    p = arrayt_alloc<T>( n1*n2*n3*n4 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = " << n1 << " x " << n2 << " x "
               << n3 << " x " << n4 << endl;
@@ -226,12 +274,11 @@ arrayt<T>::arrayt( const int n1, const int n2, const int n3, const int n4 )   //
 template < class T >                // required for misc. operations
 arrayt<T>::arrayt( const arrayt<T> &a )
 {
-    p = new T [ a.nn ];
-    if( NULL == p ) {
-        cout << "Cannot allocate memory for arrayt size = " << a.nn  << endl;
-        exit( EXIT_FAILURE );
+    p = NULL;
+    if( a.nn > 0 ) {
+        p = arrayt_alloc<T>( a.nn );
+        memcpy( p, a.p, a.nn*sizeof(T) );
     }
-    memcpy( p, a.p, a.nn*sizeof(T) );
     nn1 = a.nn1;
     nn2 = a.nn2;
     nn3 = a.nn3;
@@ -240,6 +287,46 @@ arrayt<T>::arrayt( const arrayt<T> &a )
     nn = a.nn;
 }
 
+template < class T >                // move, takes over the storage of a
+arrayt<T>::arrayt( arrayt<T> &&a )
+{
+    p = a.p;
+    nn1 = a.nn1;
+    nn2 = a.nn2;
+    nn3 = a.nn3;
+    nn4 = a.nn4;
+    nndim = a.nndim;
+    nn = a.nn;
+    a.p = NULL;
+    a.nn = a.nndim = a.nn1 = a.nn2 = a.nn3 = a.nn4 = 0;
+}
+
+//  evaluate an expression into a new array of the same shape
+template < class T >
+template < class E >
+arrayt<T>::arrayt( const arrayt_expr<E> &e )
+{
+    const E &x = e.self();
+    if( x.ndim() > 2 ) {
+        cout << "arrayt expression with ndim= " << x.ndim() << ", NOT ALLOWED" << endl;
+        exit( EXIT_FAILURE );
+    }
+    if( x.n() <= 0 ) {
+        cout << "arrayt initialized with size = " << x.n() << ", NOT ALLOWED" << endl;
+        exit( EXIT_FAILURE );
+    }
+    p = arrayt_alloc<T>( x.n() );
+    if( NULL == p ) {
+        cout << "Cannot allocate memory for arrayt size = " << x.n()  << endl;
+        exit( EXIT_FAILURE );
+    }
+    nn = x.n();
+    nn1 = x.n1();
+    nn2 = x.n2();
+    nn3 = nn4 = 0;
+    nndim = x.ndim();
+    arrayt_eval( p, nn, e );
+}
 
 // -------  member function resize() -------------------------
 
@@ -251,8 +338,8 @@ void arrayt<T>::resize( const int n  )      // 1D resize
             << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE ); 
     }
-    if(nn>0) delete [] p;
-    p = new T [ n ];
+    if(nn>0) arrayt_free( p );
+    p = arrayt_alloc<T>( n );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt resize = "
              << n << endl;
@@ -274,8 +361,8 @@ void arrayt<T>::resize( const int n1, const int n2 )        // 2D resize
                 << n2 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    if(nn>0) delete [] p;
-    p = new T [ n1 * n2 ];
+    if(nn>0) arrayt_free( p );
+    p = arrayt_alloc<T>( n1 * n2 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt resize = "
             << n1 << " x " << n2 << endl;
@@ -298,8 +385,8 @@ void arrayt<T>::resize( const int n1, const int n2, const int n3 )   // 3D resiz
               << n3 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    if(nn>0) delete [] p;
-    p = new T [ n1 * n2 * n3 ];
+    if(nn>0) arrayt_free( p );
+    p = arrayt_alloc<T>( n1 * n2 * n3 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = "
                 << n1 << " x " << n2 << " x " << n3 << endl;
@@ -309,7 +396,7 @@ void arrayt<T>::resize( const int n1, const int n2, const int n3 )   // 3D resiz
     nn2 = n2;
     nn3 = n3;
     nn4 = 0;
-    nndim = 2;
+    nndim = 3;
     nn = n1 * n2 * n3;
 }
 
@@ -321,8 +408,8 @@ void arrayt<T>::resize( const int n1, const int n2, const int n3, const int n4 )
               << n3 << " x " << n4 << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
     }
-    if(nn>0) delete [] p;
-    p = new T [ n1 * n2 * n3 * n4];
+    if(nn>0) arrayt_free( p );
+    p = arrayt_alloc<T>( n1 * n2 * n3 * n4 );
     if( NULL == p ) {
         cout << "Cannot allocate memory for arrayt size = " << n1 << " x " << n2 << " x "
               << n3 << " x " << n4 << endl;
@@ -332,7 +419,7 @@ void arrayt<T>::resize( const int n1, const int n2, const int n3, const int n4 )
     nn2 = n2;
     nn3 = n3;
     nn4 = n4;
-    nndim = 2;
+    nndim = 4;
     nn = n1 * n2 * n3 * n4;
 }
 
@@ -341,18 +428,89 @@ void arrayt<T>::resize( const int n1, const int n2, const int n3, const int n4 )
 
 
 // -------  member function operator =
+//    if the sizes differ a1 is reallocated to the shape of a2
 template < class T >
 arrayt<T>& arrayt<T>::operator=( const arrayt<T> &m )
 {
-    if( (nn != m.nn) || (nndim != m.nndim)  ){
-        cout << "arrayt = operator invoked with unequal sizes\n"
-            << "  m1 size = " << nn << ", dim= " << nndim << "\n"
-            << "  m2 size = " << m.nn << ", dim= " << m.nndim << endl;
+    if( this == &m ) return *this;
+    if( nn != m.nn ) {
+        if(nn>0) arrayt_free( p );
+        p = NULL;
+        if( m.nn > 0 ) p = arrayt_alloc<T>( m.nn );
+        nn = m.nn;
+    }
+    nn1 = m.nn1;
+    nn2 = m.nn2;
+    nn3 = m.nn3;
+    nn4 = m.nn4;
+    nndim = m.nndim;
+    if( nn > 0 ) memcpy( p, m.p, nn*sizeof(T) );    // fastest way to do this
+    return *this;
+}
+
+// -------  member function operator = (move)
+//    frees the old storage of a1 and takes over the storage of a2
+template < class T >
+arrayt<T>& arrayt<T>::operator=( arrayt<T> &&m )
+{
+    if( this == &m ) return *this;
+    if(nn>0) arrayt_free( p );
+    p = m.p;
+    nn1 = m.nn1;
+    nn2 = m.nn2;
+    nn3 = m.nn3;
+    nn4 = m.nn4;
+    nndim = m.nndim;
+    nn = m.nn;
+    m.p = NULL;
+    m.nn = m.nndim = m.nn1 = m.nn2 = m.nn3 = m.nn4 = 0;
+    return *this;
+}
+
+// -------  member function operator = (expression)
+//    one pass over the storage, element i of the result only depends on
+//    element i of the operands so a1 = a1 - s*a2 is safe;
+//    if the sizes differ the result goes to new storage first
+//    (the expression may still refer to the old one)
+template < class T >
+template < class E >
+inline arrayt<T>& arrayt<T>::operator=( const arrayt_expr<E> &e )
+{
+    const E &x = e.self();
+    if( x.ndim() > 2 ) {
+        cout << "arrayt expression with ndim= " << x.ndim() << ", NOT ALLOWED" << endl;
         exit( EXIT_FAILURE );
+    }
+    if( nn != x.n() ){
+        T *q = NULL;
+        if( x.n() > 0 ) {
+            q = arrayt_alloc<T>( x.n() );
+            arrayt_eval( q, x.n(), e );
+        }
+        if(nn>0) arrayt_free( p );
+        p = q;
+        nn = x.n();
     } else {
-        memcpy( p, m.p, nn*sizeof(T) ); // fastest way to do this
-        return *this;
+        arrayt_eval( p, nn, e );
     }
+    nn1 = x.n1();
+    nn2 = x.n2();
+    nn3 = nn4 = 0;
+    nndim = x.ndim();
+    return *this;
+}
+
+// ------- expression evaluation ----------------------------------
+//
+//  p[i] = e[i] for all i, the loop is simple enough for the compiler
+//  to vectorize; headers that know faster kernels for particular
+//  expressions can add overloads of arrayt_eval() (see matrix.hpp)
+//
+template < class T, class E >
+inline void arrayt_eval( T *p, const int n, const arrayt_expr<E> &e )
+{
+    const E &x = e.self();
+    for( int i=0; i<n; i++) p[i] = x[i];
 }
 
 // ------- index operators ----------------------------------
@@ -452,7 +610,7 @@ inline arrayt<T>& arrayt<T>::operator+=( const arrayt<T>& m  )
             "   " << nn << " and "<< m.n() << endl;
         exit( EXIT_FAILURE );
     } else {
-        register int i;
+        int i;
         for( i=0; i<nn; i++) p[i] += m.p[i];
         return *this;
     }
@@ -468,7 +626,7 @@ inline arrayt<T>& arrayt<T>::operator-=( const arrayt<T>& m  )
             "   " << nn << " and "<< m.n() << endl;
         exit( EXIT_FAILURE );
     } else {
-        register int i;
+        int i;
         for( i=0; i<nn; i++) p[i] -= m.p[i];
         return *this;
     }
@@ -484,7 +642,7 @@ inline arrayt<T>& arrayt<T>::operator*=( const arrayt<T>& m  )
             "   " << nn << " and "<< m.n() << endl;
         exit( EXIT_FAILURE );
     } else {
-        register int i;
+        int i;
         for( i=0; i<nn; i++) p[i] *= m.p[i];
         return *this;
     }
@@ -497,7 +655,7 @@ template < class T >
 inline arrayt<T>& arrayt<T>::operator*=( const T s  )
 {
 
-    register int i;
+    int i;
     for( i=0; i<nn; i++) p[i] *= s;
 
     return *this;
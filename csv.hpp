@@ -0,0 +1,349 @@
+/*
+csv.hpp
+
+Fast loader for numeric CSV files (one example per line, fields separated by
+commas) into arrayt<double> or arrayt<float>, replacing getline, istringstream
+and stod.
+
+    load_csv(path, a):
+        maps the whole file (see mapped_file.hpp), cuts it into byte ranges
+        of about CSV_CHUNK_BYTES ending on line breaks, counts the rows
+        of every range, resizes a to match, then parses the ranges
+        concurrently on the thread pool (threadpool.hpp), each straight
+        into its own rows of a. Every field is parsed in place with
+        std::from_chars. There is no string or stream per field, and
+        parsing doesn't depend on the locale.
+    load_csv(path, a, stats):
+        the same, also fills stats with the shape, the bytes read and the
+        time taken. print_csv_stats() reports rows/s and MB/s.
+    load_csv(path, a, stats, &col_stats):
+        also the mean, variance, min and max of every column (see
+        feature_stats.hpp), each range added right after it is parsed,
+        while it is still in cache, so the values are read only once
+    csv_header(path, names):
+        the column names from the header line, if the file has one
+
+A file with one column gives a vector (a(i)), like the labels. Anything else
+gives a rows x cols matrix.
+A first line that doesn't start with a number is taken as a header and skipped.
+Blank lines are skipped. Windows line endings are fine.
+Spaces or tabs around fields are allowed.
+Returns false (after printing the line and the reason) if the file can't be
+read, a row has the wrong number of fields or a field isn't a number. With
+several bad lines, the first one in the file is reported, whatever the
+number of threads.
+
+Needs C++17 (std::from_chars for floating point, GCC 11 or later).
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef CSV
+#define CSV
+
+#include <cstring>  // memchr
+#include <charconv> // from_chars
+#include <system_error>
+#include <climits>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include "arrayt.hpp"
+#include "mapped_file.hpp"
+#include "threadpool.hpp"
+#include "feature_stats.hpp"
+
+using namespace std;
+
+// files are parsed in ranges of about this many bytes, one thread each
+//   (files smaller than this are parsed on the calling thread)
+#ifndef CSV_CHUNK_BYTES
+#define CSV_CHUNK_BYTES (1 << 20)
+#endif
+
+struct csv_stats
+{
+    long rows;      // data rows (header and blank lines not counted)
+    int cols;       // fields per row
+    size_t bytes;   // size of the file
+    double seconds; // time to map, count and parse
+};
+
+inline const char* csv_skip_blanks(const char *s, const char *end)
+{
+    // past spaces, tabs and the '\r' of a Windows line ending
+    while (s < end && (*s == ' ' || *s == '\t' || *s == '\r')) s++;
+    return s;
+}
+
+inline const char* csv_line_end(const char *s, const char *end)
+{
+    // the '\n' ending the line that starts at s (or end)
+    const char *eol = (const char*) memchr(s, '\n', end - s);
+    return (eol == NULL) ? end : eol;
+}
+
+template <class T>
+inline const char* csv_field(const char *s, const char *end, T &x)
+{
+    // parses the number at s into x, returns the first character after it
+    //   (and any blanks), or NULL if s doesn't start with a number
+    s = csv_skip_blanks(s, end);
+    if (s < end && *s == '+') s++;  // from_chars doesn't take a leading '+'
+    const from_chars_result r = from_chars(s, end, x);
+    if (r.ec != errc()) return NULL;
+    return csv_skip_blanks(r.ptr, end);
+}
+
+struct csv_chunk
+{
+    const char *begin, *end;  // whole lines of the file
+    long rows, lines;         // data rows and all lines in the range
+    long row0, line0;         // row and line number of the first line
+    long parsed;              // rows csv_parse() got, -1 on error
+};
+
+inline void csv_count(csv_chunk &c)
+{
+    // count the lines of a range, and the ones with something on them
+    c.rows = 0;
+    c.lines = 0;
+    for(const char *q = c.begin; q < c.end; )
+    {
+        const char *eol = csv_line_end(q, c.end);
+        if (csv_skip_blanks(q, eol) < eol) c.rows++;
+        c.lines++;
+        q = eol + 1;
+    }
+}
+
+template <class T>
+long csv_parse(const char *s, const char *end, const int cols, T *out,
+    const char *path, long line)
+{
+    /*
+    Inputs:
+        s, end: whole lines of the file
+        cols: fields expected on each line
+        out: receives the values, row after row
+        path, line: file name and number of the line at s, for messages
+            (with path = NULL nothing is printed)
+    Output:
+        number of rows parsed, or -1 (after printing what's wrong)
+    */
+    long row = 0;
+    while (s < end)
+    {
+        const char *eol = csv_line_end(s, end);
+        const char *q = csv_skip_blanks(s, eol);
+        if (q < eol)
+        {
+            T *r = out + row*cols;
+            for(int j=0; j < cols; j++)
+            {
+                q = csv_field(q, eol, r[j]);
+                if (q == NULL){
+                    if (path != NULL) cout << path << " line " << line << ": field " << j+1
+                        << " is not a number" << endl;
+                    return -1;
+                }
+                if (j < cols-1){
+                    if (q == eol || *q != ','){
+                        if (path != NULL) cout << path << " line " << line << ": " << j+1
+                            << " fields, expected " << cols << endl;
+                        return -1;
+                    }
+                    q++;
+                }
+            }
+            if (q != eol){
+                if (path != NULL) cout << path << " line " << line << ": more than "
+                    << cols << " fields" << endl;
+                return -1;
+            }
+            row++;
+        }
+        s = eol + 1;
+        line++;
+    }
+    return row;
+}
+
+template <class T>
+bool load_csv(const char *path, arrayt<T>& a, csv_stats& stats, feature_stats *col_stats = NULL)
+{
+    /*
+    Inputs:
+        path: csv file
+        a: resized to the shape of the file and filled
+        stats: receives rows, columns, bytes and time
+        col_stats: if not NULL, receives the statistics of each column
+            (merged range by range in file order, the same for any
+            number of threads)
+    Output:
+        false if the file couldn't be loaded (a is then unchanged)
+    */
+    const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    stats.rows = 0;
+    stats.cols = 0;
+    stats.bytes = 0;
+    stats.seconds = 0.0;
+
+    mapped_file f;
+    if (!f.open(path)) return false;
+    const char *s = f.data(), *end = f.data() + f.size();
+    stats.bytes = f.size();
+
+    // first line with something on it, skipped if it is a header
+    long line = 1;
+    while (s < end && csv_skip_blanks(s, csv_line_end(s, end)) == csv_line_end(s, end))
+    {
+        s = csv_line_end(s, end) + 1;
+        line++;
+    }
+    if (s < end)
+    {
+        double x;
+        if (csv_field(s, csv_line_end(s, end), x) == NULL){
+            s = csv_line_end(s, end) + 1;
+            line++;
+        }
+    }
+    if (s > end) s = end;
+
+    // fields on the first data line
+    int cols = 0;
+    for(const char *q = s; q < end && cols == 0; )
+    {
+        const char *eol = csv_line_end(q, end);
+        if (csv_skip_blanks(q, eol) < eol){
+            cols = 1;
+            for(const char *c = q; c < eol; c++) if (*c == ',') cols++;
+        }
+        q = eol + 1;
+    }
+
+    // ranges of whole lines, about CSV_CHUNK_BYTES each
+    const int n_chunks = (int) ((end - s)/CSV_CHUNK_BYTES) + 1;
+    vector<csv_chunk> chunks(n_chunks);
+    const char *b = s;
+    for(int k=0; k < n_chunks; k++)
+    {
+        chunks[k].begin = b;
+        if (k < n_chunks-1){
+            b = csv_line_end(s + (long) (k+1)*CSV_CHUNK_BYTES, end);
+            if (b < end) b++;
+            if (b < chunks[k].begin) b = chunks[k].begin;
+        }
+        else b = end;
+        chunks[k].end = b;
+    }
+
+    // rows in each range, then where each one starts
+    parallel_for(n_chunks, 1, [&](int k0, int k1)
+    {
+        for(int k=k0; k < k1; k++) csv_count(chunks[k]);
+    });
+    long rows = 0;
+    for(int k=0; k < n_chunks; k++)
+    {
+        chunks[k].row0 = rows;
+        chunks[k].line0 = line;
+        rows += chunks[k].rows;
+        line += chunks[k].lines;
+    }
+    if (rows == 0){
+        cout << path << " has no data" << endl;
+        return false;
+    }
+    if ((double) rows*cols > INT_MAX){
+        cout << path << " has " << rows << " x " << cols << " values, too many for an arrayt" << endl;
+        return false;
+    }
+
+    // parse every range into its own rows
+    arrayt<T> a2;
+    if (cols == 1) a2.resize(rows);
+    else a2.resize(rows, cols);
+    T *out = a2.data();
+    vector<feature_stats> chunk_stats((col_stats != NULL) ? n_chunks : 0);
+    parallel_for(n_chunks, 1, [&](int k0, int k1)
+    {
+        for(int k=k0; k < k1; k++)
+        {
+            csv_chunk &c = chunks[k];
+            c.parsed = csv_parse(c.begin, c.end, cols, out + c.row0*cols, NULL, c.line0);
+            if (col_stats != NULL && c.parsed == c.rows)
+                chunk_stats[k].add(arrayt_view<T>(out + c.row0*cols, (int) c.rows, cols, cols, 1));
+        }
+    });
+    for(int k=0; k < n_chunks; k++)
+    {
+        if (chunks[k].parsed != chunks[k].rows){
+            // again on this thread, to print the first bad line
+            const csv_chunk &c = chunks[k];
+            csv_parse(c.begin, c.end, cols, out + c.row0*cols, path, c.line0);
+            return false;
+        }
+    }
+
+    if (col_stats != NULL){
+        *col_stats = feature_stats(cols);
+        for(int k=0; k < n_chunks; k++) col_stats->merge(chunk_stats[k]);
+    }
+
+    a = std::move(a2);
+    stats.rows = rows;
+    stats.cols = cols;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    return true;
+}
+
+template <class T>
+bool load_csv(const char *path, arrayt<T>& a)
+{
+    csv_stats stats;
+    return load_csv(path, a, stats);
+}
+
+inline bool csv_header(const char *path, vector<string>& names)
+{
+    // the fields of the header line of a csv file (blanks around them
+    //   removed), false with names empty if the file has no header
+    names.clear();
+    mapped_file f;
+    if (!f.open(path)) return false;
+    const char *s = f.data(), *end = f.data() + f.size();
+    while (s < end && csv_skip_blanks(s, csv_line_end(s, end)) == csv_line_end(s, end))
+        s = csv_line_end(s, end) + 1;
+    if (s >= end) return false;
+
+    const char *eol = csv_line_end(s, end);
+    double x;
+    if (csv_field(s, eol, x) != NULL) return false;    // starts with a number
+    while (s <= eol)
+    {
+        const char *c = (const char*) memchr(s, ',', eol - s);
+        if (c == NULL) c = eol;
+        const char *b = csv_skip_blanks(s, c), *e = c;
+        while (e > b && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r')) e--;
+        names.push_back(string(b, e));
+        s = c + 1;
+    }
+    return true;
+}
+
+inline void print_csv_stats(const char *path, const csv_stats& s)
+{
+    // e.g. x_prep.txt: 10000 x 10, 1.93 MB in 0.011 s (0.91 M rows/s, 175 MB/s)
+    const double t = (s.seconds > 0) ? s.seconds : 1e-9;
+    cout << path << ": " << s.rows << " x " << s.cols << ", "
+        << setprecision(3) << s.bytes*1e-6 << " MB in " << s.seconds << " s ("
+        << s.rows/t*1e-6 << " M rows/s, " << s.bytes/t*1e-6 << " MB/s)"
+        << setprecision(6) << endl;
+}
+
+#endif
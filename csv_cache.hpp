@@ -0,0 +1,277 @@
+/*
+csv_cache.hpp
+
+Cache of parsed csv files, so a file that hasn't changed since the last run
+is mapped instead of parsed again.
+
+    cached_csv<double> x;
+    if (!x.open("x_prep.txt")) ...   // prints why and returns false
+    x.view()                         // the values, rows x cols (n x 1 for
+                                     //   a single column)
+    x.cached()                       // true if they came from the cache
+    x.stats()                        // as from load_csv() (csv.hpp), the
+                                     //   time is for the whole open()
+    x.col_stats()                    // mean, variance, min and max of each
+                                     //   column (feature_stats.hpp)
+    print_cached_csv_stats(path, x)  // print_csv_stats() or, from the
+                                     //   cache, the time to check and map it
+
+The first open() of a file parses it with load_csv() and writes the values
+to a binary dataset next to it, path + ".nnd" (x_prep.txt.nnd, see
+dataset.hpp). The identity of the source is kept in the tag of that file:
+its path, size, modification time and a 64 bit hash of its contents,
+followed by the column statistics gathered while it was parsed. A later
+open() maps the cache (no parsing or copying) and reads the statistics back
+if all four still match and the element type is T. Otherwise the cache is
+stale and is written again.
+The cheap checks come first, so only a cache that passes them costs a read
+of the source, for the hash, which is several times faster than parsing it.
+
+If the cache can't be written (e.g. a read only directory) open() still
+works, with the parsed values kept in memory. The views are only valid while
+the cached_csv is open.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef CSV_CACHE
+#define CSV_CACHE
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include "arrayt.hpp"
+#include "arrayt_view.hpp"
+#include "mapped_file.hpp"
+#include "threadpool.hpp"
+#include "csv.hpp"
+#include "dataset.hpp"
+#include "feature_stats.hpp"
+
+using namespace std;
+
+// files are hashed in blocks of this many bytes, one thread each
+#ifndef HASH_BLOCK_BYTES
+#define HASH_BLOCK_BYTES (1 << 20)
+#endif
+
+const uint64_t HASH_PRIME = 0x9e3779b97f4a7c15ull;
+
+inline uint64_t hash_mix(uint64_t h)
+{
+    // final mixing of a 64 bit value, every input bit affects every output bit
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+inline uint64_t hash_bytes(const char *p, const size_t n, const uint64_t seed)
+{
+    /*
+    Inputs:
+        p, n: the bytes to hash
+        seed: start value
+    Output:
+        a 64 bit hash of the bytes, to spot a changed file (not for
+        security)
+    Description:
+        four independent lanes of 8 byte words, so the multiplies overlap,
+        the last partial 32 bytes padded with zeros, the length mixed in
+    */
+    uint64_t h[4] = {seed, seed ^ HASH_PRIME, seed + HASH_PRIME, ~seed};
+    uint64_t w[4];
+    size_t i = 0;
+    for(; i + sizeof(w) <= n; i += sizeof(w))
+    {
+        memcpy(w, p + i, sizeof(w));
+        for(int k=0; k < 4; k++)
+        {
+            h[k] = (h[k] ^ w[k])*HASH_PRIME;
+            h[k] ^= h[k] >> 29;
+        }
+    }
+    memset(w, 0, sizeof(w));
+    if (n > i) memcpy(w, p + i, n - i);
+    for(int k=0; k < 4; k++) h[k] = (h[k] ^ w[k])*HASH_PRIME;
+
+    return hash_mix(hash_mix(h[0] ^ n) ^ hash_mix(h[1]) ^ hash_mix(h[2] + 1) ^ hash_mix(h[3] + 2));
+}
+
+inline bool hash_file(const char *path, uint64_t& hash)
+{
+    // hash of the whole file, blocks hashed on the thread pool and then
+    //   combined in order, so the value doesn't depend on the thread count
+    mapped_file f;
+    if (!f.open(path)) return false;
+    const long n_blocks = ((long) f.size() + HASH_BLOCK_BYTES - 1)/HASH_BLOCK_BYTES;
+    vector<uint64_t> block_hash(n_blocks);
+    const char *p = f.data();
+    const size_t size = f.size();
+    parallel_for((int) n_blocks, 1, [&](const int begin, const int end)
+    {
+        for(int b=begin; b < end; b++)
+        {
+            const size_t start = (size_t) b*HASH_BLOCK_BYTES;
+            const size_t len = (size - start < HASH_BLOCK_BYTES) ? size - start : HASH_BLOCK_BYTES;
+            block_hash[b] = hash_bytes(p + start, len, b);
+        }
+    });
+    hash = hash_bytes((const char*) block_hash.data(), block_hash.size()*sizeof(uint64_t), size);
+    return true;
+}
+
+inline bool file_identity(const char *path, long long& size, long long& mtime_ns)
+{
+    // size and modification time (in ns where the OS keeps them) of a file
+    struct stat st;
+    if (stat(path, &st) != 0){
+        cout << "can't stat " << path << endl;
+        return false;
+    }
+    size = (long long) st.st_size;
+#if defined(__linux__)
+    mtime_ns = (long long) st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+    mtime_ns = (long long) st.st_mtimespec.tv_sec*1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    mtime_ns = (long long) st.st_mtime*1000000000LL;
+#endif
+    return true;
+}
+
+template <class T>
+class cached_csv
+{
+public:
+    cached_csv() : from_cache(false) {}
+
+    bool open(const char *path);
+    void close();
+
+    arrayt_view<T> view() const { return v; }
+    bool cached() const { return from_cache; }
+    const csv_stats& stats() const { return stats_; }
+    const feature_stats& col_stats() const { return col; }
+    string cache_path() const { return path + ".nnd"; }
+
+private:
+    bool parse(const string& key);
+    void free_parsed() { arrayt<T> old(std::move(a)); }     // a is left empty
+
+    string path;
+    dataset cache;
+    arrayt<T> a;        // the parsed values when there is no cache
+    arrayt_view<T> v;
+    bool from_cache;
+    csv_stats stats_;
+    feature_stats col;
+
+    cached_csv(const cached_csv&);
+    cached_csv& operator=(const cached_csv&);
+};
+
+template <class T>
+bool cached_csv<T>::open(const char *file)
+{
+    close();
+    path = file;
+    const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+
+    long long size, mtime_ns;
+    if (!file_identity(file, size, mtime_ns)) return false;
+    ostringstream key;
+    key << "csv cache\n" << path << "\n" << size << "\n" << mtime_ns << "\n";
+
+    // use the cache if path, size and time match, then if the hash does
+    //   (the statistics follow the hash in the tag)
+    const string cp = cache_path();
+    if (file_exists(cp.c_str()) && cache.open(cp.c_str()))
+    {
+        const string& tag = cache.tag();
+        const size_t eol = tag.find('\n', key.str().size());
+        uint64_t hash;
+        if (tag.compare(0, key.str().size(), key.str()) == 0 && eol != string::npos
+            && (int) cache.dtype() == (int) dataset_type<T>::value
+            && cache.targets() == 0 && hash_file(file, hash)
+            && tag.substr(key.str().size(), eol + 1 - key.str().size()) == to_string(hash) + "\n"
+            && col.parse(tag.substr(eol + 1)) && col.cols() == cache.features())
+        {
+            v = cache.x<T>();
+            from_cache = true;
+            stats_.rows = v.n1();
+            stats_.cols = v.n2();
+            stats_.bytes = size;
+            stats_.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+            return true;
+        }
+        cache.close();
+    }
+    if (!parse(key.str())) return false;
+    stats_.seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    return true;
+}
+
+template <class T>
+void cached_csv<T>::close()
+{
+    cache.close();
+    free_parsed();
+    v = arrayt_view<T>();
+    from_cache = false;
+    col.clear();
+}
+
+template <class T>
+bool cached_csv<T>::parse(const string& key)
+{
+    /*
+    load_csv() the source (with its column statistics), write the cache
+    and map it (or keep a if that fails). key is the identity of the source
+    from before it was read, so a change while parsing leaves a cache that
+    won't match next time.
+    */
+    if (!load_csv(path.c_str(), a, stats_, &col)) return false;
+    v = arrayt_view<T>(a);
+
+    uint64_t hash;
+    if (!hash_file(path.c_str(), hash)) return true;
+
+    vector<string> names;
+    csv_header(path.c_str(), names);
+    if ((int) names.size() != v.n2()) names.clear();
+    const string cp = cache_path();
+    if (write_dataset<T>(cp.c_str(), v, arrayt_view<T>(), names, DATASET_ROWS,
+            key + to_string(hash) + "\n" + col.str(names))
+        && cache.open(cp.c_str()))
+    {
+        v = cache.x<T>();
+        free_parsed();
+    }
+    return true;
+}
+
+template <class T>
+void print_cached_csv_stats(const char *path, const cached_csv<T>& c)
+{
+    // e.g. x_prep.txt: 10000 x 10, unchanged, mapped x_prep.txt.nnd in 0.0004 s
+    if (!c.cached()){
+        print_csv_stats(path, c.stats());
+        return;
+    }
+    cout << path << ": " << c.stats().rows << " x " << c.stats().cols << ", unchanged, mapped "
+        << c.cache_path() << " in " << setprecision(3) << c.stats().seconds << " s"
+        << setprecision(6) << endl;
+}
+
+#endif
@@ -0,0 +1,464 @@
+/*
+data_stream.hpp
+
+Out-of-core reader for datasets larger than memory. Training gets the data a
+chunk of rows at a time while a background thread reads the next chunk, so
+the loop only waits for the disk when it is faster than the disk.
+
+    data_stream<T> s;
+    s.open("prep.nnd", chunk_rows)                    // binary dataset, see dataset.hpp
+    s.open("x_prep.txt", "y_prep.txt", chunk_rows)    // or a pair of csv files
+    arrayt_view<T> x, y;
+    while (s.next(x, y)) { ... }                      // x: rows x features,
+                                                      // y: rows x targets
+
+Double buffering: two buffers of chunk_rows rows. The reader thread fills one
+while the caller works on the other, and the views from next() stay valid
+until the following call to next(). Memory use is those two buffers (see
+buffer_bytes()) plus a read buffer for csv files, whatever the size of the
+data.
+
+Binary datasets are read with plain fread, by rows or, for the column
+layout, one column at a time. csv files are read in blocks and parsed line
+by line as in csv.hpp (header line, blank lines and CRLF are fine).
+next() returns false at the end of the data, or after printing the first
+bad line (failed() then returns true). wait_seconds() is the total time
+next() has spent waiting for the reader.
+
+The reader also gathers the statistics of every column as it reads them
+(x_stats(), y_stats(), see feature_stats.hpp, complete once next() has
+returned false, or after close()), and with s.standardize_x(stats) before open() it
+standardizes the features of each chunk before handing it over.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef DATA_STREAM
+#define DATA_STREAM
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <iostream>
+#include "arrayt_view.hpp"
+#include "csv.hpp"
+#include "dataset.hpp"
+#include "feature_stats.hpp"
+
+using namespace std;
+
+inline bool stream_seek(FILE *fp, const long long offset)
+{
+    // fseek past 2 GB
+#if defined(_WIN32)
+    return _fseeki64(fp, offset, SEEK_SET) == 0;
+#else
+    return fseeko(fp, (off_t) offset, SEEK_SET) == 0;
+#endif
+}
+
+class csv_stream
+{
+    /*
+    Lines of a csv file, read a block at a time.
+        open(path): skips a header line, cols() is then the number of
+            fields in the first data line
+        read(out, max_rows): parses up to max_rows rows into out (row
+            after row), returns the number read (0 at the end, -1 after
+            printing a bad line)
+    */
+public:
+    csv_stream() : fp(NULL), pos(0), len(0), eof(false), line(1), n_cols(0) {}
+    ~csv_stream() { close(); }
+
+    bool open(const char *file);
+    void close() { if (fp != NULL) fclose(fp); fp = NULL; }
+    int cols() const { return n_cols; }
+
+    template <class T> long read(T *out, const long max_rows);
+
+private:
+    const char* next_line(const char *&eol);
+    void skip_line(const char *eol) { pos = eol - &buf[0] + 1; if (pos > len) pos = len; line++; }
+
+    FILE *fp;
+    vector<char> buf;
+    size_t pos, len;    // unread bytes are buf[pos, len)
+    bool eof;
+    long line;          // number of the line at pos
+    int n_cols;
+    string path;
+
+    csv_stream(const csv_stream&);
+    csv_stream& operator=(const csv_stream&);
+};
+
+inline const char* csv_stream::next_line(const char *&eol)
+{
+    // the next line (without its '\n') as [start, eol), NULL at the end
+    for(;;)
+    {
+        const char *s = &buf[0] + pos;
+        const char *e = (const char*) memchr(s, '\n', len - pos);
+        if (e != NULL){
+            eol = e;
+            return s;
+        }
+        if (eof){
+            eol = &buf[0] + len;
+            return (pos < len) ? s : NULL;
+        }
+        // keep the partial line, grow the buffer for very long lines
+        memmove(&buf[0], &buf[0] + pos, len - pos);
+        len -= pos;
+        pos = 0;
+        if (len == buf.size()) buf.resize(2*buf.size());
+        const size_t got = fread(&buf[0] + len, 1, buf.size() - len, fp);
+        len += got;
+        if (got == 0) eof = true;
+    }
+}
+
+inline bool csv_stream::open(const char *file)
+{
+    close();
+    path = file;
+    fp = fopen(file, "rb");
+    if (fp == NULL){
+        cout << "can't open " << file << endl;
+        return false;
+    }
+    buf.resize(1 << 20);
+    pos = len = 0;
+    eof = false;
+    line = 1;
+    n_cols = 0;
+
+    // header (first line with something on it, if not a number) and blank lines
+    bool first = true;
+    const char *s, *eol;
+    while ((s = next_line(eol)) != NULL)
+    {
+        const char *q = csv_skip_blanks(s, eol);
+        double x;
+        if (q == eol || (first && csv_field(q, eol, x) == NULL)){
+            if (q != eol) first = false;
+            skip_line(eol);
+            continue;
+        }
+        n_cols = 1;
+        for(const char *c = q; c < eol; c++) if (*c == ',') n_cols++;
+        return true;
+    }
+    cout << path << " has no data" << endl;
+    return false;
+}
+
+template <class T>
+long csv_stream::read(T *out, const long max_rows)
+{
+    long rows = 0;
+    const char *s, *eol;
+    while (rows < max_rows && (s = next_line(eol)) != NULL)
+    {
+        const long r = csv_parse(s, eol, n_cols, out + rows*n_cols, path.c_str(), line);
+        if (r < 0) return -1;
+        rows += r;
+        skip_line(eol);
+    }
+    return rows;
+}
+
+template <class T>
+class data_stream
+{
+public:
+    data_stream() : chunk_rows(0), n_x(0), n_y(0), total(-1), source(NO_SOURCE), layout(DATASET_ROWS),
+        nnd(NULL), data_offset(0), rows_read(0), error(false), stop(false), in_use(-1),
+        next_chunk(0), waited(0.0) { state[0] = state[1] = EMPTY; }
+    ~data_stream() { close(); }
+
+    bool open(const char *nnd_path, const long chunk_rows);
+    bool open(const char *x_path, const char *y_path, const long chunk_rows);
+    void close();
+
+    bool next(arrayt_view<T>& x, arrayt_view<T>& y);
+
+    int features() const { return n_x; }
+    int targets() const { return n_y; }
+    long rows() const { return total; }     // -1 if not known (csv)
+    bool failed() const { return error; }
+    double wait_seconds() const { return waited; }
+    size_t buffer_bytes() const { return 2*buf[0].size()*sizeof(T); }
+
+    // statistics of the values read so far, before any standardization
+    const feature_stats& x_stats() const { return x_seen; }
+    const feature_stats& y_stats() const { return y_seen; }
+    // standardize x with these (call before open(), clear() them for raw values)
+    void standardize_x(const feature_stats& s) { x_scale = s; }
+
+private:
+    enum { EMPTY, READY, IN_USE };
+    enum { NO_SOURCE, NND_FILE, CSV_FILES };
+
+    void start();
+    void reader_loop();
+    long fill(const int k);
+
+    long chunk_rows;
+    int n_x, n_y;       // features, targets
+    long total;
+    int source;
+
+    // binary dataset
+    dataset_layout layout;
+    FILE *nnd;
+    long data_offset, rows_read;
+
+    // csv files
+    csv_stream x_csv, y_csv;
+
+    // the two buffers, and views of the rows in each
+    vector<T> buf[2];
+    arrayt_view<T> xv[2], yv[2];
+    long n_rows[2];     // rows in the buffer, 0 at the end, -1 on error
+    int state[2];
+    bool error;
+
+    feature_stats x_seen, y_seen, x_scale;
+
+    thread reader;
+    mutex m;
+    condition_variable cv;
+    bool stop;
+    int in_use, next_chunk;
+    double waited;
+
+    data_stream(const data_stream&);
+    data_stream& operator=(const data_stream&);
+};
+
+template <class T>
+bool data_stream<T>::open(const char *path, const long rows_per_chunk)
+{
+    close();
+    dataset d;   // only to read and check the header
+    if (!d.open(path)) return false;
+    if ((int) d.dtype() != (int) dataset_type<T>::value){
+        cout << path << " holds " << (d.dtype() == DATASET_FLOAT32 ? "float" : "double")
+            << " values, not " << (sizeof(T) == sizeof(float) ? "float" : "double") << endl;
+        return false;
+    }
+    n_x = d.features();
+    n_y = d.targets();
+    total = d.rows();
+    layout = d.layout();
+    data_offset = d.data_offset();
+    d.close();
+
+    nnd = fopen(path, "rb");
+    if (nnd == NULL || !stream_seek(nnd, data_offset)){
+        cout << "can't read " << path << endl;
+        close();
+        return false;
+    }
+    source = NND_FILE;
+    chunk_rows = (rows_per_chunk > 0) ? rows_per_chunk : 1;
+    start();
+    return true;
+}
+
+template <class T>
+bool data_stream<T>::open(const char *x_path, const char *y_path, const long rows_per_chunk)
+{
+    close();
+    if (!x_csv.open(x_path) || !y_csv.open(y_path)){
+        close();
+        return false;
+    }
+    n_x = x_csv.cols();
+    n_y = y_csv.cols();
+    total = -1;
+    source = CSV_FILES;
+    chunk_rows = (rows_per_chunk > 0) ? rows_per_chunk : 1;
+    start();
+    return true;
+}
+
+template <class T>
+void data_stream<T>::start()
+{
+    for(int k=0; k < 2; k++)
+    {
+        buf[k].resize((size_t) chunk_rows*(n_x + n_y));
+        state[k] = EMPTY;
+        n_rows[k] = 0;
+    }
+    rows_read = 0;
+    x_seen.clear();
+    y_seen.clear();
+    error = false;
+    stop = false;
+    in_use = -1;
+    next_chunk = 0;
+    waited = 0.0;
+    reader = thread(&data_stream<T>::reader_loop, this);
+}
+
+template <class T>
+void data_stream<T>::close()
+{
+    if (reader.joinable()){
+        {
+            lock_guard<mutex> lock(m);
+            stop = true;
+        }
+        cv.notify_all();
+        reader.join();
+    }
+    if (nnd != NULL) fclose(nnd);
+    nnd = NULL;
+    x_csv.close();
+    y_csv.close();
+    source = NO_SOURCE;
+}
+
+template <class T>
+long data_stream<T>::fill(const int k)
+{
+    /*
+    Reads the next chunk into buffer k and sets its views (reader thread).
+    Output: rows read, 0 at the end of the data, -1 on error
+    */
+    T *p = &buf[k][0];
+    const int cols = n_x + n_y;
+    long n = 0;
+    if (source == NND_FILE)
+    {
+        n = (total - rows_read < chunk_rows) ? total - rows_read : chunk_rows;
+        if (n <= 0) return 0;
+        bool ok = true;
+        if (layout == DATASET_ROWS){
+            // rows are contiguous: one read, x and y are strided views
+            ok = fread(p, sizeof(T), (size_t) n*cols, nnd) == (size_t) n*cols;
+            xv[k] = arrayt_view<T>(p, n, n_x, cols, 1);
+            yv[k] = arrayt_view<T>(p + n_x, n, n_y, cols, 1);
+        }
+        else {
+            // rows_read to rows_read+n of each column, column after column
+            for(int j=0; j < cols && ok; j++)
+            {
+                ok = stream_seek(nnd, data_offset + ((long long) j*total + rows_read)*sizeof(T))
+                    && fread(p + (long) j*n, sizeof(T), n, nnd) == (size_t) n;
+            }
+            xv[k] = arrayt_view<T>(p, n, n_x, 1, n);
+            yv[k] = arrayt_view<T>(p + (long) n_x*n, n, n_y, 1, n);
+        }
+        if (!ok){
+            cout << "error reading the dataset at row " << rows_read << endl;
+            return -1;
+        }
+        rows_read += n;
+    }
+    else
+    {
+        // x in the front of the buffer, y behind it
+        T *py = p + chunk_rows*n_x;
+        n = x_csv.read(p, chunk_rows);
+        if (n < 0) return -1;
+        const long ny = y_csv.read(py, n);
+        if (ny < 0) return -1;
+        if (ny != n){
+            cout << "the csv files have different numbers of rows (" << rows_read + ny
+                << " labels for at least " << rows_read + n << " examples)" << endl;
+            return -1;
+        }
+        if (n == 0){
+            // x is done, y must be too
+            T extra;
+            if (y_csv.read(&extra, 1) != 0){
+                cout << "the csv files have different numbers of rows" << endl;
+                return -1;
+            }
+            return 0;
+        }
+        xv[k] = arrayt_view<T>(p, n, n_x, n_x, 1);
+        yv[k] = arrayt_view<T>(py, n, n_y, n_y, 1);
+        rows_read += n;
+    }
+
+    // while the chunk is in cache: its statistics, then standardize it
+    x_seen.add(xv[k]);
+    y_seen.add(yv[k]);
+    if (!x_scale.empty()) standardize(xv[k], x_scale);
+    return n;
+}
+
+template <class T>
+void data_stream<T>::reader_loop()
+{
+    // fill buffers 0, 1, 0, 1, ... as the caller hands them back
+    int k = 0;
+    for(;;)
+    {
+        {
+            unique_lock<mutex> lock(m);
+            cv.wait(lock, [&]{ return stop || state[k] == EMPTY; });
+            if (stop) return;
+        }
+        const long n = fill(k);
+        {
+            lock_guard<mutex> lock(m);
+            n_rows[k] = n;
+            state[k] = READY;
+        }
+        cv.notify_all();
+        if (n <= 0) return;     // end of data or error, nothing more to read
+        k ^= 1;
+    }
+}
+
+template <class T>
+bool data_stream<T>::next(arrayt_view<T>& x, arrayt_view<T>& y)
+{
+    /*
+    Inputs:
+        x, y: set to views of the next chunk's features and targets
+    Output:
+        false at the end of the data (or on error, see failed())
+    Description:
+        Hands the previous chunk's buffer back to the reader, then waits
+        (normally not at all) for the next one.
+    */
+    if (source == NO_SOURCE) return false;
+    unique_lock<mutex> lock(m);
+    if (in_use >= 0){
+        state[in_use] = EMPTY;
+        in_use = -1;
+        cv.notify_all();
+    }
+    const int k = next_chunk;
+    if (state[k] != READY){
+        const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        cv.wait(lock, [&]{ return state[k] == READY; });
+        waited += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    }
+    if (n_rows[k] <= 0){
+        error = n_rows[k] < 0;
+        return false;   // stays READY, later calls return false too
+    }
+    state[k] = IN_USE;
+    in_use = k;
+    next_chunk = k ^ 1;
+    x = xv[k];
+    y = yv[k];
+    return true;
+}
+
+#endif
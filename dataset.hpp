@@ -0,0 +1,293 @@
+/*
+dataset.hpp
+
+Binary dataset files (.nnd), so the training data is parsed from text once
+and afterwards just mapped into memory.
+
+Layout of a file (all values little-endian, as written by x86):
+    dataset_header      64 bytes: magic, element type, layout, shape,
+                        number of target columns, offset of the values
+    names               the column names, each ending in '\0'
+    tag                 free text for whoever wrote the file (csv_cache.hpp
+                        keeps the identity of the source file there), may
+                        be empty
+    padding             zeros up to a multiple of 64 bytes
+    values              rows x cols doubles or floats, either row after row
+                        (DATASET_ROWS, one example is contiguous) or column
+                        after column (DATASET_COLUMNS, one feature is
+                        contiguous)
+The first cols - targets columns are the features (x), the rest the
+targets (y).
+
+    write_dataset(path, x, y, names, layout, tag):
+        writes features x (rows x features) and targets y (rows x targets,
+        or an empty view) to path. names may be empty for x0, x1, ..., y0, ...
+        tag is stored as is and read back with d.tag().
+        The file is written under a temporary name and renamed, so a reader
+        never sees half a file.
+    dataset d; d.open(path):
+        maps the file (see mapped_file.hpp) and checks the header.
+    d.x<T>(), d.y<T>():
+        the features and targets as arrayt_view<T> straight into the mapped
+        file, no copy and no parsing, whatever the size. Pages are read
+        from disk (or the OS file cache) the first time they are touched.
+        The mapping is copy on write, so writing through a view changes
+        this process's copy only, never the file. The views are only valid
+        while d is open. T must match the element type of the file.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef DATASET
+#define DATASET
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <climits>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "arrayt.hpp"
+#include "arrayt_view.hpp"
+#include "mapped_file.hpp"
+
+using namespace std;
+
+enum dataset_dtype { DATASET_FLOAT64 = 1, DATASET_FLOAT32 = 2 };
+enum dataset_layout { DATASET_ROWS = 0, DATASET_COLUMNS = 1 };
+
+// element type of a file for each T
+template <class T> struct dataset_type;
+template <> struct dataset_type<double> { enum { value = DATASET_FLOAT64 }; };
+template <> struct dataset_type<float> { enum { value = DATASET_FLOAT32 }; };
+
+const char DATASET_MAGIC[8] = {'N', 'N', 'D', 'A', 'T', 'A', '1', '\0'};
+const uint32_t DATASET_ENDIAN = 0x01020304;
+
+struct dataset_header
+{
+    char magic[8];          // DATASET_MAGIC
+    uint32_t endian;        // DATASET_ENDIAN as the writer stored it
+    uint32_t dtype;         // dataset_dtype
+    uint32_t layout;        // dataset_layout
+    uint32_t names_bytes;   // size of the names after the header
+    int64_t rows, cols;     // cols counts features and targets
+    int64_t targets;        // the last targets columns are y
+    int64_t data_offset;    // where the values start, a multiple of 64
+    uint32_t tag_bytes;     // size of the tag after the names
+    char reserved[4];
+};
+static_assert(sizeof(dataset_header) == 64, "dataset_header must be 64 bytes");
+
+inline bool file_exists(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) return false;
+    fclose(fp);
+    return true;
+}
+
+template <class T>
+bool write_dataset(const char *path, arrayt_view<T> x, arrayt_view<T> y,
+    const vector<string>& names, const dataset_layout layout = DATASET_ROWS,
+    const string& tag = string())
+{
+    /*
+    Inputs:
+        path: file to write
+        x: features, rows x features (any strides)
+        y: targets, rows x targets, or an empty view for none
+        names: one per column (features then targets), or empty
+        layout: DATASET_ROWS or DATASET_COLUMNS
+        tag: any bytes to keep with the data
+    Output:
+        false (after printing why) if nothing was written
+    */
+    const long rows = x.n1();
+    const int nx = x.n2(), ny = (y.n() == 0) ? 0 : y.n2(), cols = nx + ny;
+    if (ny > 0 && y.n1() != rows){
+        cout << "write_dataset: x has " << rows << " rows, y has " << y.n1() << endl;
+        return false;
+    }
+    if (!names.empty() && (int) names.size() != cols){
+        cout << "write_dataset: " << names.size() << " names for " << cols << " columns" << endl;
+        return false;
+    }
+
+    string name_block;
+    for(int j=0; j < cols; j++)
+    {
+        if (!names.empty()) name_block += names[j];
+        else name_block += (j < nx ? "x" + to_string(j) : "y" + to_string(j - nx));
+        name_block += '\0';
+    }
+
+    dataset_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DATASET_MAGIC, sizeof(h.magic));
+    h.endian = DATASET_ENDIAN;
+    h.dtype = dataset_type<T>::value;
+    h.layout = layout;
+    h.names_bytes = (uint32_t) name_block.size();
+    h.tag_bytes = (uint32_t) tag.size();
+    h.rows = rows;
+    h.cols = cols;
+    h.targets = ny;
+    h.data_offset = (sizeof(h) + name_block.size() + tag.size() + 63)/64*64;
+
+    const string tmp = string(path) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (fp == NULL){
+        cout << "can't write " << tmp << endl;
+        return false;
+    }
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    ok = ok && fwrite(name_block.data(), 1, name_block.size(), fp) == name_block.size();
+    ok = ok && fwrite(tag.data(), 1, tag.size(), fp) == tag.size();
+    const vector<char> pad(h.data_offset - sizeof(h) - name_block.size() - tag.size(), 0);
+    ok = ok && fwrite(pad.data(), 1, pad.size(), fp) == pad.size();
+
+    // values through a buffer of about 64K elements
+    vector<T> buf;
+    buf.reserve(1 << 16);
+    if (layout == DATASET_ROWS)
+    {
+        for(long i=0; i < rows && ok; i++)
+        {
+            for(int j=0; j < nx; j++) buf.push_back(x(i, j));
+            for(int j=0; j < ny; j++) buf.push_back(y(i, j));
+            if (buf.size() >= (1 << 16) || i == rows-1){
+                ok = fwrite(buf.data(), sizeof(T), buf.size(), fp) == buf.size();
+                buf.clear();
+            }
+        }
+    }
+    else
+    {
+        for(int j=0; j < cols && ok; j++)
+        {
+            for(long i=0; i < rows && ok; i++)
+            {
+                buf.push_back(j < nx ? x(i, j) : y(i, j - nx));
+                if (buf.size() >= (1 << 16) || i == rows-1){
+                    ok = fwrite(buf.data(), sizeof(T), buf.size(), fp) == buf.size();
+                    buf.clear();
+                }
+            }
+        }
+    }
+    ok = (fclose(fp) == 0) && ok;
+    if (ok){
+        remove(path);   // rename() won't replace a file on Windows
+        ok = rename(tmp.c_str(), path) == 0;
+    }
+    if (!ok){
+        cout << "error writing " << path << endl;
+        remove(tmp.c_str());
+    }
+    return ok;
+}
+
+// overloads so arrays can be passed directly (see gemm in matrix.hpp)
+inline bool write_dataset(const char *path, arrayt_view<double> x, arrayt_view<double> y,
+    const vector<string>& names, const dataset_layout layout = DATASET_ROWS,
+    const string& tag = string())
+{ return write_dataset<double>(path, x, y, names, layout, tag); }
+
+inline bool write_dataset(const char *path, arrayt_view<float> x, arrayt_view<float> y,
+    const vector<string>& names, const dataset_layout layout = DATASET_ROWS,
+    const string& tag = string())
+{ return write_dataset<float>(path, x, y, names, layout, tag); }
+
+class dataset
+{
+public:
+    dataset() { memset(&h, 0, sizeof(h)); }
+
+    bool open(const char *path);
+    void close() { f.close(); memset(&h, 0, sizeof(h)); names_.clear(); tag_.clear(); }
+
+    long rows() const { return (long) h.rows; }
+    int features() const { return (int) (h.cols - h.targets); }
+    int targets() const { return (int) h.targets; }
+    dataset_dtype dtype() const { return (dataset_dtype) h.dtype; }
+    dataset_layout layout() const { return (dataset_layout) h.layout; }
+    size_t bytes() const { return f.size(); }
+    long data_offset() const { return (long) h.data_offset; }   // of the values
+    const vector<string>& names() const { return names_; }
+    const string& tag() const { return tag_; }
+
+    // zero copy views of the features and the targets
+    template <class T> arrayt_view<T> x() { return columns<T>(0, features()); }
+    template <class T> arrayt_view<T> y() { return columns<T>(features(), targets()); }
+
+private:
+    template <class T> arrayt_view<T> columns(const int j0, const int n);
+
+    mapped_file f;
+    dataset_header h;
+    vector<string> names_;
+    string tag_;
+    string path;
+
+    dataset(const dataset&);
+    dataset& operator=(const dataset&);
+};
+
+inline bool dataset::open(const char *file)
+{
+    close();
+    path = file;
+    if (!f.open(file, true)) return false;
+    if (f.size() >= sizeof(h)) memcpy(&h, f.data(), sizeof(h));
+    if (f.size() < sizeof(h) || memcmp(h.magic, DATASET_MAGIC, sizeof(h.magic)) != 0){
+        cout << path << " is not a dataset file" << endl;
+        close();
+        return false;
+    }
+    const size_t elem = (h.dtype == DATASET_FLOAT32) ? sizeof(float) : sizeof(double);
+    if (h.endian != DATASET_ENDIAN
+        || (h.dtype != DATASET_FLOAT64 && h.dtype != DATASET_FLOAT32)
+        || (h.layout != DATASET_ROWS && h.layout != DATASET_COLUMNS)
+        || h.rows < 0 || h.rows > INT_MAX || h.cols < 1 || h.cols > INT_MAX
+        || h.targets < 0 || h.targets > h.cols || h.data_offset % 64 != 0
+        || h.data_offset < (int64_t) sizeof(h) + h.names_bytes + h.tag_bytes){
+        cout << path << " has a header this version can't read" << endl;
+        close();
+        return false;
+    }
+    if ((uint64_t) h.data_offset + (uint64_t) h.rows*h.cols*elem > f.size()){
+        cout << path << " is truncated" << endl;
+        close();
+        return false;
+    }
+
+    const char *s = f.data() + sizeof(h), *end = s + h.names_bytes;
+    while (s < end)
+    {
+        const char *e = (const char*) memchr(s, '\0', end - s);
+        if (e == NULL) e = end;
+        names_.push_back(string(s, e));
+        s = e + 1;
+    }
+    tag_.assign(end, h.tag_bytes);
+    return true;
+}
+
+template <class T>
+arrayt_view<T> dataset::columns(const int j0, const int n)
+{
+    // columns j0 to j0+n-1 of the values, rows x n, empty if T is wrong
+    if (h.dtype != (uint32_t) dataset_type<T>::value){
+        cout << path << " holds " << (h.dtype == DATASET_FLOAT32 ? "float" : "double")
+            << " values, not " << (sizeof(T) == sizeof(float) ? "float" : "double") << endl;
+        return arrayt_view<T>();
+    }
+    T *p = (T*) (f.data() + h.data_offset);
+    if (h.layout == DATASET_ROWS) return arrayt_view<T>(p + j0, (int) h.rows, n, h.cols, 1);
+    return arrayt_view<T>(p + (long) j0*h.rows, (int) h.rows, n, 1, h.rows);
+}
+
+#endif
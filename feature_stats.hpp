@@ -0,0 +1,319 @@
+/*
+feature_stats.hpp
+
+Per-column statistics of the data (count, mean, variance, min and max),
+gathered while it is loaded, and standardization with them, so the features
+don't need a separate pass in Python before training.
+
+    running_stats s;
+    s.add(x)                        // Welford's update, one value at a time
+    s.merge(t)                      // s becomes the statistics of both sets
+    s.mean, s.stddev(), s.min, s.max
+
+    feature_stats f;                // one running_stats per column
+    f.add(x)                        // the rows of a view, as one block
+    f.merge(g)                      // g from other rows, same columns
+    f.columns(j0, n)                // columns j0 to j0+n-1 of f
+    f.str(), f.parse(s)             // as text, exactly (17 digits)
+    f.save(path, names), f.load(path)
+
+    compute_feature_stats(x)        // statistics of a whole view, on the
+                                    //   thread pool
+    standardize(x, f)               // x = (x - mean)/stddev in place, column
+                                    //   by column (a constant column is
+                                    //   only centered)
+
+load_csv() (csv.hpp), cached_csv (csv_cache.hpp) and data_stream
+(data_stream.hpp) fill a feature_stats as they read the values, each chunk
+while it is still in cache. The blocks are always merged in the order of
+the rows, so the result doesn't depend on the number of threads.
+
+The variance is of the values themselves (divided by n, not n - 1).
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef FEATURE_STATS
+#define FEATURE_STATS
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include "arrayt.hpp"
+#include "arrayt_view.hpp"
+#include "threadpool.hpp"
+
+using namespace std;
+
+// compute_feature_stats() hands out blocks of this many rows, one thread each
+#ifndef FEATURE_STATS_BLOCK_ROWS
+#define FEATURE_STATS_BLOCK_ROWS 8192
+#endif
+
+struct running_stats
+{
+    long n;         // values seen
+    double mean;
+    double m2;      // sum of squared differences from the mean
+    double min, max;
+
+    running_stats() : n(0), mean(0.0), m2(0.0), min(HUGE_VAL), max(-HUGE_VAL) {}
+
+    void add(const double x)
+    {
+        // Welford's update
+        n++;
+        const double d = x - mean;
+        mean += d/n;
+        m2 += d*(x - mean);
+        if (x < min) min = x;
+        if (x > max) max = x;
+    }
+
+    void merge(const running_stats& b);
+
+    double variance() const { return (n > 0) ? m2/n : 0.0; }
+    double stddev() const { return sqrt(variance()); }
+};
+
+inline void running_stats::merge(const running_stats& b)
+{
+    // Chan, Golub and LeVeque's combination of two sets of values,
+    //   no worse numerically than adding them one by one
+    if (b.n == 0) return;
+    if (n == 0){
+        *this = b;
+        return;
+    }
+    const long nab = n + b.n;
+    const double d = b.mean - mean;
+    mean += d*((double) b.n/nab);
+    m2 += b.m2 + d*d*((double) n*b.n/nab);
+    n = nab;
+    if (b.min < min) min = b.min;
+    if (b.max > max) max = b.max;
+}
+
+class feature_stats
+{
+public:
+    feature_stats() {}
+    explicit feature_stats(const int cols) : c(cols) {}
+
+    int cols() const { return (int) c.size(); }
+    long rows() const { return c.empty() ? 0 : c[0].n; }
+    bool empty() const { return rows() == 0; }
+    void clear() { c.clear(); }
+
+    const running_stats& operator[](const int j) const { return c[j]; }
+    running_stats& operator[](const int j) { return c[j]; }
+
+    template <class T> void add(arrayt_view<T> x);
+    void merge(const feature_stats& b);
+    feature_stats columns(const int j0, const int n) const;
+
+    string str(const vector<string>& names = vector<string>()) const;
+    bool parse(const string& s);
+    bool save(const char *path, const vector<string>& names = vector<string>()) const;
+    bool load(const char *path);
+
+private:
+    vector<running_stats> c;
+};
+
+template <class T>
+void feature_stats::add(arrayt_view<T> x)
+{
+    /*
+    Inputs:
+        x: rows x cols, the same number of columns every time
+    Description:
+        The mean and squared differences of the block are computed
+        exactly, in two passes over it (so it should be small enough to
+        stay in cache, like a chunk of a file being parsed), then merged
+        into the running totals.
+    */
+    const int n = x.n1(), m = x.n2();
+    if (c.empty()) c.resize(m);
+    if (n == 0) return;
+    if (m != cols()){
+        cout << "feature_stats: " << m << " columns added to " << cols() << endl;
+        return;
+    }
+
+    vector<running_stats> b(m);
+    for(int i=0; i < n; i++)
+    {
+        for(int j=0; j < m; j++)
+        {
+            const double v = x(i, j);
+            b[j].mean += v;
+            if (v < b[j].min) b[j].min = v;
+            if (v > b[j].max) b[j].max = v;
+        }
+    }
+    for(int j=0; j < m; j++) b[j].mean /= n;
+    for(int i=0; i < n; i++)
+    {
+        for(int j=0; j < m; j++)
+        {
+            const double d = x(i, j) - b[j].mean;
+            b[j].m2 += d*d;
+        }
+    }
+    for(int j=0; j < m; j++)
+    {
+        b[j].n = n;
+        c[j].merge(b[j]);
+    }
+}
+
+inline void feature_stats::merge(const feature_stats& b)
+{
+    if (b.c.empty()) return;
+    if (c.empty()) c.resize(b.c.size());
+    if (b.c.size() != c.size()){
+        cout << "feature_stats: can't merge " << b.c.size() << " columns into " << c.size() << endl;
+        return;
+    }
+    for(size_t j=0; j < c.size(); j++) c[j].merge(b.c[j]);
+}
+
+inline feature_stats feature_stats::columns(const int j0, const int n) const
+{
+    feature_stats s;
+    s.c.assign(c.begin() + j0, c.begin() + j0 + n);
+    return s;
+}
+
+inline string feature_stats::str(const vector<string>& names) const
+{
+    /*
+    One line per column:
+        name count mean stddev min max m2
+    names default to x0, x1, ..., blanks in a name become '_'.
+    17 significant digits, so parse() gets back the same doubles.
+    */
+    ostringstream s;
+    s << setprecision(17);
+    s << "# column count mean stddev min max m2\n";
+    for(int j=0; j < cols(); j++)
+    {
+        string name = ((int) names.size() == cols()) ? names[j] : "x" + to_string(j);
+        if (name.empty()) name = "x" + to_string(j);
+        for(size_t k=0; k < name.size(); k++)
+            if (name[k] == ' ' || name[k] == '\t' || name[k] == '\n' || name[k] == '\r') name[k] = '_';
+        const running_stats& r = c[j];
+        s << name << " " << r.n << " " << r.mean << " " << r.stddev() << " "
+            << r.min << " " << r.max << " " << r.m2 << "\n";
+    }
+    return s.str();
+}
+
+inline bool feature_stats::parse(const string& text)
+{
+    // from str(), false (and empty) if any line can't be read
+    c.clear();
+    istringstream s(text);
+    string line;
+    while (getline(s, line))
+    {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream f(line);
+        string name;
+        running_stats r;
+        double sd;
+        if (!(f >> name >> r.n >> r.mean >> sd >> r.min >> r.max >> r.m2) || r.n < 1){
+            c.clear();
+            return false;
+        }
+        c.push_back(r);
+    }
+    return !c.empty();
+}
+
+inline bool feature_stats::save(const char *path, const vector<string>& names) const
+{
+    ofstream f(path);
+    f << str(names);
+    f.close();
+    if (!f){
+        cout << "can't write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+inline bool feature_stats::load(const char *path)
+{
+    ifstream f(path);
+    if (!f){
+        cout << "can't read " << path << endl;
+        return false;
+    }
+    ostringstream s;
+    s << f.rdbuf();
+    if (!parse(s.str())){
+        cout << path << " doesn't hold feature statistics" << endl;
+        return false;
+    }
+    return true;
+}
+
+template <class T>
+feature_stats compute_feature_stats(arrayt_view<T> x)
+{
+    // the statistics of all of x, blocks of rows on the thread pool,
+    //   merged in order
+    const int n_blocks = (x.n1() + FEATURE_STATS_BLOCK_ROWS - 1)/FEATURE_STATS_BLOCK_ROWS;
+    vector<feature_stats> block(n_blocks);
+    parallel_for(n_blocks, 1, [&](const int b0, const int b1)
+    {
+        for(int b=b0; b < b1; b++)
+        {
+            const int i0 = b*FEATURE_STATS_BLOCK_ROWS;
+            const int n = (x.n1() - i0 < FEATURE_STATS_BLOCK_ROWS) ? x.n1() - i0 : FEATURE_STATS_BLOCK_ROWS;
+            block[b].add(view_rows(x, i0, n));
+        }
+    });
+    feature_stats s(x.n2());
+    for(int b=0; b < n_blocks; b++) s.merge(block[b]);
+    return s;
+}
+
+template <class T>
+void standardize(arrayt_view<T> x, const feature_stats& s)
+{
+    /*
+    Inputs:
+        x: rows x cols, overwritten with (x - mean)/stddev of each column
+        s: statistics with the same number of columns (e.g. saved with
+            the model, to treat new examples like the training data)
+    */
+    const int m = x.n2();
+    if (s.cols() != m){
+        cout << "standardize: " << s.cols() << " columns of statistics for " << m << endl;
+        return;
+    }
+    vector<T> shift(m), scale(m);
+    for(int j=0; j < m; j++)
+    {
+        const double sd = s[j].stddev();
+        shift[j] = (T) s[j].mean;
+        scale[j] = (T) ((sd > 0) ? 1.0/sd : 1.0);
+    }
+    // rows on the thread pool, serial below PARALLEL_THRESHOLD elements
+    parallel_for(x.n1(), PARALLEL_THRESHOLD/(2*(m > 0 ? m : 1)) + 1, [&](const int i0, const int i1)
+    {
+        for(int i=i0; i < i1; i++)
+            for(int j=0; j < m; j++) x(i, j) = (x(i, j) - shift[j])*scale[j];
+    });
+}
+
+#endif
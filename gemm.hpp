@@ -0,0 +1,252 @@
+/*
+gemm.hpp
+
+Cache-blocked, register-tiled general matrix multiply (GEMM) on raw strided
+buffers. dot() in matrix.hpp hands products to gemm_blocked() once they are
+large enough for the packing overhead to pay off.
+
+Computes
+    C = alpha*A*B + beta*C
+where A is m x k, B is k x n and C is m x n. Every operand is described by a
+pointer plus a row stride and a column stride, so element (i,j) of A lives at
+a[i*rsa + j*csa]. A row-major arrayt matrix has strides (n2, 1); swapping the
+strides reads the same memory as its transpose.
+
+Layout of the computation (Goto / BLIS style):
+    jc loop: NC wide column panels of B and C
+      pc loop: KC deep slices of A and B, B slice packed into bpack
+        ic loop: MC tall row panels of A, packed into apack
+          jr, ir loops: MR x NR register tiles computed by gemm_micro()
+
+The packed panels are contiguous and are walked with unit stride by the
+micro-kernel, so A and B are read from cache regardless of their original
+strides. Edge tiles are zero padded when packed.
+
+Everything is a template on the element type T (double or float). Each
+type has its own register tile (gemm_tile<T>). A vector register holds twice
+as many floats, and float's tile is wider still (4 x 32 against 4 x 8): with
+NR = 16 GCC vectorized the float kernel along MR instead of NR and it ran
+at a quarter of the speed of double.
+
+Products of at least GEMM_PARALLEL_THRESHOLD multiply-adds are split into
+row (or column) panels of C, a few per thread of the pool in threadpool.hpp,
+each done by the loops above with its own packing buffers. Every element of
+C sees the same sequence of operations however C is split, so the result
+doesn't depend on the number of threads.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef GEMM
+#define GEMM
+
+#include <vector>
+#include "threadpool.hpp"
+
+// register tile (per element type) and cache block sizes (in elements)
+//   MR x NR accumulators stay in registers, KC x NR panel of B in L1,
+//   MC x KC panel of A in L2, KC x NC panel of B in L3
+template <class T> struct gemm_tile;
+template <> struct gemm_tile<double> { enum { MR = 4, NR = 8 }; };
+template <> struct gemm_tile<float> { enum { MR = 4, NR = 32 }; };
+const int GEMM_MR = gemm_tile<double>::MR, GEMM_NR = gemm_tile<double>::NR;
+const int GEMM_KC = 256, GEMM_MC = 96, GEMM_NC = 2048;
+
+// products with fewer multiply-adds than this are left to the simple loop in dot()
+#ifndef GEMM_THRESHOLD
+#define GEMM_THRESHOLD (32*32*32)
+#endif
+
+// products with fewer multiply-adds than this run on one thread
+#ifndef GEMM_PARALLEL_THRESHOLD
+#define GEMM_PARALLEL_THRESHOLD (128*128*128)
+#endif
+
+template <class T>
+inline void gemm_pack_a(const int mc, const int kc, const T *a,
+    const long rsa, const long csa, T *apack)
+{
+    // pack an mc x kc block of A into row micro-panels of MR rows,
+    //   stored column by column so the micro-kernel reads them in order
+    const int MR = gemm_tile<T>::MR;
+    for(int i=0; i < mc; i += MR)
+    {
+        const int mr = (mc - i < MR) ? mc - i : MR;
+        for(int p=0; p < kc; p++)
+        {
+            for(int ii=0; ii < mr; ii++) apack[ii] = a[(i+ii)*rsa + p*csa];
+            for(int ii=mr; ii < MR; ii++) apack[ii] = 0;
+            apack += MR;
+        }
+    }
+}
+
+template <class T>
+inline void gemm_pack_b(const int kc, const int nc, const T *b,
+    const long rsb, const long csb, T *bpack)
+{
+    // pack a kc x nc block of B into column micro-panels of NR columns,
+    //   stored row by row
+    const int NR = gemm_tile<T>::NR;
+    for(int j=0; j < nc; j += NR)
+    {
+        const int nr = (nc - j < NR) ? nc - j : NR;
+        for(int p=0; p < kc; p++)
+        {
+            const T *bp = b + p*rsb + j*csb;
+            for(int jj=0; jj < nr; jj++) bpack[jj] = bp[jj*csb];
+            for(int jj=nr; jj < NR; jj++) bpack[jj] = 0;
+            bpack += NR;
+        }
+    }
+}
+
+template <class T>
+inline void gemm_micro(const int kc, const T *ap, const T *bp,
+    const T alpha, const T beta, T *c, const long rsc,
+    const long csc, const int mr, const int nr)
+{
+    /*
+    Computes one MR x NR tile of C from packed micro-panels.
+    The accumulators are a small fixed size local array so the compiler
+    keeps them in (vector) registers across the whole kc loop.
+    Only the mr x nr corner of the tile is written back to C.
+    */
+    const int MR = gemm_tile<T>::MR, NR = gemm_tile<T>::NR;
+    T ab[MR][NR];
+    for(int i=0; i < MR; i++)
+        for(int j=0; j < NR; j++) ab[i][j] = 0;
+
+    for(int p=0; p < kc; p++)
+    {
+        for(int i=0; i < MR; i++)
+        {
+            const T ai = ap[i];
+            for(int j=0; j < NR; j++) ab[i][j] += ai*bp[j];
+        }
+        ap += MR;
+        bp += NR;
+    }
+
+    for(int i=0; i < mr; i++)
+    {
+        for(int j=0; j < nr; j++)
+        {
+            T &cij = c[i*rsc + j*csc];
+            if (beta == 0) cij = alpha*ab[i][j];   // don't read C, it may be uninitialized
+            else cij = beta*cij + alpha*ab[i][j];
+        }
+    }
+}
+
+template <class T>
+void gemm_blocked_serial(const int m, const int n, const int k, const T alpha,
+    const T *a, const long rsa, const long csa,
+    const T *b, const long rsb, const long csb,
+    const T beta, T *c, const long rsc, const long csc)
+{
+    /*
+    Same arguments as gemm_blocked(), on the calling thread only.
+    See top of file for the loop structure.
+    The packing buffers are kept per thread and only grow.
+    */
+    if (m <= 0 || n <= 0) return;
+
+    const int MR = gemm_tile<T>::MR, NR = gemm_tile<T>::NR;
+    static thread_local std::vector<T> apack, bpack;
+    const size_t asize = (size_t) GEMM_MC*GEMM_KC;
+    const size_t bsize = (size_t) GEMM_KC*(GEMM_NC + NR);
+    if (apack.size() < asize) apack.resize(asize);
+    if (bpack.size() < bsize) bpack.resize(bsize);
+
+    if (k <= 0){
+        // empty sum, only the beta*C part remains
+        for(int i=0; i < m; i++)
+            for(int j=0; j < n; j++)
+            {
+                T &cij = c[i*rsc + j*csc];
+                cij = (beta == 0) ? 0 : beta*cij;
+            }
+        return;
+    }
+
+    for(int jc=0; jc < n; jc += GEMM_NC)
+    {
+        const int nc = (n - jc < GEMM_NC) ? n - jc : GEMM_NC;
+        for(int pc=0; pc < k; pc += GEMM_KC)
+        {
+            const int kc = (k - pc < GEMM_KC) ? k - pc : GEMM_KC;
+            // later k slices accumulate on top of the earlier ones
+            const T beta_p = (pc == 0) ? beta : 1;
+
+            gemm_pack_b(kc, nc, b + pc*rsb + jc*csb, rsb, csb, &bpack[0]);
+
+            for(int ic=0; ic < m; ic += GEMM_MC)
+            {
+                const int mc = (m - ic < GEMM_MC) ? m - ic : GEMM_MC;
+                gemm_pack_a(mc, kc, a + ic*rsa + pc*csa, rsa, csa, &apack[0]);
+
+                for(int jr=0; jr < nc; jr += NR)
+                {
+                    const int nr = (nc - jr < NR) ? nc - jr : NR;
+                    for(int ir=0; ir < mc; ir += MR)
+                    {
+                        const int mr = (mc - ir < MR) ? mc - ir : MR;
+                        gemm_micro(kc, &apack[ir*kc], &bpack[jr*kc], alpha, beta_p,
+                            c + (ic+ir)*rsc + (jc+jr)*csc, rsc, csc, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+}
+
+template <class T>
+void gemm_blocked(const int m, const int n, const int k, const T alpha,
+    const T *a, const long rsa, const long csa,
+    const T *b, const long rsb, const long csb,
+    const T beta, T *c, const long rsc, const long csc)
+{
+    /*
+    Inputs:
+        m, n, k: C is m x n, A is m x k, B is k x n
+        alpha, beta: scalars, C = alpha*A*B + beta*C
+        a, b, c: pointers to element (0,0) of each operand
+        rs*, cs*: row and column stride of each operand, in elements
+    Description:
+        Blocked matrix multiply. Big products are cut along the longer side
+        of C into panels (whole register tiles) that the threads of the pool
+        compute independently, each packing the part of B (or A) it needs.
+    */
+    if ((double) m*n*k < GEMM_PARALLEL_THRESHOLD || num_threads() == 1){
+        gemm_blocked_serial(m, n, k, alpha, a, rsa, csa, b, rsb, csb, beta, c, rsc, csc);
+        return;
+    }
+
+    const int MR = gemm_tile<T>::MR, NR = gemm_tile<T>::NR;
+    if (m >= n)
+    {
+        // panels of rows of A and C, counted in MR row tiles
+        const int tiles = (m + MR - 1)/MR;
+        parallel_for(tiles, 1, [=](int t0, int t1)
+        {
+            const int i0 = t0*MR, i1 = (t1*MR < m) ? t1*MR : m;
+            gemm_blocked_serial(i1 - i0, n, k, alpha, a + i0*rsa, rsa, csa,
+                b, rsb, csb, beta, c + i0*rsc, rsc, csc);
+        });
+    }
+    else
+    {
+        // panels of columns of B and C, counted in NR column tiles
+        const int tiles = (n + NR - 1)/NR;
+        parallel_for(tiles, 1, [=](int t0, int t1)
+        {
+            const int j0 = t0*NR, j1 = (t1*NR < n) ? t1*NR : n;
+            gemm_blocked_serial(m, j1 - j0, k, alpha, a, rsa, csa,
+                b + j0*csb, rsb, csb, beta, c + j0*csc, rsc, csc);
+        });
+    }
+}
+
+#endif
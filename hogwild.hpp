@@ -0,0 +1,100 @@
+/*
+hogwild.hpp
+
+Lock-free updates of weights shared by several training threads, as in
+"Hogwild!" (Niu, Recht, Re and Wright, 2011): every thread reads the shared
+weights, computes a gradient on its own examples and subtracts it from the
+shared weights, with no lock and no waiting for the other threads.
+
+    hogwild_load(w, local):         local = w, element by element
+    hogwild_sub(w, alpha, grad):    w = w - alpha*grad, element by element
+    hogwild_shard(n, t, p, b, e):   rows [b, e) of n for thread t of p
+    hogwild_run(p, body):           body(t) for t = 0 .. p-1 on p threads
+                                    (t = 0 on the calling thread)
+
+Every element of the shared weights is read and written with a relaxed
+atomic load or store. For an aligned double that is a plain 8 byte move on
+x86 and ARM64, no lock and no fence, but it makes the races well defined:
+a reader sees the old or the new value of an element, never half of each.
+An update is a load and a store, not one atomic read-modify-write, so when
+two threads update the same weight at the same moment one of the updates
+can be lost, and a thread's copy of the weights can mix elements from
+different updates. For SGD on a small model either is a little extra noise
+in the gradient, which is the bargain Hogwild makes for not synchronizing.
+
+Keep the shared weights in arrays of their own (arrayt storage is aligned
+to a cache line, see arrayt_alloc.hpp) and give every thread its own copies
+and buffers, so the weights are the only memory the threads write to in
+common.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef HOGWILD
+#define HOGWILD
+
+#include <vector>
+#include <thread>
+#include "arrayt.hpp"
+
+using namespace std;
+
+template <class T>
+inline T relaxed_load(const T *p)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    T v;
+    __atomic_load(p, &v, __ATOMIC_RELAXED);
+    return v;
+#else
+    return *(const volatile T*) p;     // MSVC: aligned 8 byte moves are atomic
+#endif
+}
+
+template <class T>
+inline void relaxed_store(T *p, T v)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    __atomic_store(p, &v, __ATOMIC_RELAXED);
+#else
+    *(volatile T*) p = v;
+#endif
+}
+
+template <class T>
+void hogwild_load(const arrayt<T>& w, arrayt<T>& local)
+{
+    // a snapshot of the shared weights w into this thread's local copy
+    const T *pw = w.data();
+    T *pl = local.data();
+    for(int i=0; i < w.n(); i++) pl[i] = relaxed_load(pw + i);
+}
+
+template <class T>
+void hogwild_sub(arrayt<T>& w, const T alpha, const arrayt<T>& grad)
+{
+    // w = w - alpha*grad on the shared weights, one element at a time
+    T *pw = w.data();
+    const T *pg = grad.data();
+    for(int i=0; i < w.n(); i++) relaxed_store(pw + i, relaxed_load(pw + i) - alpha*pg[i]);
+}
+
+inline void hogwild_shard(const int n, const int t, const int p, int& begin, int& end)
+{
+    // thread t's share of n rows, p contiguous shards whose sizes differ by at most one
+    begin = (int) ((long) n*t/p);
+    end = (int) ((long) n*(t+1)/p);
+}
+
+template <class F>
+void hogwild_run(const int p, F body)
+{
+    // body(t) on p threads at once, returns when they have all finished
+    vector<thread> workers;
+    for(int t=1; t < p; t++) workers.push_back(thread([&body, t]{ body(t); }));
+    body(0);
+    for(size_t i=0; i < workers.size(); i++) workers[i].join();
+}
+
+#endif
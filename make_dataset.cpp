@@ -0,0 +1,104 @@
+/*
+make_dataset.cpp
+
+Converts the csv training data into a binary dataset file (dataset.hpp)
+that nn.cpp maps at startup instead of parsing the text.
+
+    make_dataset [x.csv y.csv out.nnd] [float] [columns]
+
+    x.csv, y.csv: features and labels, one example per line
+                  (default x_prep.txt and y_prep.txt)
+    out.nnd:      the dataset to write (default prep.nnd)
+    float:        store floats instead of doubles
+    columns:      store column after column instead of row after row
+
+Column names come from the header lines of the csv files, if they have them.
+The mean, variance, min and max of every column, gathered while the files
+are parsed, are stored in the tag of the dataset (see feature_stats.hpp), so
+nn.cpp can standardize the features without reading them twice.
+
+Compile with e.g.
+    g++ -std=c++17 -O2 -pthread -o make_dataset make_dataset.cpp
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "csv.hpp"
+#include "dataset.hpp"
+#include "feature_stats.hpp"
+
+template <class T>
+bool convert_files(const char *x_path, const char *y_path, const char *out,
+    const dataset_layout layout)
+{
+    // load both csv files as T and write them as one dataset
+    arrayt<T> x, y;
+    csv_stats stats;
+    feature_stats x_stats, y_stats;
+    if (!load_csv(x_path, x, stats, &x_stats)) return false;
+    print_csv_stats(x_path, stats);
+    if (!load_csv(y_path, y, stats, &y_stats)) return false;
+    print_csv_stats(y_path, stats);
+
+    arrayt_view<T> xv(x), yv(y);
+    if (yv.n1() != xv.n1()){
+        cout << x_path << " has " << xv.n1() << " rows but " << y_path << " has "
+            << yv.n1() << endl;
+        return false;
+    }
+
+    // names from the headers, only if both files have one that fits
+    vector<string> names, x_names, y_names;
+    if (csv_header(x_path, x_names) && csv_header(y_path, y_names)
+        && (int) x_names.size() == xv.n2() && (int) y_names.size() == yv.n2()){
+        names = x_names;
+        names.insert(names.end(), y_names.begin(), y_names.end());
+    }
+    else{
+        x_names.clear();
+        y_names.clear();
+        for(int j=0; j < yv.n2(); j++) y_names.push_back("y" + to_string(j));
+    }
+    return write_dataset<T>(out, xv, yv, names, layout, x_stats.str(x_names) + y_stats.str(y_names));
+}
+
+int main(int argc, char *argv[])
+{
+    const char *x_path = "x_prep.txt", *y_path = "y_prep.txt", *out = "prep.nnd";
+    bool use_float = false;
+    dataset_layout layout = DATASET_ROWS;
+
+    vector<const char*> files;
+    for(int i=1; i < argc; i++)
+    {
+        const string arg = argv[i];
+        if (arg == "float") use_float = true;
+        else if (arg == "columns") layout = DATASET_COLUMNS;
+        else files.push_back(argv[i]);
+    }
+    if (files.size() == 3){
+        x_path = files[0];
+        y_path = files[1];
+        out = files[2];
+    }
+    else if (!files.empty()){
+        cout << "usage: make_dataset [x.csv y.csv out.nnd] [float] [columns]" << endl;
+        return(EXIT_FAILURE);
+    }
+
+    const bool ok = use_float ? convert_files<float>(x_path, y_path, out, layout)
+        : convert_files<double>(x_path, y_path, out, layout);
+    if (!ok) return(EXIT_FAILURE);
+
+    dataset d;
+    if (!d.open(out)) return(EXIT_FAILURE);
+    cout << "wrote " << out << ": " << d.rows() << " rows, " << d.features() << " features, "
+        << d.targets() << " target(s), " << (use_float ? "float" : "double")
+        << (layout == DATASET_ROWS ? ", by rows, " : ", by columns, ") << d.bytes() << " bytes" << endl;
+    return(EXIT_SUCCESS);
+}
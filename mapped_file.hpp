@@ -0,0 +1,129 @@
+/*
+mapped_file.hpp
+
+View of a whole file in memory, for the loaders in csv.hpp and dataset.hpp.
+
+On Linux and macOS the file is memory mapped, so the pages come straight from
+the OS file cache with no copy and no buffer to allocate. Elsewhere (Windows)
+the file is read into one buffer with a single fread.
+
+    mapped_file f;
+    if (!f.open("x_prep.txt")) ...   // prints why and returns false
+    f.data(), f.size()               // the bytes of the file
+    f.open(path, true)               // pages may be written, the changes
+                                     //   stay in this process (copy on
+                                     //   write) and never reach the file
+    f.close()                        // or let the destructor do it
+
+An empty file opens fine with size() == 0.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef MAPPED_FILE
+#define MAPPED_FILE
+
+#include <cstdio>
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPED_FILE_MMAP
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+class mapped_file
+{
+public:
+    mapped_file() : p(NULL), n(0), mapped(false) {}
+    ~mapped_file() { close(); }
+
+    bool open(const char *path, const bool writable = false);
+    void close();
+
+    const char* data() const { return p; }
+    char* data() { return p; }      // only write if opened writable
+    size_t size() const { return n; }
+
+private:
+    char *p;
+    size_t n;
+    bool mapped;         // p is from mmap (otherwise it points into buf)
+    vector<char> buf;
+
+    mapped_file(const mapped_file&);
+    mapped_file& operator=(const mapped_file&);
+};
+
+inline bool mapped_file::open(const char *path, const bool writable)
+{
+    close();
+#ifdef MAPPED_FILE_MMAP
+    const int fd = ::open(path, O_RDONLY);
+    if (fd < 0){
+        cout << "can't open " << path << endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0){
+        cout << "can't stat " << path << endl;
+        ::close(fd);
+        return false;
+    }
+    n = (size_t) st.st_size;
+    if (n > 0){
+        void *m = mmap(NULL, n, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED){
+            cout << "can't map " << path << endl;
+            ::close(fd);
+            n = 0;
+            return false;
+        }
+        // read front to back, let the kernel read ahead
+        madvise(m, n, MADV_SEQUENTIAL);
+        p = (char*) m;
+        mapped = true;
+    }
+    ::close(fd);    // the mapping stays valid
+    return true;
+#else
+    (void) writable;    // our own buffer, always writable
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL){
+        cout << "can't open " << path << endl;
+        return false;
+    }
+    fseek(fp, 0, SEEK_END);
+    const long len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    buf.resize(len > 0 ? len : 0);
+    n = (len > 0 && fread(&buf[0], 1, len, fp) == (size_t) len) ? (size_t) len : 0;
+    fclose(fp);
+    if (len > 0 && n == 0){
+        cout << "can't read " << path << endl;
+        return false;
+    }
+    p = buf.empty() ? NULL : &buf[0];
+    return true;
+#endif
+}
+
+inline void mapped_file::close()
+{
+#ifdef MAPPED_FILE_MMAP
+    if (mapped) munmap(p, n);
+#endif
+    p = NULL;
+    n = 0;
+    mapped = false;
+    vector<char>().swap(buf);
+}
+
+#endif
@@ -2,27 +2,59 @@
 matrix.hpp
 
 Implements linear algebra operations for arrayt<double> vectors and matrices
-needed for matrix based neural networks. 
+needed for matrix based neural networks. Everything is a template on the
+element type, so arrayt<float> works too (float kernels do twice as many
+elements per vector register and move half the bytes).
 
 Functions:
     dot:
         matrix multiplication
         matrix vector multiplication
         vector vector dot product
+        (large products go through the blocked GEMM in gemm.hpp)
+    gemm:
+        C = alpha*op(A)*op(B) + beta*C, op() optionally transposes,
+        without ever forming the transposed matrix
     transpose:
-        transposes matrix or vector
+        transposes matrix or vector (cache-oblivious, into a new array;
+        transposeInPlace for square matrices)
     multiply:
         element-wise mutliplication of matrices or vectors
     applyFunction:
-        applies a function to each element of matrix or vector
+        applies a function to each element of matrix or vector, into a new
+        array or into a caller provided one (applyFunctionInPlace to
+        overwrite the input); the function is a template parameter so
+        functors from activations.hpp are inlined and vectorized
+    dense_forward:
+        fused layer act(W^T [x; bias]) into a caller provided vector,
+        bias handled implicitly, no allocation
+    dense_forward_batch, dense_backward:
+        the same layer for a batch of examples (one per row) as one gemm,
+        and its weight gradient [X, bias]^T D and input gradient D W^T
     Overwrites '-' for matrices and vectors:
         element-wise subtraction
     Overwrites '+' for matrices and vectors:
         element-wise addition
     Overwrites '*' for double and matrix/vector:
         scalar multiplication
+    ('-', '+' and '*' are expression templates, a whole expression like
+     w = w - alpha*grad is evaluated in one loop without temporary arrays)
+    convert:
+        copies between element types, e.g. double weights to float
+        (also makes a compact array from a strided view)
+    gather_rows:
+        copies a list of rows of a matrix (e.g. a shuffled mini-batch)
+        into a compact block
     print:
         outputs matrix or vector
+
+    multiply and the simple forms a+b, a-b, s*a run on the vector kernels in
+    simd.hpp, chosen at startup for the instruction sets the CPU supports
+
+    dot/gemm, transpose, multiply, applyFunction and the '+', '-', '*'
+    expressions split big arrays across the thread pool in threadpool.hpp
+    (set_num_threads(), or NN_THREADS at startup); each element is computed
+    the same way on any number of threads
     
 Run on Windows 10 in Visual Studio Code
 AEP 4380 
@@ -35,19 +67,26 @@ Author: Collin Farquhar
 #include <cstdlib>
 #include <iostream> //  stream IO
 #include <iomanip>  //  to format the output
+#include <algorithm> // min
 #include "arrayt.hpp" // Author: Dr. Kirkland, Cornell
+#include "arrayt_view.hpp" // non-owning views (rows, blocks) of arrayt
+#include "gemm.hpp"   // cache-blocked matrix multiply
+#include "simd.hpp"   // vectorized element-wise kernels
+#include "threadpool.hpp" // shared worker threads
+#include "activations.hpp" // activation functors for applyFunction
 
 using namespace std;
 
-arrayt<double> dot(arrayt<double>& a, arrayt<double>& b)
+template <class T>
+arrayt<T> dot(arrayt<T>& a, arrayt<T>& b)
 {
     /*
     Returns the product of matrices or vectors
     Inputs: 
-        a: array<double> matrix of size a_r, a_c
-        b: array<double> matrix of size b_r x b_c
+        a: array<T> matrix of size a_r, a_c (T = double or float)
+        b: array<T> matrix of size b_r x b_c
     Output:
-        product: array<double> of the resulting matrix/vector after matrix 
+        product: array<T> of the resulting matrix/vector after matrix 
         mulitiplication of a and b
     Description:
         If a and b are matrices, perform matrix multiplication, product is matrix
@@ -62,51 +101,430 @@ arrayt<double> dot(arrayt<double>& a, arrayt<double>& b)
         cout << "dot product dimensions do not match" << endl;
         //exit(EXIT_FAILURE); // uncomment if you'd like the program to stop
     }
-    arrayt<double> product(a_r, b_c);
+    arrayt<T> product(a_r, b_c);
 
+    // big products: packed, cache-blocked kernel
+    if ((double) a_r*b_c*a_c >= GEMM_THRESHOLD)
+    {
+        gemm_blocked<T>(a_r, b_c, a_c, 1, a.data(), a_c, 1, b.data(), b_c, 1,
+            0, product.data(), b_c, 1);
+        return product;
+    }
+
+    // small products: i-k-j order so the inner loop runs along rows of b and product
+    const T *pa = a.data(), *pb = b.data();
+    T *pp = product.data();
     for(int i=0; i < a_r; i++)
     {
-        for(int j=0; j < b_c; j++)
+        T *prow = pp + i*b_c;
+        for(int j=0; j < b_c; j++) prow[j] = 0;
+        for(int k=0; k < a_c; k++)
+        {
+            const T aik = pa[i*a_c + k];
+            const T *brow = pb + k*b_c;
+            for(int j=0; j < b_c; j++) prow[j] += aik*brow[j];
+        }
+    }
+    return product;
+}
+
+template <class T>
+void gemm(bool transA, bool transB, T alpha, arrayt_view<T> A,
+    arrayt_view<T> B, T beta, arrayt_view<T> C)
+{
+    /*
+    General matrix multiply, C = alpha*op(A)*op(B) + beta*C
+    Inputs:
+        transA, transB: if true use the transpose of A (or B)
+        alpha, beta: scalars
+        A, B: arrayt<T> matrices (or n x 1 vectors), or views into them
+        C: arrayt<T> output (or view), must already be op(A) rows x op(B) columns
+    Description:
+        Transposed operands are read in place by swapping their row and
+        column strides (the same goes for views of a row or a block of rows), so gemm(true, false, 1.0, w, x, 0.0, y) computes
+        y = transpose(w)*x without allocating or copying transpose(w).
+        With beta = 0, C is only written (its old contents are ignored).
+    */
+
+    // op(A) is m x k, op(B) is k x n, strides as seen through op()
+    const int m = transA ? A.n2() : A.n1(), ka = transA ? A.n1() : A.n2();
+    const int kb = transB ? B.n2() : B.n1(), n = transB ? B.n1() : B.n2();
+    const long rsa = transA ? A.s2() : A.s1(), csa = transA ? A.s1() : A.s2();
+    const long rsb = transB ? B.s2() : B.s1(), csb = transB ? B.s1() : B.s2();
+    const long rsc = C.s1(), csc = C.s2();
+
+    if (ka != kb || C.n1() != m || C.n2() != n){
+        cout << "gemm dimensions do not match" << endl;
+        return;
+    }
+    const int k = ka;
+
+    // big products: packed, cache-blocked kernel
+    if ((double) m*n*k >= GEMM_THRESHOLD)
+    {
+        gemm_blocked(m, n, k, alpha, A.data(), rsa, csa, B.data(), rsb, csb,
+            beta, C.data(), rsc, csc);
+        return;
+    }
+
+    // small products (e.g. a weight matrix times one example)
+    const T *pa = A.data(), *pb = B.data();
+    T *pc = C.data();
+    if (beta == 0 && csb == 1 && csc == 1)
+    {
+        // rows of op(B) and C contiguous (e.g. a batch of examples times a
+        //   weight matrix): i-k-j order so the inner loop runs along them,
+        //   each C(i,j) still summed over p in order, so the bits are the same
+        for(int i=0; i < m; i++)
         {
-            product(i, j) = 0.0;
-            for(int k=0; k < a_c; k++)
+            T *crow = pc + i*rsc;
+            for(int j=0; j < n; j++) crow[j] = 0;
+            for(int p=0; p < k; p++)
             {
-                product(i,j) += a(i, k)*b(k, j);
+                const T aip = pa[i*rsa + p*csa];
+                const T *brow = pb + p*rsb;
+                for(int j=0; j < n; j++) crow[j] += aip*brow[j];
             }
+            if (alpha != 1) for(int j=0; j < n; j++) crow[j] *= alpha;
+        }
+        return;
+    }
+    for(int i=0; i < m; i++)
+    {
+        for(int j=0; j < n; j++)
+        {
+            T sum = 0;
+            for(int p=0; p < k; p++) sum += pa[i*rsa + p*csa]*pb[p*rsb + j*csb];
+            T &cij = pc[i*rsc + j*csc];
+            if (beta == 0) cij = alpha*sum;
+            else cij = beta*cij + alpha*sum;
         }
     }
-    return product;
 }
 
-arrayt<double> transpose(arrayt<double>& x)
+// a view parameter doesn't deduce T from an arrayt argument, so these
+//   overloads (which take either, an arrayt becomes a view of all of it)
+//   are what callers normally get
+inline void gemm(bool transA, bool transB, double alpha, arrayt_view<double> A,
+    arrayt_view<double> B, double beta, arrayt_view<double> C)
+{ gemm<double>(transA, transB, alpha, A, B, beta, C); }
+
+inline void gemm(bool transA, bool transB, float alpha, arrayt_view<float> A,
+    arrayt_view<float> B, float beta, arrayt_view<float> C)
+{ gemm<float>(transA, transB, alpha, A, B, beta, C); }
+
+template <class T>
+inline long vec_stride(const arrayt_view<T>& v)
+{
+    // distance between consecutive elements of an n x 1 or 1 x n view
+    return (v.n2() == 1) ? v.s1() : v.s2();
+}
+
+template <class T, class F>
+void dense_forward(arrayt_view<T> W, arrayt_view<T> x, T bias,
+    F act, arrayt_view<T> out, arrayt_view<T> pre)
+{
+    /*
+    Fused dense layer: out = act(W^T [x; bias])
+    Inputs:
+        W: (n_in+1) x n_out weights, the last row multiplies the bias
+        x: n_in x 1 input vector (or a view of a row of the data)
+        bias: value of the implicit extra input
+        act: activation, called as act(z) on each pre-activation
+        out: n_out x 1, receives the activations
+        pre: n_out x 1, receives the pre-activations W^T [x; bias]
+             (needed for backprop, may be the same as out)
+    Description:
+        One pass over W, a row at a time (rows are contiguous):
+            pre = sum_i x(i)*W(i,:) + bias*W(n_in,:)
+        then the activation is applied while the result is still in cache.
+        Neither the augmented input [x; bias] nor W^T is ever formed, and
+        nothing is allocated. The summation order is the same as
+        gemm(true, false, ...) on an augmented input, so results match it.
+    */
+    const int n_in = x.n(), n_out = W.n2();
+    if (W.n1() != n_in+1 || out.n() != n_out || pre.n() != n_out){
+        cout << "dense_forward dimensions do not match" << endl;
+        return;
+    }
+
+    const T *w = W.data(), *px = x.data();
+    T *z = pre.data(), *y = out.data();
+    const long sx = vec_stride(x), sz = vec_stride(pre), sy = vec_stride(out);
+
+    for(int j=0; j < n_out; j++) z[j*sz] = 0;
+    for(int i=0; i <= n_in; i++)
+    {
+        const T xi = (i < n_in) ? px[i*sx] : bias;
+        const T *wrow = w + i*W.s1();
+        for(int j=0; j < n_out; j++) z[j*sz] += xi*wrow[j*W.s2()];
+    }
+    for(int j=0; j < n_out; j++) y[j*sy] = act(z[j*sz]);
+}
+
+// overloads taking arrayt or views (see gemm), with or without pre
+template <class F>
+void dense_forward(arrayt_view<double> W, arrayt_view<double> x, double bias,
+    F act, arrayt_view<double> out, arrayt_view<double> pre)
+{ dense_forward<double, F>(W, x, bias, act, out, pre); }
+
+template <class F>
+void dense_forward(arrayt_view<float> W, arrayt_view<float> x, float bias,
+    F act, arrayt_view<float> out, arrayt_view<float> pre)
+{ dense_forward<float, F>(W, x, bias, act, out, pre); }
+
+template <class F>
+void dense_forward(arrayt_view<double> W, arrayt_view<double> x, double bias,
+    F act, arrayt_view<double> out)
+{ dense_forward<double, F>(W, x, bias, act, out, out); }
+
+template <class F>
+void dense_forward(arrayt_view<float> W, arrayt_view<float> x, float bias,
+    F act, arrayt_view<float> out)
+{ dense_forward<float, F>(W, x, bias, act, out, out); }
+
+template <class T, class F>
+void dense_forward_batch(arrayt_view<T> W, arrayt_view<T> X, T bias,
+    F act, arrayt_view<T> out, arrayt_view<T> pre)
+{
+    /*
+    Dense layer on a batch: out = act([X, bias] W), row by row
+    Inputs:
+        W: (n_in+1) x n_out weights, the last row multiplies the bias
+        X: batch x n_in, one example per row (e.g. view_rows of the data)
+        bias: value of the implicit extra input
+        act: activation
+        out: batch x n_out, receives the activations
+        pre: batch x n_out, receives the pre-activations (may be out)
+    Description:
+        pre = X W[0:n_in] is one gemm (the blocked kernel once the batch is
+        big enough), then the bias row is added and act applied in one pass
+        while pre is in cache. Row i gives the same bits as dense_forward()
+        on row i of X (the sums are in the same order), and nothing is
+        allocated.
+    */
+    const int n_in = X.n2(), n_out = W.n2(), b = X.n1();
+    if (W.n1() != n_in+1 || out.n1() != b || out.n2() != n_out
+        || pre.n1() != b || pre.n2() != n_out){
+        cout << "dense_forward_batch dimensions do not match" << endl;
+        return;
+    }
+    gemm<T>(false, false, 1, X, view_rows(W, 0, n_in), 0, pre);
+    const arrayt_view<T> wb = view_row(W, n_in);
+    for(int i=0; i < b; i++)
+    {
+        for(int j=0; j < n_out; j++)
+        {
+            const T z = pre(i, j) + bias*wb(j);
+            pre(i, j) = z;
+            out(i, j) = act(z);
+        }
+    }
+}
+
+template <class T>
+void dense_backward(arrayt_view<T> W, arrayt_view<T> X, T bias,
+    arrayt_view<T> D, arrayt_view<T> gW, arrayt_view<T> dX)
+{
+    /*
+    Gradients of a dense layer over a batch
+    Inputs:
+        W: (n_in+1) x n_out weights of the layer
+        X: batch x n_in, its inputs
+        bias: value of the implicit extra input
+        D: batch x n_out, gradient of the loss with respect to the
+           pre-activations (summed over the batch, so scale it first for
+           a mean)
+        gW: (n_in+1) x n_out, receives [X, bias]^T D
+        dX: batch x n_in, receives D W[0:n_in]^T, the gradient with respect
+            to X (before the previous layer's activation derivative), or
+            an empty view if it isn't needed
+    Description:
+        Two gemms with transposed operands read in place, plus the bias
+        row as bias times the column sums of D. Nothing is allocated.
+    */
+    const int n_in = X.n2(), n_out = W.n2(), b = X.n1();
+    if (W.n1() != n_in+1 || D.n1() != b || D.n2() != n_out
+        || gW.n1() != n_in+1 || gW.n2() != n_out
+        || (dX.n() > 0 && (dX.n1() != b || dX.n2() != n_in))){
+        cout << "dense_backward dimensions do not match" << endl;
+        return;
+    }
+    gemm<T>(true, false, 1, X, D, 0, view_rows(gW, 0, n_in));
+    for(int j=0; j < n_out; j++)
+    {
+        T sum = 0;
+        for(int i=0; i < b; i++) sum += D(i, j);
+        gW(n_in, j) = bias*sum;
+    }
+    if (dX.n() > 0) gemm<T>(false, true, 1, D, view_rows(W, 0, n_in), 0, dX);
+}
+
+// overloads taking arrayt or views (see gemm)
+template <class F>
+void dense_forward_batch(arrayt_view<double> W, arrayt_view<double> X, double bias,
+    F act, arrayt_view<double> out, arrayt_view<double> pre)
+{ dense_forward_batch<double, F>(W, X, bias, act, out, pre); }
+
+template <class F>
+void dense_forward_batch(arrayt_view<float> W, arrayt_view<float> X, float bias,
+    F act, arrayt_view<float> out, arrayt_view<float> pre)
+{ dense_forward_batch<float, F>(W, X, bias, act, out, pre); }
+
+inline void dense_backward(arrayt_view<double> W, arrayt_view<double> X, double bias,
+    arrayt_view<double> D, arrayt_view<double> gW, arrayt_view<double> dX)
+{ dense_backward<double>(W, X, bias, D, gW, dX); }
+
+inline void dense_backward(arrayt_view<float> W, arrayt_view<float> X, float bias,
+    arrayt_view<float> D, arrayt_view<float> gW, arrayt_view<float> dX)
+{ dense_backward<float>(W, X, bias, D, gW, dX); }
+
+// blocks with both sides at most one cache line (8 doubles, 16 floats) are
+//   transposed by the plain loop; bigger blocks lose to cache set conflicts
+//   when the row length is a power of two (32 x 32 ran at a third of the speed)
+#ifndef TRANSPOSE_BLOCK_BYTES
+#define TRANSPOSE_BLOCK_BYTES 64
+#endif
+
+template <class T>
+void transpose_block(const int r, const int c, const T *a, const long lda,
+    T *b, const long ldb)
+{
+    /*
+    Inputs:
+        r, c: block of a is r x c
+        a, lda: first element and row stride of the source
+        b, ldb: first element and row stride of the c x r destination
+    Description:
+        b = transpose(a), cache-oblivious: the longer side is halved until
+        the block fits in L1, so for any cache size the rows read from a
+        and the rows written to b both stay in cache while they are in use
+    */
+    const int B = TRANSPOSE_BLOCK_BYTES/sizeof(T);
+    if (r <= B && c <= B){
+        for(int i=0; i < r; i++)
+            for(int j=0; j < c; j++) b[j*ldb + i] = a[i*lda + j];
+        return;
+    }
+    if (r >= c){
+        const int h = r/2;
+        transpose_block(h, c, a, lda, b, ldb);
+        transpose_block(r - h, c, a + h*lda, lda, b + h, ldb);
+    }
+    else {
+        const int h = c/2;
+        transpose_block(r, h, a, lda, b, ldb);
+        transpose_block(r, c - h, a + h, lda, b + h*ldb, ldb);
+    }
+}
+
+template <class T>
+void transpose_swap(const int r, const int c, T *a, T *b, const long ld)
+{
+    // swaps the r x c block at a with the transpose of the c x r block at b
+    //   (same row stride ld), halving the longer side like transpose_block()
+    const int B = TRANSPOSE_BLOCK_BYTES/sizeof(T);
+    if (r <= B && c <= B){
+        for(int i=0; i < r; i++)
+            for(int j=0; j < c; j++) swap(a[i*ld + j], b[j*ld + i]);
+        return;
+    }
+    if (r >= c){
+        const int h = r/2;
+        transpose_swap(h, c, a, b, ld);
+        transpose_swap(r - h, c, a + h*ld, b + h, ld);
+    }
+    else {
+        const int h = c/2;
+        transpose_swap(r, h, a, b, ld);
+        transpose_swap(r, c - h, a + h, b + h*ld, ld);
+    }
+}
+
+template <class T>
+void transpose_square(const int n, T *a, const long ld)
+{
+    // transposes the n x n block at a in place: the two diagonal quarters
+    //   recursively, then the off-diagonal quarters swapped with each other
+    const int B = TRANSPOSE_BLOCK_BYTES/sizeof(T);
+    if (n <= B){
+        for(int i=0; i < n; i++)
+            for(int j=i+1; j < n; j++) swap(a[i*ld + j], a[j*ld + i]);
+        return;
+    }
+    const int h = n/2;
+    transpose_square(h, a, ld);
+    transpose_square(n - h, a + h*ld + h, ld);
+    transpose_swap(h, n - h, a + h, a + h*ld, ld);
+}
+
+template <class T>
+arrayt<T> transpose(arrayt<T>& x)
 {
     /*
     Returns the transpose of x
-    Input: arrayt<double> matrix x
-    Output: arrayt<double> matrix xT
+    Input: arrayt<T> matrix x
+    Output: arrayt<T> matrix xT
     Description: 
-        Takes transpose of x and stores it in a xT, flips rows and columns
+        Takes transpose of x and stores it in a xT, flips rows and columns.
+        Bands along the longer side of x go to the threads, each band is
+        transposed by the cache-oblivious transpose_block()
     */
     const int r = x.n1(), c = x.n2();
-    arrayt<double> xT(c,r);
+    arrayt<T> xT(c,r);
 
-    for(int i=0; i < r; i++)
-    {
-        for(int j=0; j < c; j++)
+    const T *px = x.data();
+    T *pt = xT.data();
+    if (r >= c){
+        // bands of rows of x (columns of xT)
+        parallel_for(r, (PARALLEL_THRESHOLD/2)/c + 1, [=](int i0, int i1)
         {
-            xT(j,i) = x(i,j);
-        }
+            transpose_block(i1 - i0, c, px + (long) i0*c, c, pt + i0, r);
+        });
+    }
+    else {
+        // bands of columns of x (rows of xT)
+        parallel_for(c, (PARALLEL_THRESHOLD/2)/r + 1, [=](int j0, int j1)
+        {
+            transpose_block(r, j1 - j0, px + j0, c, pt + (long) j0*r, r);
+        });
     }
     return xT;
 }
 
-arrayt<double> multiply(arrayt<double>& a, arrayt<double>& b){
+template <class T>
+void transposeInPlace(arrayt<T>& x)
+{
+    /*
+    Input: arrayt<T> square matrix x
+    Description:
+        Overwrites x with its transpose without allocating.
+        Bands of rows go to the threads, each transposes its diagonal block
+        and swaps the block right of it with the block below it
+    */
+    const int n = x.n1();
+    if (x.n2() != n){
+        cout << "transposeInPlace needs a square matrix" << endl;
+        //exit(EXIT_FAILURE); // uncomment if you'd like the program to stop
+        return;
+    }
+
+    T *px = x.data();
+    parallel_for(n, (PARALLEL_THRESHOLD/2)/n + 1, [=](int i0, int i1)
+    {
+        transpose_square(i1 - i0, px + (long) i0*n + i0, n);
+        transpose_swap(i1 - i0, n - i1, px + (long) i0*n + i1, px + (long) i1*n + i0, n);
+    });
+}
+
+template <class T>
+arrayt<T> multiply(arrayt<T>& a, arrayt<T>& b){
     
     /*  
     Inputs:
-        a: arrayt<double> vector (could be matrix)
-        b: arrayt<double> vector (could be matrix)
-    Output: arrayt<double> product of element-wise multiplication
+        a: arrayt<T> vector (could be matrix)
+        b: arrayt<T> vector (could be matrix)
+    Output: arrayt<T> product of element-wise multiplication
     Description:
         Returns the result of elementwise multiplication on two vectors 
         of the same dimensionality, will also work for 2 matrices of the same shape
@@ -120,131 +538,349 @@ arrayt<double> multiply(arrayt<double>& a, arrayt<double>& b){
         //exit(EXIT_FAILURE); // uncomment if you'd like the program to stop
     } 
 
-    arrayt<double> product(a_r, b_c);
-    
-    for(int i = 0; i < a_r; i++){
-        for(int j = 0; j < a_c; j++)
-        {
-            product(i,j) = a(i,j)*b(i,j);
-        }
-    }
+    arrayt<T> product(a_r, b_c);
+    const T *pa = a.data(), *pb = b.data();
+    T *pp = product.data();
+    parallel_elements(min(product.n(), min(a_s, b_s)), [=](int i0, int i1)
+    {
+        simd_mul(i1 - i0, pa + i0, pb + i0, pp + i0);
+    });
     
     return product;
 }
 
-arrayt<double> operator-(arrayt<double>& a, arrayt<double>& b)
+// ---------------- expression templates for '+', '-', scalar '*' ----------------
+//
+// The operators below don't compute anything, they return a small object
+// describing the expression. The work is done when the expression is assigned
+// to (or used to construct) an arrayt, in a single loop over the elements, so
+//     w0 = w0 - alpha*w0_grad;
+// makes no temporary arrays. See arrayt_expr in arrayt.hpp.
+
+// operands: arrays are held by reference, sub-expressions by value
+//   (they are temporaries that would be gone by the time we evaluate)
+template <class E> struct expr_operand { typedef const E type; };
+template <class T> struct expr_operand< arrayt<T> > { typedef const arrayt<T>& type; };
+
+struct expr_add { template <class T> static T apply(T a, T b) { return a + b; } };
+struct expr_sub { template <class T> static T apply(T a, T b) { return a - b; } };
+
+template <class L, class R, class Op>
+class expr_binary : public arrayt_expr< expr_binary<L, R, Op> >
+{
+    // element-wise a op b, takes its shape from a
+    typename expr_operand<L>::type a;
+    typename expr_operand<R>::type b;
+public:
+    typedef typename L::value_type value_type;
+    expr_binary(const L& a, const R& b) : a(a), b(b) {}
+    value_type operator[](const int i) const { return Op::apply(a[i], b[i]); }
+    int n1() const { return a.n1(); }
+    int n2() const { return a.n2(); }
+    int ndim() const { return a.ndim(); }
+    int n() const { return a.n(); }
+    const L& left() const { return a; }
+    const R& right() const { return b; }
+};
+
+template <class E>
+class expr_scaled : public arrayt_expr< expr_scaled<E> >
+{
+    // s*a for scalar s
+    typedef typename E::value_type T;
+    T s;
+    typename expr_operand<E>::type a;
+public:
+    typedef T value_type;
+    expr_scaled(const T s, const E& a) : s(s), a(a) {}
+    value_type operator[](const int i) const { return s*a[i]; }
+    int n1() const { return a.n1(); }
+    int n2() const { return a.n2(); }
+    int ndim() const { return a.ndim(); }
+    int n() const { return a.n(); }
+    T scalar() const { return s; }
+    const E& operand() const { return a; }
+};
+
+template <class L, class R>
+bool expr_same_shape(const arrayt_expr<L>& a, const arrayt_expr<R>& b)
+{
+    return a.self().n1() == b.self().n1() && a.self().n2() == b.self().n2();
+}
+
+template <class L, class R>
+expr_binary<L, R, expr_sub> operator-(const arrayt_expr<L>& a, const arrayt_expr<R>& b)
 { 
     /*  
     Inputs:
-        a: arrayt<double> vector (could be matrix)
-        b: arrayt<double> vector (could be matrix)
-    Output: arrayt<double> difference of element-wise subtraction
+        a: arrayt<T> vector (could be matrix) or expression
+        b: arrayt<T> vector (could be matrix) or expression
+    Output: expression for the element-wise difference
     Description:
         overload the c++ '-' operator. When using '-' on vectors or matrices, 
         returns the result of element-wise subtraction
     */
-    
-    const int a_s = a.n(), a_r = a.n1(), a_c = a.n2();
-    const int b_s = b.n(), b_r = b.n1(), b_c = b.n2();
-
-    if (a_r != b_r || a_c != b_c){
+    if (!expr_same_shape(a, b)){
         cout << "vectors must be the same size to subtract" << endl;
         //exit(EXIT_FAILURE); // uncomment if you'd like the program to stop
     } 
-
-    arrayt<double> difference(a_r, b_c);
-    
-    for(int i = 0; i < a_r; i++){
-        for(int j = 0; j < a_c; j++)
-        {
-            difference(i,j) = a(i,j)-b(i,j);
-        }
-    }
-    
-    return difference;
+    return expr_binary<L, R, expr_sub>(a.self(), b.self());
 }
 
-arrayt<double> operator+(arrayt<double>& a, arrayt<double>& b)
+template <class L, class R>
+expr_binary<L, R, expr_add> operator+(const arrayt_expr<L>& a, const arrayt_expr<R>& b)
 { 
     /*  
     Inputs:
-        a: arrayt<double> vector (could be matrix)
-        b: arrayt<double> vector (could be matrix)
-    Output: arrayt<double> difference of element-wise subtraction
+        a: arrayt<T> vector (could be matrix) or expression
+        b: arrayt<T> vector (could be matrix) or expression
+    Output: expression for the element-wise sum
     Description:
         overload the c++ '+' operator. When using '+' on vectors or matrices, 
         returns the result of element-wise addition
     */
-    
-    const int a_s = a.n(), a_r = a.n1(), a_c = a.n2();
-    const int b_s = b.n(), b_r = b.n1(), b_c = b.n2();
-
-    if (a_r != b_r || a_c != b_c){
+    if (!expr_same_shape(a, b)){
         cout << "vectors must be the same size to add" << endl;
         //exit(EXIT_FAILURE); // uncomment if you'd like the program to stop
     } 
-
-    arrayt<double> summed(a_r, b_c);
-    
-    for(int i = 0; i < a_r; i++){
-        for(int j = 0; j < a_c; j++)
-        {
-            summed(i,j) = a(i,j)+b(i,j);
-        }
-    }
-    
-    return summed;
+    return expr_binary<L, R, expr_add>(a.self(), b.self());
 }
 
-arrayt<double> operator*(double s, arrayt<double>& a)
+template <class E>
+expr_scaled<E> operator*(double s, const arrayt_expr<E>& a)
 { 
     /*  
     Inputs:
-        s: scalar double
-        a: arrayt<double> vector (could be matrix)
-    Output: arrayt<double> prod
+        s: scalar double (rounded to float for float arrays)
+        a: arrayt<T> vector (could be matrix) or expression
+    Output: expression for s*a
     Description:
         overload the c++ '*' operator to allow for scalar * matrix and
         scalar * vector multiplication
     */
-    
-    const int a_s = a.n(), a_r = a.n1(), a_c = a.n2();
+    return expr_scaled<E>(s, a.self());
+}
 
-    arrayt<double> prod(a_r, a_c);
-    
-    for(int i = 0; i < a_r; i++){
-        for(int j = 0; j < a_c; j++)
+// the simplest expressions map straight onto one SIMD kernel (simd.hpp),
+//   anything more complicated uses the fused loop; either way big arrays
+//   are split across the thread pool
+template <class T, class E>
+inline void eval_fused(T *p, const int n, const arrayt_expr<E>& e)
+{
+    const E& x = e.self();
+    parallel_elements(n, [=, &x](int i0, int i1)
+    {
+        for(int i = i0; i < i1; i++) p[i] = x[i];
+    });
+}
+
+template <class T>
+inline void eval_add(T *p, const int n, const arrayt<T>& a, const arrayt<T>& b)
+{
+    const T *pa = a.data(), *pb = b.data();
+    parallel_elements(n, [=](int i0, int i1) { simd_add(i1 - i0, pa + i0, pb + i0, p + i0); });
+}
+
+template <class T>
+inline void eval_sub(T *p, const int n, const arrayt<T>& a, const arrayt<T>& b)
+{
+    const T *pa = a.data(), *pb = b.data();
+    parallel_elements(n, [=](int i0, int i1) { simd_sub(i1 - i0, pa + i0, pb + i0, p + i0); });
+}
+
+template <class T>
+inline void eval_scale(T *p, const int n, const T s, const arrayt<T>& a)
+{
+    const T *pa = a.data();
+    parallel_elements(n, [=](int i0, int i1) { simd_scale(i1 - i0, s, pa + i0, p + i0); });
+}
+
+// arrayt.hpp calls arrayt_eval(p, n, expression), these overloads send
+//   double and float expressions to the kernels above
+typedef expr_binary< arrayt<double>, arrayt<double>, expr_add > expr_add_dd;
+typedef expr_binary< arrayt<double>, arrayt<double>, expr_sub > expr_sub_dd;
+typedef expr_binary< arrayt<float>, arrayt<float>, expr_add > expr_add_ff;
+typedef expr_binary< arrayt<float>, arrayt<float>, expr_sub > expr_sub_ff;
+
+template <class E>
+inline void arrayt_eval(double *p, const int n, const arrayt_expr<E>& e) { eval_fused(p, n, e); }
+template <class E>
+inline void arrayt_eval(float *p, const int n, const arrayt_expr<E>& e) { eval_fused(p, n, e); }
+
+inline void arrayt_eval(double *p, const int n, const arrayt_expr<expr_add_dd>& e)
+{ eval_add(p, n, e.self().left(), e.self().right()); }
+inline void arrayt_eval(float *p, const int n, const arrayt_expr<expr_add_ff>& e)
+{ eval_add(p, n, e.self().left(), e.self().right()); }
+
+inline void arrayt_eval(double *p, const int n, const arrayt_expr<expr_sub_dd>& e)
+{ eval_sub(p, n, e.self().left(), e.self().right()); }
+inline void arrayt_eval(float *p, const int n, const arrayt_expr<expr_sub_ff>& e)
+{ eval_sub(p, n, e.self().left(), e.self().right()); }
+
+inline void arrayt_eval(double *p, const int n, const arrayt_expr< expr_scaled< arrayt<double> > >& e)
+{ eval_scale(p, n, e.self().scalar(), e.self().operand()); }
+inline void arrayt_eval(float *p, const int n, const arrayt_expr< expr_scaled< arrayt<float> > >& e)
+{ eval_scale(p, n, e.self().scalar(), e.self().operand()); }
+
+template <class T, class F>
+void applyFunction(F function, arrayt_view<T> a, arrayt_view<T> f)
+{
+    /*  
+    Inputs:
+        function: anything callable as function(T), e.g. a functor from
+            activations.hpp, a lambda or a plain function
+        a: arrayt<T> vector (could be matrix), or a view
+        f: arrayt<T> output, same shape as a, may be a itself
+    Description:
+        f(i,j) = function(a(i,j)) with no allocation. function is a template
+        parameter so its call is inlined into the loop, which lets the compiler
+        vectorize simple (branch free) functions. It is taken by value (like the
+        standard algorithms) so its members, e.g. the leak of act_leaky_relu,
+        are local copies that the stores into f can't alias.
+        Big contiguous arrays are split across the thread pool.
+    */
+    if (a.n1() != f.n1() || a.n2() != f.n2()){
+        cout << "applyFunction output must be the same shape as the input" << endl;
+        return;
+    }
+    const T *pa = a.data();
+    T *pf = f.data();
+    if (a.s2() == 1 && f.s2() == 1 && a.s1() == a.n2() && f.s1() == f.n2())
+    {
+        // both contiguous, one flat loop (per thread for big arrays)
+        parallel_elements(a.n(), [=](int i0, int i1)
         {
-            prod(i,j) = s*a(i,j);
+            const F fn = function;  // local copy, see above
+            for(int i = i0; i < i1; i++) pf[i] = fn(pa[i]);
+        });
+        return;
+    }
+    for(int i = 0; i < a.n1(); i++){
+        for(int j = 0; j < a.n2(); j++)
+        {
+            pf[i*f.s1() + j*f.s2()] = function(pa[i*a.s1() + j*a.s2()]);
         }
     }
-    
-    return prod;
 }
 
-arrayt<double> applyFunction(double (*function)(double), arrayt<double> a)   
+// overloads taking arrayt or views (see gemm)
+template <class F>
+void applyFunction(F function, arrayt_view<double> a, arrayt_view<double> f)
+{ applyFunction<double, F>(function, a, f); }
+
+template <class F>
+void applyFunction(F function, arrayt_view<float> a, arrayt_view<float> f)
+{ applyFunction<float, F>(function, a, f); }
+
+template <class F>
+void applyFunctionInPlace(F function, arrayt_view<double> a)
+{
+    // a(i,j) = function(a(i,j)), no allocation
+    applyFunction<double, F>(function, a, a);
+}
+
+template <class F>
+void applyFunctionInPlace(F function, arrayt_view<float> a)
+{ applyFunction<float, F>(function, a, a); }
+
+template <class T, class F>
+arrayt<T> applyFunction(F function, const arrayt<T>& a)   
 {
     /*  
     Inputs:
-        a: arrayt<double> vector (could be matrix)
-    Output: arrayt<double> f, same shape as a
+        function: anything callable as function(T)
+        a: arrayt<T> vector (could be matrix)
+    Output: arrayt<T> f, same shape as a
     Description:
         The vector f is the result of applying a function element-wise to a
     */
-    const int a_s = a.n(), a_r = a.n1(), a_c = a.n2();
- 
-    arrayt<double> f(a_r, a_c);
-    for(int i = 0; i < a_r; i++){
-        for(int j = 0; j < a_c; j++)
-        {
-            f(i,j) = function(a(i,j));
-        }
-    }
+    const int a_s = a.n();
+    arrayt<T> f = (a.ndim() == 1) ? arrayt<T>(a.n1()) : arrayt<T>(a.n1(), a.n2());
+
+    const T *pa = a.data();
+    T *pf = f.data();
+    for(int i = 0; i < a_s; i++) pf[i] = function(pa[i]);
  
     return f;
 }
 
-void print(arrayt<double> m)
+template <class T, class S>
+void convert(const arrayt<S>& a, arrayt<T>& b)
+{
+    /*
+    Inputs:
+        a: arrayt<S> vector or matrix
+        b: arrayt<T> of the same size
+    Description:
+        b = a element by element, converting S to T (e.g. double to float),
+        without allocating
+    */
+    if (a.n() != b.n()){
+        cout << "convert needs arrays of the same size" << endl;
+        return;
+    }
+    const S *pa = a.data();
+    T *pb = b.data();
+    parallel_elements(a.n(), [=](int i0, int i1)
+    {
+        for(int i = i0; i < i1; i++) pb[i] = (T) pa[i];
+    });
+}
+
+template <class T, class S>
+arrayt<T> convert(const arrayt<S>& a)
+{
+    // a copy of a with elements of type T, e.g. convert<float>(x)
+    arrayt<T> b = (a.ndim() == 1) ? arrayt<T>(a.n1()) : arrayt<T>(a.n1(), a.n2());
+    convert(a, b);
+    return b;
+}
+
+template <class T, class S>
+void convert(arrayt_view<S> a, arrayt_view<T> b)
+{
+    // b = a element by element for views of the same shape (any strides,
+    //   e.g. of a mapped dataset or of part of an array), no allocation
+    const int n2 = a.n2();
+    if (a.n1() != b.n1() || n2 != b.n2()){
+        cout << "convert needs arrays of the same size" << endl;
+        return;
+    }
+    parallel_for(a.n1(), (PARALLEL_THRESHOLD/2)/(n2 > 0 ? n2 : 1) + 1, [=](int i0, int i1)
+    {
+        for(int i = i0; i < i1; i++)
+            for(int j = 0; j < n2; j++) b(i, j) = (T) a(i, j);
+    });
+}
+
+template <class T, class S>
+void gather_rows(arrayt_view<S> a, const int *rows, arrayt_view<T> b)
+{
+    // b(i,:) = a(rows[i],:) for each row i of b, converting S to T, so rows
+    //   visited in any order can go to gemm as one block, no allocation
+    const int n2 = a.n2();
+    if (n2 != b.n2()){
+        cout << "gather_rows needs arrays with the same number of columns" << endl;
+        return;
+    }
+    for(int i = 0; i < b.n1(); i++)
+    {
+        const int r = rows[i];
+        for(int j = 0; j < n2; j++) b(i, j) = (T) a(r, j);
+    }
+}
+
+template <class T, class S>
+arrayt<T> convert(arrayt_view<S> a)
+{
+    // a compact n1 x n2 copy of a view with elements of type T
+    arrayt<T> b(a.n1(), a.n2());
+    convert(a, arrayt_view<T>(b));
+    return b;
+}
+
+template <class T>
+void print(arrayt<T> m)
 {
     // Prints an arrayt matrix or vector
 
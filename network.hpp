@@ -0,0 +1,267 @@
+/*
+network.hpp
+
+A fully connected network of any depth, built from the list of its layer
+widths, that owns all of its memory:
+
+    network<double> net(widths, max_batch);     // e.g. widths {10, 32, 16, 1}
+    net.init(rand)                  // every weight from rand(), layer by
+                                    //   layer, row by row
+    net.forward(X)                  // X: up to max_batch examples, one per
+                                    //   row; returns the outputs, one row
+                                    //   per example
+    net.backward(X, y)              // after forward(X): the gradient of the
+                                    //   mean squared error over the rows
+    net.train_step(X, y)            // forward and backward (no backward if
+                                    //   forward fails, it returns an empty view)
+    net.sgd(alpha)                  // weights -= alpha*gradient
+
+    net.weights(l), net.grad(l)     // layer l, (width(l)+1) x width(l+1),
+                                    //   the last row multiplies the bias
+    net.params(), net.grads()       // all weights and all gradients, each
+                                    //   in one contiguous array
+
+Layer l takes the activations of layer l-1 (the input for l = 0) plus an
+implicit bias input. The hidden layers use leaky ReLU, the output layer is
+linear.
+
+Memory: the weights of every layer are in one array, layer after layer, and
+the gradients in another with the same layout, so an update is a single pass
+over two contiguous arrays and an optimizer can keep its state in arrays
+parallel to them. Each layer starts on a cache line. The pre-activations,
+activations and back propagated errors of every layer, for max_batch
+examples, are in a third array. All three are made by the constructor (or
+set_max_batch()); forward(), backward() and sgd() work on views of them
+through the kernels in matrix.hpp, so a training step allocates nothing,
+whatever the depth.
+
+With one example, or a batch of them, the results have the same bits as
+dense_forward() and backprop_batch() in nn.cpp on the same two layers.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef NETWORK
+#define NETWORK
+
+#include <iostream>
+#include <vector>
+#include "arrayt.hpp"
+#include "arrayt_view.hpp"
+#include "activations.hpp"
+#include "matrix.hpp"
+
+using namespace std;
+
+template <class T>
+class network
+{
+public:
+    network() : n_batch(0), n_rows(0), leak(0.5), bias(1) {}
+    network(const vector<int>& widths, const int max_batch = 1, const T leak = 0.5, const T bias = 1)
+        : n_batch(0), n_rows(0) { build(widths, max_batch, leak, bias); }
+
+    void build(const vector<int>& widths, const int max_batch = 1, const T leak = 0.5, const T bias = 1);
+    void set_max_batch(const int max_batch);
+
+    int layers() const { return (int) width_.size() - 1; }     // weight layers
+    int width(const int i) const { return width_[i]; }          // 0 is the input
+    int max_batch() const { return n_batch; }
+    long n_params() const { return w.n(); }
+
+    arrayt_view<T> weights(const int l) { return layer_view(w, l); }
+    arrayt_view<T> grad(const int l) { return layer_view(g, l); }
+    arrayt<T>& params() { return w; }
+    arrayt<T>& grads() { return g; }
+
+    template <class F> void init(F rand);
+
+    arrayt_view<T> forward(arrayt_view<T> X);
+    void backward(arrayt_view<T> X, arrayt_view<double> y, const int n_mean = 0);
+    arrayt_view<T> train_step(arrayt_view<T> X, arrayt_view<double> y, const int n_mean = 0)
+    {
+        // the outputs, an empty view (and no gradient) if forward() failed
+        arrayt_view<T> out = forward(X);
+        if (out.n1() == X.n1()) backward(X, y, n_mean);
+        return out;
+    }
+    void sgd(const T alpha);
+
+private:
+    vector<int> width_;
+    vector<long> w_off;     // start of each layer in w and g
+    vector<long> b_off;     // start of each layer's buffers in buf
+    int n_batch;            // rows of the buffers
+    int n_rows;             // rows of the last forward()
+    T leak, bias;
+    arrayt<T> w, g;         // weights and gradients
+    arrayt<T> buf;          // per layer: pre-activations, activations, errors
+
+    static long line_up(const long n)
+    {
+        // n rounded up to a whole number of cache lines of T
+        const long k = 64/sizeof(T);
+        return (n + k - 1)/k*k;
+    }
+    arrayt_view<T> layer_view(arrayt<T>& a, const int l)
+    {
+        return arrayt_view<T>(a.data() + w_off[l], width_[l]+1, width_[l+1], width_[l+1], 1);
+    }
+    arrayt_view<T> buffer(const int l, const int k, const int n)
+    {
+        // buffer k (0 pre-activations, 1 activations, 2 errors) of layer l, n rows
+        const int m = width_[l+1];
+        return arrayt_view<T>(buf.data() + b_off[l] + k*line_up((long) n_batch*m), n, m, m, 1);
+    }
+};
+
+template <class T>
+void network<T>::build(const vector<int>& widths, const int max_batch, const T leak_, const T bias_)
+{
+    /*
+    Inputs:
+        widths: input size, the width of each hidden layer, output size
+            (at least two entries)
+        max_batch: the most examples forward() will get at once
+        leak_: slope of the hidden layers' leaky ReLU for z < 0
+        bias_: value of every layer's implicit bias input
+    */
+    if (widths.size() < 2){
+        cout << "network needs at least an input and an output width" << endl;
+        return;
+    }
+    width_ = widths;
+    leak = leak_;
+    bias = bias_;
+    w_off.resize(layers());
+    long n = 0;
+    for(int l=0; l < layers(); l++)
+    {
+        w_off[l] = n;
+        n += line_up((long) (width_[l]+1)*width_[l+1]);
+    }
+    w.resize(n);
+    g.resize(n);
+    for(long i=0; i < n; i++) w.data()[i] = g.data()[i] = 0;
+    set_max_batch(max_batch);
+}
+
+template <class T>
+void network<T>::set_max_batch(const int max_batch)
+{
+    // buffers for max_batch examples (made here, not while training)
+    n_batch = (max_batch < 1) ? 1 : max_batch;
+    n_rows = 0;
+    b_off.resize(layers());
+    long n = 0;
+    for(int l=0; l < layers(); l++)
+    {
+        b_off[l] = n;
+        n += 3*line_up((long) n_batch*width_[l+1]);
+    }
+    buf.resize(n);
+}
+
+template <class T>
+template <class F>
+void network<T>::init(F rand)
+{
+    for(int l=0; l < layers(); l++)
+    {
+        arrayt_view<T> W = weights(l);
+        for(int i=0; i < W.n1(); i++)
+            for(int j=0; j < W.n2(); j++) W(i,j) = (T) rand();
+    }
+}
+
+template <class T>
+arrayt_view<T> network<T>::forward(arrayt_view<T> X)
+{
+    /*
+    Inputs:
+        X: n x width(0), n <= max_batch, one example per row (e.g. view_rows
+            of the data)
+    Output:
+        n x width(layers()), the outputs (a view of the network's buffer,
+        good until the next forward()), or an empty view if X doesn't fit
+    Description:
+        Layer by layer with dense_forward_batch(), each layer's
+        pre-activations and activations kept for backward().
+    */
+    const int n = X.n1(), L = layers();
+    if (L < 1){
+        cout << "network::forward on a network with no layers (build() it first)" << endl;
+        return arrayt_view<T>();
+    }
+    if (n > n_batch || X.n2() != width_[0]){
+        cout << "network::forward got " << n << " x " << X.n2() << " for at most "
+            << n_batch << " x " << width_[0] << endl;
+        n_rows = 0;     // backward() needs a forward() that worked
+        return arrayt_view<T>();
+    }
+    n_rows = n;
+    const act_leaky_relu hidden_act(leak);
+    arrayt_view<T> in = X;
+    for(int l=0; l < L-1; l++)
+    {
+        dense_forward_batch(weights(l), in, bias, hidden_act, buffer(l, 1, n), buffer(l, 0, n));
+        in = buffer(l, 1, n);
+    }
+    arrayt_view<T> out = buffer(L-1, 1, n);
+    dense_forward_batch(weights(L-1), in, bias, act_identity(), out, out);
+    return out;
+}
+
+template <class T>
+void network<T>::backward(arrayt_view<T> X, arrayt_view<double> y, const int n_mean)
+{
+    /*
+    Inputs:
+        X: the examples of the last forward()
+        y: their targets, n x width(layers())
+        n_mean: if > 0, the gradient is the sum over the rows divided by
+            n_mean instead of n (for a slice of a larger batch)
+    Description:
+        grads() receives the gradient of the mean of the squared errors
+        (over 2, so the error at the output is just pred - y), layer by
+        layer from the output with dense_backward(): each layer's error
+        goes back through its weights and the derivative of the
+        activation of the layer before.
+    */
+    const int n = n_rows, L = layers(), m = (L < 1) ? 0 : width_[L];
+    if (L < 1 || X.n1() != n || y.n1() != n || y.n2() != m){
+        cout << "network::backward needs the examples of the last forward() and their targets" << endl;
+        return;
+    }
+    const T mean_n = (T) ((n_mean > 0) ? n_mean : n);
+    const act_leaky_relu_deriv hidden_deriv(leak);
+
+    arrayt_view<T> out = buffer(L-1, 1, n), D = buffer(L-1, 2, n);
+    for(int i=0; i < n; i++)
+        for(int j=0; j < m; j++) D(i,j) = (out(i,j) - (T) y(i,j)) / mean_n;
+
+    for(int l=L-1; l >= 0; l--)
+    {
+        arrayt_view<T> in = (l > 0) ? buffer(l-1, 1, n) : X;
+        arrayt_view<T> D_in = (l > 0) ? buffer(l-1, 2, n) : arrayt_view<T>();
+        dense_backward(weights(l), in, bias, buffer(l, 2, n), grad(l), D_in);
+        if (l > 0){
+            arrayt_view<T> pre = buffer(l-1, 0, n);
+            for(int i=0; i < n; i++)
+                for(int j=0; j < D_in.n2(); j++) D_in(i,j) *= hidden_deriv(pre(i,j));
+        }
+    }
+}
+
+template <class T>
+void network<T>::sgd(const T alpha)
+{
+    // one pass over the weights and gradients (the padding between layers
+    //   is zero in both)
+    T *pw = w.data();
+    const T *pg = g.data();
+    for(int i=0; i < w.n(); i++) pw[i] -= alpha*pg[i];
+}
+
+#endif
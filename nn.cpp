@@ -5,6 +5,8 @@ Neural Network coded from scratch
 Predict redshift from SDSS data
 
 Run on Windows 10 in Visual Studio Code
+Needs C++17 (csv.hpp, dataset.hpp), e.g.
+    g++ -std=c++17 -O2 -pthread -o nn nn.cpp
 AEP 4380 Final Project 
 Author: Collin Farquhar
 */
@@ -17,6 +19,23 @@ Author: Collin Farquhar
 #include <string>
 #include <ctime>
 #include "matrix.hpp"
+#include "network.hpp" // layers of any depth, with all their buffers
+#include "optimizer.hpp" // fused update rules: momentum, RMSProp, Adam, AdamW
+#include "csv.hpp" // fast loader for the data files
+#include "dataset.hpp" // binary datasets, mapped without parsing
+#include "csv_cache.hpp" // csv files parsed once, then mapped
+#include "data_stream.hpp" // chunks of the data read in the background
+#include "feature_stats.hpp" // column means and variances, standardization
+#include "shuffle.hpp" // random orders of the rows for each epoch
+#include "hogwild.hpp" // lock-free updates of shared weights from several threads
+#include "allreduce.hpp" // gradients summed in a fixed order
+#include "param_server.hpp" // worker processes around a parameter server
+#ifdef PARAM_SERVER_POSIX
+#include <sys/wait.h>
+#include <csignal>
+#endif
+#include <atomic>
+#include <chrono>
 #include <vector> // STD vector class
 
 #define ARRAYT_BOUNDS_CHECK
@@ -27,11 +46,22 @@ typedef arrayt<double> mdoub;
 double leak = 0.5, alpha = 0.001, threshold = 1e-8;
 const int n_input = 10, n_hidden_layers = 1, n_hidden_nodes = 5, n_out_nodes = 1;
 
+// mixed precision: forward and backward prop in float on float copies of the
+// data and weights, while w0, w1 and their updates stay double
+// (set the environment variable NN_PRECISION=mixed to turn it on)
+bool mixed_precision = false;
+
 // Declare weights and initialize biases globally for convience
 mdoub w0(n_input+1, n_hidden_nodes); // +1 for bias
 mdoub w1(n_hidden_nodes+1, n_out_nodes);
 double b0 = 1.0, b1= 1.0; // biases
 
+// the network the main loop trains, with n_hidden_layers of n_hidden_nodes or
+// the hidden widths in NN_LAYERS (see main()); the modes that train w0 and w1
+// themselves (mixed precision, NN_SYNC, NN_HOGWILD, NN_PS) copy them into it
+// for eval_performance()
+network<double> net;
+
 // keep track of MSE as the network trains
 vector<double> mse_tracker;
 
@@ -39,7 +69,25 @@ vector<double> mse_tracker;
 vector<double> predictions;
 vector<double> actual;
 
-void prepocess(mdoub& xTr, mdoub& yTr, mdoub& xTe, mdoub& yTe)
+// standardize the features with their mean and standard deviation, gathered
+// while the data is read (set the environment variable NN_NORMALIZE=1 to turn
+// it on); the statistics are saved to norm_file with the model, so new
+// examples can be standardized the same way
+bool normalize = false;
+const char *norm_file = "norm_stats.txt";
+
+// statistics of the training features and labels, from the loader
+feature_stats x_stats, y_stats;
+
+// the training data: xTr and yTr in main() are views either straight into the
+// mapped binary dataset prep.nnd (no parsing or copying, see dataset.hpp and
+// make_dataset.cpp) or, without one, of the csv files, parsed on the first run
+// and mapped from their caches x_prep.txt.nnd, y_prep.txt.nnd after that
+// (see csv_cache.hpp)
+dataset prep_data;
+cached_csv<double> x_csv, y_csv;
+
+void prepocess(arrayt_view<double>& xTr, arrayt_view<double>& yTr, mdoub& xTe, mdoub& yTe)
 {
     /*
     Inputs:
@@ -48,54 +96,81 @@ void prepocess(mdoub& xTr, mdoub& yTr, mdoub& xTe, mdoub& yTe)
         xTe: Testing data
         yTe: Testing labels
     Desciption:
-        Reads in csv file of training data, modifies xTr as matrix of data
-        Reads in csv file of labels, modifies yTr as array of labels
-
-    Note: Inputs should already be the shape of the respective csv file
+        Maps prep.nnd if there is one, xTr is its features and yTr its
+        first target, both sized from the file
+        Otherwise reads in csv file of training data into x_csv, and csv
+        file of labels into y_csv (see csv.hpp), or maps their caches if
+        the files haven't changed, xTr and yTr view them
+        Fills x_stats and y_stats (from the tag of prep.nnd or the csv
+        loader, without another pass over the data if they are there) and
+        standardizes xTr in place if normalize is set (the mapped files
+        are copy on write, so they are not changed)
+        Stops the program if the data can't be read
     */
-
-    // xTr
-    ifstream infile( "x_prep.txt" );
-
-    int count = 0, max = xTr.n1();
-    while (infile)
+    if (file_exists("prep.nnd"))
     {
-        string s;
-        if (!getline( infile, s )) break;
-        if (count == -1) continue;
-
-        istringstream ss( s );
-
-        int idx = 0;
-        while (ss)
-        {
-            string s;
-            if (!getline( ss, s, ',' )) break;
-            //cout << s << endl;
-            xTr(count, idx) = stod(s); // stod -> string to double
-            idx += 1;
+        const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (!prep_data.open("prep.nnd")) exit(EXIT_FAILURE);
+        if (prep_data.targets() < 1 || prep_data.dtype() != DATASET_FLOAT64){
+            cout << "prep.nnd needs double values and a target column" << endl;
+            exit(EXIT_FAILURE);
+        }
+        xTr = prep_data.x<double>();
+        yTr = view_col(prep_data.y<double>(), 0);
+
+        // statistics stored by make_dataset, or computed here for older files
+        feature_stats all;
+        if (all.parse(prep_data.tag()) && all.cols() == prep_data.features() + prep_data.targets()){
+            x_stats = all.columns(0, xTr.n2());
+            y_stats = all.columns(xTr.n2(), 1);
         }
-        count += 1;
-        if (count == max) break;
+        else{
+            x_stats = compute_feature_stats(xTr);
+            y_stats = compute_feature_stats(yTr);
+        }
+        cout << "prep.nnd: " << prep_data.rows() << " x " << prep_data.features()
+            << ", mapped in " << chrono::duration<double>(chrono::steady_clock::now() - t0).count()
+            << " s" << endl;
     }
-    infile.close();
-
-
-    // yTr
-    ifstream yfile( "y_prep.txt" );
-
-    count = 0, max = yTr.n1();
-    while (yfile)
+    else
     {
-        string s;
-        if (!getline( yfile, s )) break;
+        // xTr
+        if (!x_csv.open("x_prep.txt")) exit(EXIT_FAILURE);
+        print_cached_csv_stats("x_prep.txt", x_csv);
+
+        // yTr
+        if (!y_csv.open("y_prep.txt")) exit(EXIT_FAILURE);
+        print_cached_csv_stats("y_prep.txt", y_csv);
+
+        xTr = x_csv.view();
+        yTr = y_csv.view();
+        x_stats = x_csv.col_stats();
+        y_stats = y_csv.col_stats();
+    }
 
-        yTr(count) = stod(s); // stod -> string to double
+    if (xTr.n2() != n_input){
+        cout << "the data has " << xTr.n2() << " features, the network takes "
+            << n_input << " inputs" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (yTr.n1() != xTr.n1()){
+        cout << "the data has " << xTr.n1() << " examples but " << yTr.n1() << " labels" << endl;
+        exit(EXIT_FAILURE);
+    }
 
-        count += 1;
-        if (count == max) break;
+    if (normalize){
+        const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        standardize(xTr, x_stats);
+        cout << "standardized the features in "
+            << chrono::duration<double>(chrono::steady_clock::now() - t0).count() << " s" << endl;
     }
-    yfile.close();
+}
+
+bool open_stream(data_stream<double>& stream, const long chunk_rows)
+{
+    // prep.nnd if there is one, otherwise the csv files, in chunks of chunk_rows
+    return file_exists("prep.nnd") ? stream.open("prep.nnd", chunk_rows)
+        : stream.open("x_prep.txt", "y_prep.txt", chunk_rows);
 }
 
 inline double myrand(unsigned int &iseed)
@@ -137,20 +212,10 @@ double leaky_ReLU_deriv(double z)
     }
 }
 
-/*
-double sigmoid(double z)
-{
-    // final layer activation
-    return(1/(1+exp(-z)));
-}
-
-double sigmoid_deriv(double z)
-{
-    return(sigmoid(z)*(1-sigmoid(z)));
-}
-*/
+// the training loop uses the inlineable versions of these from activations.hpp,
+// act_leaky_relu(leak) and act_leaky_relu_deriv(leak); sigmoid, tanh etc. are there too
 
-mdoub add_bias(mdoub a, double bias)
+mdoub add_bias(arrayt_view<double> a, double bias)
 {
     if (a.n2() != 1) cout << "you should only add bias to a vector" << endl;
 
@@ -164,20 +229,17 @@ mdoub add_bias(mdoub a, double bias)
     return ab;
 }
 
-mdoub forward_prop(mdoub input, double (*layer_f)(double))
+mdoub forward_prop(arrayt_view<double> input, double (*layer_f)(double))
 {
-    mdoub inputb = add_bias(input, b0);
-    // H is vector of hidden layer activations of weighted input sums
-    mdoub w0T = transpose(w0);
-    mdoub H = applyFunction(layer_f, dot(w0T, inputb));
-
-    // add bias to hidden layer
-    mdoub Hb = add_bias(H, b1);
+    // H is vector of hidden layer activations of weighted input sums,
+    // H = layer_f(w0^T [input; b0]), bias added implicitly
+    mdoub H(n_hidden_nodes, 1);
+    dense_forward(w0, input, b0, layer_f, H);
 
-    cout << "H = " << Hb.n1() << " x " << Hb.n2() << endl;
+    cout << "H = " << H.n1() << " x " << H.n2() << endl;
     cout << "w1 = " << w1.n1() << " x " << w1.n2() << endl;
-    mdoub w1T = transpose(w1);
-    mdoub Y = dot(w1T, Hb);
+    mdoub Y(n_out_nodes, 1);
+    dense_forward(w1, H, b1, act_identity(), Y); // w1^T [H; b1]
     return Y;
 }
 
@@ -272,65 +334,572 @@ void weight_writer(mdoub w0, mdoub w1)
     w.close();
 }
 
-void eval_performance(mdoub& xTr, mdoub& yTr)
+void net_from_w()
 {
-    // get the last 100 points
+    // w0 and w1 into the two layers of net
+    convert(arrayt_view<double>(w0), net.weights(0));
+    convert(arrayt_view<double>(w1), net.weights(1));
+}
+
+void print_weights()
+{
+    for(int l=0; l < net.layers(); l++) print(convert<double>(net.weights(l)));
+}
+
+bool stop(mdoub& grad, const double scale)
+{
+    // stop() on one array of gradients (all of net's at once), times scale
+    double max = 0.0;
+    for (int i=0; i < grad.n(); i++)
+    {
+        const double g = scale*grad.data()[i];
+        if (g > max) max = g;
+        if (isinf(g)) cout << "infinity in the gradient" << endl;
+    }
+    return max < threshold;
+}
+
+template <class T>
+double backprop(arrayt<T>& w0c, arrayt<T>& w1c, arrayt_view<T> example, double ex_y,
+    arrayt<T>& in_h, arrayt<T>& H, arrayt<T>& Y, mdoub& w0_grad, mdoub& w1_grad)
+{
+    /*
+    Inputs:
+        w0c, w1c: the weights in precision T (w0 and w1 themselves for double,
+            float copies of them for mixed precision)
+        example: input, ex_y: label
+        in_h, H, Y: layer buffers, written in place
+        w0_grad, w1_grad: receive the gradients (not yet times alpha)
+    Output:
+        prediction of the network
+    Description:
+        One example forward and back through the network, all in T
+    */
+    const act_leaky_relu hidden_act(leak);
+    const act_leaky_relu_deriv hidden_deriv(leak);
+
+    // ------------------   forward prop    -----------------------------
+
+    // compute propogation of inputs to hidden layer, in_h = w0^T [example; b0],
+    // and H, the vector of hidden layer activations of weighted input sums,
+    // in one fused pass over w0 (the bias input b0 is implicit)
+    dense_forward(w0c, example, (T) b0, hidden_act, H, in_h);
+
+    // computer propogation from hiddern layer to output, w1^T [H; b1]
+    dense_forward(w1c, H, (T) b1, act_identity(), Y);
+    const T pred = Y(0); // just one output node
+
+    // ------------------    backprop    -----------------------------
+
+    // calculate error of the predicition
+    const T delta = pred - (T) ex_y;
+
+    // gradient for w1 is delta*[H; b1]
+    for(int i=0; i < n_hidden_nodes; i++) w1_grad(i,0) = delta*H(i,0);
+    w1_grad(n_hidden_nodes,0) = delta*(T) b1;
+
+    // gradient for w0 is [example; b0] times the error at hidden node j,
+    // delta*w1(j)*leaky_ReLU_deriv(in_h(j))
+    for(int i=0; i < w0_grad.n1(); i++)
+    {
+        for(int j=0; j < w0_grad.n2();j++)
+        {
+            const T input_i = (i < n_input) ? example(i) : (T) b0; // [example; b0]
+            const T delta_j = delta*w1c(j,0)*hidden_deriv(in_h(j));
+            w0_grad(i,j) = delta_j * input_i;
+        }
+    }
+    return pred;
+}
+
+template <class T>
+struct batch_buffers
+{
+    // layer buffers for up to n examples at a time (one per row), made once
+    arrayt<T> in_h, H, Y;       // pre-activations, activations, predictions
+    arrayt<T> D1, D2;           // error at the hidden and output nodes
+    arrayt<T> w0_grad, w1_grad; // gradients in precision T
+    arrayt<T> X;                // rows of a shuffled batch, gathered
+    arrayt<double> y;           //   with their labels
+
+    void resize(const int n)
+    {
+        in_h.resize(n, n_hidden_nodes);
+        H.resize(n, n_hidden_nodes);
+        Y.resize(n, n_out_nodes);
+        D1.resize(n, n_hidden_nodes);
+        D2.resize(n, n_out_nodes);
+        w0_grad.resize(n_input+1, n_hidden_nodes);
+        w1_grad.resize(n_hidden_nodes+1, n_out_nodes);
+        X.resize(n, n_input);
+        y.resize(n, 1);
+    }
+};
+
+template <class T>
+void backprop_batch(arrayt<T>& w0c, arrayt<T>& w1c, arrayt_view<T> X, arrayt_view<double> y,
+    batch_buffers<T>& b, arrayt<T>& w0_grad, arrayt<T>& w1_grad, const int n_mean = 0)
+{
+    /*
+    Inputs:
+        w0c, w1c: the weights in precision T
+        X: a batch of examples, one per row (a view of rows of the data),
+            y: their labels
+        b: buffers for at least X.n1() examples, the predictions are left
+            in the first X.n1() rows of b.Y
+        w0_grad, w1_grad: receive the mean gradient over the batch (not
+            yet times alpha)
+        n_mean: if > 0, the gradient is the sum over the rows divided by
+            n_mean instead of X.n1() (for a slice of a larger batch)
+    Description:
+        backprop() for all the rows of X at once, so each layer forward
+        and back is a gemm (matrix times matrix) instead of a matrix times
+        a vector per example. Nothing is allocated.
+    */
+    const int n = X.n1();
+    const T mean_n = (T) ((n_mean > 0) ? n_mean : n);
+    const act_leaky_relu hidden_act(leak);
+    const act_leaky_relu_deriv hidden_deriv(leak);
+    arrayt_view<T> in_h = view_rows(b.in_h, 0, n), H = view_rows(b.H, 0, n);
+    arrayt_view<T> Y = view_rows(b.Y, 0, n);
+    arrayt_view<T> D1 = view_rows(b.D1, 0, n), D2 = view_rows(b.D2, 0, n);
+
+    // ------------------   forward prop    -----------------------------
+
+    // in_h = [X, b0] w0 and H = leaky_ReLU(in_h), then Y = [H, b1] w1
+    dense_forward_batch(w0c, X, (T) b0, hidden_act, H, in_h);
+    dense_forward_batch(w1c, H, (T) b1, act_identity(), Y, Y);
+
+    // ------------------    backprop    -----------------------------
+
+    // error of each prediction, over n for the mean gradient
+    for(int i=0; i < n; i++) D2(i,0) = (Y(i,0) - (T) y(i)) / mean_n;
+
+    // gradient for w1 is [H, b1]^T D2, and D2 w1^T is the error at the
+    // hidden nodes before the derivative of the activation
+    dense_backward(w1c, H, (T) b1, D2, w1_grad, D1);
+    for(int i=0; i < n; i++)
+        for(int j=0; j < n_hidden_nodes; j++) D1(i,j) *= hidden_deriv(in_h(i,j));
+
+    // gradient for w0 is [X, b0]^T D1
+    dense_backward(w0c, X, (T) b0, D1, w0_grad, arrayt_view<T>());
+}
+
+template <class T>
+struct sync_buffers
+{
+    // a mini-batch cut into slices of a fixed number of rows, each with
+    //   its own batch_buffers (and so its own gradients), made once
+    int slice;
+    vector< batch_buffers<T> > part;
+
+    void resize(const int batch, const int slice_rows)
+    {
+        slice = slice_rows;
+        part.resize((batch + slice - 1)/slice);
+        for(size_t k=0; k < part.size(); k++) part[k].resize(slice);
+    }
+
+    // prediction for example i of the last batch
+    T pred(const int i) { return part[i/slice].Y(i % slice, 0); }
+};
+
+template <class T>
+void backprop_sync(arrayt<T>& w0c, arrayt<T>& w1c, arrayt_view<T> x, arrayt_view<double> y,
+    const int *rows, const int r, const int nb, sync_buffers<T>& s)
+{
+    /*
+    Inputs:
+        w0c, w1c: the weights in precision T
+        x, y: the chunk of data and its labels
+        rows: order of the rows of the chunk, or NULL for file order
+        r, nb: the batch is examples r to r+nb-1 in that order
+        s: slice buffers for at least nb examples, the mean gradient over
+            the batch is left in s.part[0].w0_grad and s.part[0].w1_grad
+    Description:
+        Synchronous data parallel backprop_batch(): the slices of the batch
+        go to the thread pool, each thread gathers its slice's rows and
+        computes its gradient into the slice's own buffers, then the
+        slices' gradients are summed with tree_reduce(). The slices and the
+        order of the sum depend only on nb and s.slice, never on the number
+        of threads, so neither does a single bit of the gradient.
+    */
+    const int n_parts = (nb + s.slice - 1)/s.slice;
+    parallel_for(n_parts, 1, [&](const int k0, const int k1)
+    {
+        for(int k=k0; k < k1; k++)
+        {
+            batch_buffers<T>& b = s.part[k];
+            const int i0 = r + k*s.slice, n = min(s.slice, r + nb - i0);
+            arrayt_view<T> X = view_rows(x, i0, n);
+            arrayt_view<double> Yk = view_rows(y, i0, n);
+            if (rows != NULL){
+                X = view_rows(b.X, 0, n);
+                Yk = view_rows(b.y, 0, n);
+                gather_rows(x, rows + i0, X);
+                gather_rows(y, rows + i0, Yk);
+            }
+            backprop_batch(w0c, w1c, X, Yk, b, b.w0_grad, b.w1_grad, nb);
+        }
+    });
+
+    // serial unless the gradients are big enough to be worth spreading
+    const int grain = PARALLEL_THRESHOLD/(s.part[0].w0_grad.n() + s.part[0].w1_grad.n()) + 1;
+    tree_reduce(n_parts, grain, [&](const int i, const int j)
+    {
+        add_into(s.part[i].w0_grad, s.part[j].w0_grad);
+        add_into(s.part[i].w1_grad, s.part[j].w1_grad);
+    });
+}
+
+double eval_performance(arrayt_view<double> xTr, arrayt_view<double> yTr, const bool quiet = false)
+{
+    // prints (unless quiet) and returns the validation mse
+    // get the last 100 points (or all of them, if there are fewer)
     const int last = xTr.n1()-1;
-    const int n_ex = 100;
+    const int n_ex = min(100, xTr.n1());
+    if (n_ex == 0) return 0;
     //vector<double> valid_mse;
     //vector<double> benchmark;
     double valid_sum = 0;
     double benchmark_sum = 0; 
-    const double avg_redshift = 0.35960330678661007; // computed in python
+    const double avg_redshift = y_stats[0].mean; // mean label, from the loader
 
     for (int i=last; i > (last-n_ex) ; i--)
     {
-        // get x example
-        mdoub example(xTr.n2(),1);
-        for (int j=0; j < example.n1(); j++){
-            example(j) = xTr(i,j);
-        }
+        // get x example, row i of xTr as a batch of one (no copy)
+        arrayt_view<double> example = view_rows(xTr, i, 1);
 
         // get y example
         double ex_y = yTr(i);
 
         // ----------------     foward prop         ---------------------
-        // add bias to example for input into the network
-            mdoub inputb = add_bias(example, b0); 
+            // through every layer of net, into its own buffers
+            double pred = net.forward(example)(0,0); // just one output node
+
+            // compute mse
+            valid_sum += mse(pred, ex_y);
+            benchmark_sum += mse(avg_redshift, ex_y);
+    }
+    if (!quiet){
+        cout << "validation mse = " << valid_sum/n_ex << endl;
+        cout << "benchmark mse = " << benchmark_sum/n_ex << endl;
+    }
+    return valid_sum/n_ex;
+}
+
+struct alignas(64) hogwild_thread
+{
+    // what one Hogwild thread keeps to itself, a cache line apart from the
+    //   next thread's so their writes don't contend
+    vector<double> mse;     // of each of its examples
+};
+
+double train_hogwild(arrayt_view<double> xTr, arrayt_view<double> yTr, const int n_threads,
+    const int epochs, const int shuffle, const unsigned int seed, long& examples)
+{
+    /*
+    Inputs:
+        xTr, yTr: the data, in memory
+        n_threads: number of threads, thread t trains on shard t of the rows
+        epochs, shuffle: as in main(), each thread shuffles its own shard
+        seed: thread t shuffles with seed + t
+        examples: receives the number of examples trained on
+    Output:
+        seconds taken
+    Description:
+        Hogwild training (see hogwild.hpp): every thread runs per example
+        SGD on its shard, reading w0 and w1 into its own copies and
+        subtracting its gradients from them without locks. The threads'
+        layer buffers, gradients and arenas are their own, nothing is
+        allocated from the heap after the first step. The mse of every
+        example goes to mse_tracker, thread after thread. All threads stop
+        when one of them meets the stopping condition.
+    */
+    const int n = xTr.n1();
+    vector<hogwild_thread> state(n_threads);
+    atomic<bool> stopped(false);
+    const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+    hogwild_run(n_threads, [&](const int t)
+    {
+        int begin, end;
+        hogwild_shard(n, t, n_threads, begin, end);
+        mdoub w0c(w0.n1(), w0.n2()), w1c(w1.n1(), w1.n2());
+        mdoub w0_grad(w0.n1(), w0.n2()), w1_grad(w1.n1(), w1.n2());
+        mdoub in_h(n_hidden_nodes, 1), H(n_hidden_nodes, 1), Y(n_out_nodes, 1);
+        arrayt_arena step_arena;
+        shuffle_rng rng(seed + t);
+        vector<int> order;
+        vector<double>& mse_t = state[t].mse;
+        mse_t.reserve((long) (end - begin)*epochs);
+
+        for(int epoch=0; epoch < epochs; epoch++)
+        {
+            if (shuffle > 0) shuffle_rows(order, end - begin, shuffle, rng);
+            for(int r=0; r < end - begin; r++)
+            {
+                if (stopped.load(memory_order_relaxed)) return;
+                step_arena.reset();
+                arrayt_use_allocator use_arena(step_arena);
+
+                const int row = begin + ((shuffle > 0) ? order[r] : r);
+                const double ex_y = yTr(row);
+                hogwild_load(w0, w0c);
+                hogwild_load(w1, w1c);
+                const double pred = backprop(w0c, w1c, view_row(xTr, row), ex_y, in_h, H, Y, w0_grad, w1_grad);
+                hogwild_sub(w1, alpha, w1_grad);
+                hogwild_sub(w0, alpha, w0_grad);
+                mse_t.push_back(mse(pred, ex_y));
+
+                if (stop(w0_grad, alpha) && stop(w1_grad, alpha)){
+                    stopped = true;
+                    return;
+                }
+            }
+        }
+    });
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
 
-            // compute propogation of inputs to hidden layer
-            mdoub w0T = transpose(w0);
-            mdoub in_h = dot(w0T, inputb);
+    examples = 0;
+    for(int t=0; t < n_threads; t++)
+    {
+        mse_tracker.insert(mse_tracker.end(), state[t].mse.begin(), state[t].mse.end());
+        examples += state[t].mse.size();
+    }
+    if (stopped) cout << "stopped after " << examples << " examples" << endl;
+    return seconds;
+}
 
-            // H is vector of hidden layer activations of weighted input sums
-            mdoub H = applyFunction(leaky_ReLU, in_h);
+#ifdef PARAM_SERVER_POSIX
+void train_ps_worker(arrayt_view<double> xTr, arrayt_view<double> yTr, const int id, const int n_workers,
+    const int epochs, const int shuffle, const unsigned int seed, const int batch,
+    const char *shm_name, const char *sock_path)
+{
+    /*
+    Inputs:
+        xTr, yTr: all of the data (mapped, the pages are shared with the
+            other processes), the worker trains on shard id of n_workers
+        epochs, shuffle, batch: as in main(), the shard is shuffled with
+            seed + id
+        shm_name, sock_path: the parameter server's segment and socket
+    Description:
+        Runs in a worker process (see train_ps()) and ends it. Every step
+        the gradient of batch examples goes to the worker's slot in the
+        segment, the server is told and the new weights are read back
+        once it says to go on. The mse of each example is written to the
+        segment, at its place in the epoch.
+    */
+    ps_segment seg;
+    const int fd = seg.attach(shm_name) ? ps_connect(sock_path) : -1;
+    ps_message msg = { PS_HELLO, id, 0, 0.0, 0 };
+    if (fd < 0 || !ps_send(fd, msg)) _exit(EXIT_FAILURE);
+
+    const int n = xTr.n1(), n_w0 = w0.n(), n_w1 = w1.n();
+    int begin, end;
+    hogwild_shard(n, id, n_workers, begin, end);
+    mdoub w0c(w0.n1(), w0.n2()), w1c(w1.n1(), w1.n2());
+    mdoub w0_grad(w0.n1(), w0.n2()), w1_grad(w1.n1(), w1.n2());
+    mdoub in_h(n_hidden_nodes, 1), H(n_hidden_nodes, 1), Y(n_out_nodes, 1);
+    batch_buffers<double> bb;
+    if (batch > 1) bb.resize(batch);
+    vector<double> flat(n_w0 + n_w1);
+    double *grad = seg.grad(id), *mse_out = seg.mse();
+    arrayt_arena step_arena;
+    shuffle_rng rng(seed + id);
+    vector<int> order;  // rows of the shard in the order they are visited
+
+    seg.read_weights(flat.data());
+    copy(flat.begin(), flat.begin() + n_w0, w0c.data());
+    copy(flat.begin() + n_w0, flat.end(), w1c.data());
+    for(int epoch=0; epoch < epochs; epoch++)
+    {
+        if (shuffle > 0){
+            shuffle_rows(order, end - begin, shuffle, rng);
+            for(size_t i=0; i < order.size(); i++) order[i] += begin;
+        }
+        double *mse_epoch = mse_out + (long) epoch*n + begin;
+        int nb = 1;
+        for(int r=0; r < end - begin; r += nb)
+        {
+            nb = min(batch, end - begin - r);
+            step_arena.reset();
+            arrayt_use_allocator use_arena(step_arena);
+
+            if (batch == 1){
+                const int row = (shuffle > 0) ? order[r] : begin + r;
+                const double pred = backprop(w0c, w1c, view_row(xTr, row), yTr(row), in_h, H, Y, w0_grad, w1_grad);
+                mse_epoch[r] = mse(pred, yTr(row));
+            }
+            else{
+                arrayt_view<double> x_batch = view_rows(xTr, begin + r, nb);
+                arrayt_view<double> y_batch = view_rows(yTr, begin + r, nb);
+                if (shuffle > 0){
+                    x_batch = view_rows(bb.X, 0, nb);
+                    y_batch = view_rows(bb.y, 0, nb);
+                    gather_rows(xTr, order.data() + r, x_batch);
+                    gather_rows(yTr, order.data() + r, y_batch);
+                }
+                backprop_batch(w0c, w1c, x_batch, y_batch, bb, w0_grad, w1_grad);
+                for(int i=0; i < nb; i++) mse_epoch[r + i] = mse(bb.Y(i,0), y_batch(i));
+            }
+            for(int i=0; i < nb; i++)
+            {
+                msg.loss += mse_epoch[r + i];
+                msg.examples++;
+            }
 
-            // add bias to hidden layer
-            mdoub Hb = add_bias(H, b1);
+            // push the gradient, wait for the server, pull the weights
+            copy(w0_grad.data(), w0_grad.data() + n_w0, grad);
+            copy(w1_grad.data(), w1_grad.data() + n_w1, grad + n_w0);
+            msg.type = PS_PUSH;
+            msg.step++;
+            ps_message reply;
+            if (!ps_send(fd, msg) || !ps_recv(fd, reply)) _exit(EXIT_FAILURE);
+            seg.read_weights(flat.data());
+            copy(flat.begin(), flat.begin() + n_w0, w0c.data());
+            copy(flat.begin() + n_w0, flat.end(), w1c.data());
+        }
+    }
+    msg.type = PS_DONE;
+    const bool sent = ps_send(fd, msg);
+    close(fd);
+    _exit(sent ? EXIT_SUCCESS : EXIT_FAILURE);
+}
 
-            // computer propogation from hiddern layer to output
-            mdoub w1T = transpose(w1);
-            mdoub Y = dot(w1T, Hb);
-            double pred = Y(0); // can convert back to double because just one output node
+bool train_ps(arrayt_view<double> xTr, arrayt_view<double> yTr, const int n_workers, const int staleness,
+    const int epochs, const int shuffle, const unsigned int seed, const int batch, long& examples)
+{
+    /*
+    Inputs:
+        xTr, yTr: the data, in memory
+        n_workers: number of worker processes
+        staleness: < 0 for synchronous updates, otherwise how many steps a
+            worker may get ahead of the slowest (see param_server.hpp)
+        epochs, shuffle, seed, batch: as in main()
+        examples: receives the number of examples trained on
+    Output:
+        false if a worker failed
+    Description:
+        This process becomes the parameter server: it puts w0 and w1 in a
+        new shared memory segment, forks the workers (train_ps_worker())
+        and serves them until they have all finished, then takes back the
+        weights and the mse of every example (epoch by epoch, in the order
+        of the shards) into mse_tracker.
+    */
+    const int n_w0 = w0.n(), n_w1 = w1.n();
+    const string shm_name = "/nn_ps_" + to_string(getpid());
+    const string sock_path = "/tmp/nn_ps_" + to_string(getpid()) + ".sock";
+    ps_segment seg;
+    if (!seg.create(shm_name.c_str(), n_workers, n_w0 + n_w1, (long) xTr.n1()*epochs)) return false;
+    vector<double> flat(n_w0 + n_w1);
+    copy(w0.data(), w0.data() + n_w0, flat.begin());
+    copy(w1.data(), w1.data() + n_w1, flat.begin() + n_w0);
+    seg.set_weights(flat.data());
+    const int listen_fd = ps_listen(sock_path.c_str());
+    if (listen_fd < 0){
+        ps_segment::unlink(shm_name.c_str());
+        return false;
+    }
 
-            // compute mse
-            valid_sum += mse(pred, ex_y);
-            benchmark_sum += mse(avg_redshift, ex_y);
+    // the workers share the hardware threads
+    const int worker_threads = max(default_num_threads()/n_workers, 1);
+    cout.flush();   // or the children print it again
+    vector<pid_t> pids;
+    for(int k=0; k < n_workers; k++)
+    {
+        const pid_t pid = fork();
+        if (pid == 0){
+            close(listen_fd);
+            restart_pool_after_fork(worker_threads);
+            train_ps_worker(xTr, yTr, k, n_workers, epochs, shuffle, seed, batch,
+                shm_name.c_str(), sock_path.c_str());
+        }
+        if (pid < 0){
+            perror("fork");
+            break;
+        }
+        pids.push_back(pid);
+    }
+
+    vector<ps_message> done;
+    bool ok = (int) pids.size() == n_workers && ps_serve(listen_fd, seg, alpha, staleness, done);
+    for(size_t k=0; k < pids.size(); k++)
+    {
+        int status;
+        if (!ok) kill(pids[k], SIGTERM);
+        if (waitpid(pids[k], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+    }
+    close(listen_fd);
+    unlink(sock_path.c_str());
+    ps_segment::unlink(shm_name.c_str());
+    if (!ok){
+        cout << "parameter server: a worker failed" << endl;
+        return false;
+    }
+
+    seg.read_weights(flat.data());
+    copy(flat.begin(), flat.begin() + n_w0, w0.data());
+    copy(flat.begin() + n_w0, flat.end(), w1.data());
+    examples = 0;
+    for(int k=0; k < n_workers; k++)
+    {
+        cout << "worker " << k << ": " << done[k].examples << " examples, mean training mse = "
+            << done[k].loss/max(done[k].examples, 1L) << endl;
+        examples += done[k].examples;
     }
-    cout << "validation mse = " << valid_sum/n_ex << endl;
-    cout << "benchmark mse = " << benchmark_sum/n_ex << endl;
+    cout << seg.version() << " updates" << endl;
+    mse_tracker.assign(seg.mse(), seg.mse() + examples);
+    return true;
 }
+#endif
 
 int main()
 {
     // goal: load ruby data
     // also, try to focus :)
-    mdoub xTr(10000,10);
-    mdoub yTr(10000);
+    arrayt_view<double> xTr, yTr; // the data files, see prepocess()
     mdoub xTe(2000,10); // not sure if will use
     mdoub yTe(2000);
 
-    prepocess(xTr, yTr, xTe, yTe);
+    // NN_STREAM_MB=<MB> streams the data (prep.nnd, or the csv files) through
+    // two buffers of that size while training, instead of loading all of it,
+    // for data that doesn't fit in memory (see data_stream.hpp)
+    const char *stream_mb = getenv("NN_STREAM_MB");
+    const bool streaming = (stream_mb != NULL && atof(stream_mb) > 0);
+    const long chunk_rows = streaming ? (long) (atof(stream_mb)*1e6/((n_input + 1)*sizeof(double))) + 1 : 0;
+    const char *norm = getenv("NN_NORMALIZE");
+    if (norm != NULL && atoi(norm) > 0) normalize = true;
+    data_stream<double> stream;
+    if (streaming){
+        if (normalize){
+            // the chunks are standardized as they are read, with the statistics
+            //   saved by an earlier run, or else from a first pass over the data
+            feature_stats saved;
+            if (file_exists(norm_file) && saved.load(norm_file) && saved.cols() == n_input){
+                x_stats = saved;
+                cout << "standardizing with the statistics in " << norm_file << endl;
+            }
+            else{
+                arrayt_view<double> x, y;
+                if (!open_stream(stream, chunk_rows)) exit(EXIT_FAILURE);
+                while (stream.next(x, y)) {}
+                if (stream.failed()) exit(EXIT_FAILURE);
+                x_stats = stream.x_stats();
+                y_stats = stream.y_stats();
+                cout << "standardizing with statistics from a first pass over the data" << endl;
+            }
+            stream.standardize_x(x_stats);
+        }
+        if (!open_stream(stream, chunk_rows)) exit(EXIT_FAILURE);
+        if (stream.features() != n_input || stream.targets() < 1){
+            cout << "the data has " << stream.features() << " features and " << stream.targets()
+                << " targets, the network takes " << n_input << " inputs" << endl;
+            exit(EXIT_FAILURE);
+        }
+        cout << "streaming the data in chunks of " << chunk_rows << " examples ("
+            << stream.buffer_bytes()*1e-6 << " MB of buffers)" << endl;
+    }
+    else prepocess(xTr, yTr, xTe, yTe);
     /*
     cout << "after preprocess" << endl;
     for(int i=0; i<xTr.n2(); i++)
@@ -346,121 +915,444 @@ int main()
     */
 
     // Randomize weights
-    unsigned int seed = time(NULL);
-
-    for(int i=0; i < w0.n1(); i++)
-    {
-        for(int j=0; j < w0.n2(); j++)
+    //   (NN_SEED=<n> for the same weights and shuffles every run)
+    const char *seed_env = getenv("NN_SEED");
+    unsigned int seed = (seed_env != NULL) ? (unsigned int) strtoul(seed_env, NULL, 10) : time(NULL);
+    cout << "seed = " << seed << endl;
+
+    // the layers: n_hidden_layers of n_hidden_nodes, or NN_LAYERS=<w>,<w>,...
+    //   for hidden layers of those widths (e.g. NN_LAYERS=32,16), all the
+    //   weights in one block and every buffer made here (see network.hpp)
+    vector<int> widths(1, n_input);
+    const char *layers_env = getenv("NN_LAYERS");
+    if (layers_env != NULL){
+        for(const char *p = layers_env; *p != '\0'; )
         {
-            w0(i,j) = myrand(seed)-0.5; // -0.5 to center mean at 0
+            char *end;
+            const long w = strtol(p, &end, 10);
+            if (end == p || w < 1){
+                cout << "NN_LAYERS should be widths separated by commas, not " << layers_env << endl;
+                exit(EXIT_FAILURE);
+            }
+            widths.push_back((int) w);
+            p = (*end == ',') ? end + 1 : end;
         }
+        cout << "hidden layers:";
+        for(size_t l=1; l < widths.size(); l++) cout << " " << widths[l];
+        cout << endl;
     }
-    //print(w0);
-    for(int i=0; i < w1.n1(); i++)
-    {
-        for(int j=0; j < w1.n2(); j++)
-        {
-            w1(i,j) = myrand(seed) -0.5; // -0.5 to center mean at 0
-        }
+    else for(int l=0; l < n_hidden_layers; l++) widths.push_back(n_hidden_nodes);
+    widths.push_back(n_out_nodes);
+    const bool two_layers = (widths.size() == 3 && widths[1] == n_hidden_nodes);
+    net.build(widths, 1, leak, b0);
+
+    // every weight in turn, layer by layer (w0 then w1 for two layers)
+    net.init([&]{ return myrand(seed)-0.5; }); // -0.5 to center mean at 0
+    if (two_layers){
+        convert(net.weights(0), arrayt_view<double>(w0));
+        convert(net.weights(1), arrayt_view<double>(w1));
     }
+    //print(w0);
     //print(w1);
 
 
-    // LOOP
-    //for(int i=0; i < xTr.n1(); i++)
-    for(int index=0; index < xTr.n1(); index++)
-    {
-        // get x example
-        mdoub example(xTr.n2(),1);
-        for (int j=0; j < example.n1(); j++){
-            example(j) = xTr(index,j);
-        }
-
-        // get y example
-        double ex_y = yTr(index);
-
-        // ------------------   forward prop in main    -----------------------------
-
-        // add bias to example for input into the network
-        mdoub inputb = add_bias(example, b0); 
-
-        // compute propogation of inputs to hidden layer
-        mdoub w0T = transpose(w0);
-        mdoub in_h = dot(w0T, inputb);
-
-        // H is vector of hidden layer activations of weighted input sums
-        mdoub H = applyFunction(leaky_ReLU, in_h);
-
-        // add bias to hidden layer
-        mdoub Hb = add_bias(H, b1);
-
-        // computer propogation from hiddern layer to output
-        mdoub w1T = transpose(w1);
-        mdoub Y = dot(w1T, Hb);
-        double pred = Y(0); // can convert back to double because just one output node 
-
-
-        // ------------------    backprop in main    -----------------------------
+    // temporaries made during a training step come from this arena,
+    // it is reset at the start of every step so after the first step
+    // the loop should not need the heap at all
+    arrayt_arena step_arena;
+    long heap_allocs_warm = arrayt_stats().heap_allocs;
+
+    // NN_EPOCHS=<n> passes over the data (default 1). NN_SHUFFLE=1 visits
+    //   the rows of every epoch in a new random order, NN_SHUFFLE=<b> (b > 1)
+    //   in random runs of b consecutive rows, so the data is still read mostly
+    //   sequentially (see shuffle.hpp). The data isn't moved, only the order
+    //   of the row indices. When streaming the rows of each chunk are shuffled.
+    const char *epochs_env = getenv("NN_EPOCHS"), *shuffle_env = getenv("NN_SHUFFLE");
+    const int epochs = (epochs_env != NULL && atoi(epochs_env) > 1) ? atoi(epochs_env) : 1;
+    const int shuffle = (shuffle_env != NULL && atoi(shuffle_env) > 0) ? atoi(shuffle_env) : 0;
+    shuffle_rng rng(seed);
+    vector<int> order;  // rows of the chunk in the order they are visited
+    if (shuffle == 1) cout << "shuffling the rows every epoch" << endl;
+    else if (shuffle > 1) cout << "shuffling runs of " << shuffle << " rows every epoch" << endl;
+
+    if (streaming){
+        if (stream.rows() > 0) mse_tracker.reserve(stream.rows()*epochs);
+    }
+    else mse_tracker.reserve((long) xTr.n1()*epochs);
+
+    // float copies of the data, weights and layers for mixed precision
+    //   (the data a chunk at a time)
+    const char *precision = getenv("NN_PRECISION");
+    if (precision != NULL && string(precision) == "mixed") mixed_precision = true;
+    arrayt<float> x_chunk_f, w0_f(w0.n1(), w0.n2()), w1_f(w1.n1(), w1.n2());
+    arrayt<float> in_h_f(n_hidden_nodes, 1), H_f(n_hidden_nodes, 1), Y_f(n_out_nodes, 1);
+    if (mixed_precision){
+        cout << "mixed precision: float forward/backward prop, double weights" << endl;
+        x_chunk_f.resize(streaming ? chunk_rows : xTr.n1(), n_input);
+    }
 
-        // calculate error of the predicition
-        double delta = pred - ex_y;
+    // NN_BATCH=<n> trains on n examples at a time: forward and back prop
+    //   are gemms over n rows of the data and the weights are updated with
+    //   the mean gradient of those rows (the default, 1, is per example SGD)
+    const char *batch_env = getenv("NN_BATCH");
+    const int batch = (batch_env != NULL && atoi(batch_env) > 1) ? atoi(batch_env) : 1;
+    batch_buffers<double> bb;
+    batch_buffers<float> bb_f;
+    if (batch > 1){
+        if (mixed_precision) bb_f.resize(batch);
+        else bb.resize(batch);
+        cout << "mini-batches of " << batch << " examples" << endl;
+    }
+    net.set_max_batch(batch);
+
+    // NN_SYNC=<s> (with NN_BATCH) computes the gradient of every mini-batch
+    //   data parallel: slices of s rows on the threads, summed in a fixed
+    //   tree (see backprop_sync()), then one update. The weights come out
+    //   the same, bit for bit, for a given seed on any number of threads.
+    const char *sync_env = getenv("NN_SYNC");
+    const int sync = (sync_env != NULL && atoi(sync_env) > 0) ? atoi(sync_env) : 0;
+    sync_buffers<double> sb;
+    sync_buffers<float> sb_f;
+    if (sync > 0){
+        if (batch == 1){
+            cout << "NN_SYNC splits mini-batches, set NN_BATCH too" << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (mixed_precision) sb_f.resize(batch, min(sync, batch));
+        else sb.resize(batch, min(sync, batch));
+        cout << "synchronous data parallel: slices of " << min(sync, batch) << " examples" << endl;
+    }
 
-        // update weights, going backwards from output
+    // the main loop trains net, except in mixed precision and with NN_SYNC,
+    //   which like NN_HOGWILD and NN_PS train w0 and w1, so two layers only
+    const bool use_net = !mixed_precision && sync == 0;
+    if (!two_layers && (!use_net || getenv("NN_HOGWILD") != NULL || getenv("NN_PS") != NULL)){
+        cout << "NN_PRECISION=mixed, NN_SYNC, NN_HOGWILD and NN_PS train one hidden layer of "
+            << n_hidden_nodes << " nodes, not NN_LAYERS" << endl;
+        exit(EXIT_FAILURE);
+    }
 
-        // update w1
-        mdoub w1_grad = delta*Hb; // overloaded * operator (scalar multiplication)
-        w1_grad = alpha*w1_grad; // scalar multiplication of learning rate and gradient
-        w1 = w1 - w1_grad; // update
-        
-        // update w0
-        mdoub w0_grad (w0.n1(), w0.n2());
+    // NN_OPTIMIZER=sgd (the default), momentum, rmsprop, adam or adamw picks
+    //   the update rule, each a single pass over the weights with its state
+    //   in arrays beside them (see optimizer.hpp); NN_LR=<lr> sets the
+    //   learning rate (alpha) and NN_WEIGHT_DECAY=<wd> the decay of adamw
+    const char *opt_env = getenv("NN_OPTIMIZER"), *lr_env = getenv("NN_LR");
+    const char *wd_env = getenv("NN_WEIGHT_DECAY");
+    if (lr_env != NULL && atof(lr_env) > 0) alpha = atof(lr_env);
+    optimizer<double> opt(OPT_SGD, alpha);
+    if (opt_env != NULL && !opt.set_kind(opt_env)){
+        cout << "NN_OPTIMIZER should be sgd, momentum, rmsprop, adam or adamw, not " << opt_env << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (wd_env != NULL) opt.weight_decay = atof(wd_env);
+    if (opt.kind != OPT_SGD || lr_env != NULL) cout << "optimizer: " << opt.name() << ", learning rate " << alpha << endl;
+    optimizer<double> opt_w0(opt), opt_w1(opt);  // for w0 and w1 in mixed precision and NN_SYNC
+    if (use_net) opt.init(net.n_params());
+    else{
+        opt_w0.init(w0.n());
+        opt_w1.init(w1.n());
+    }
 
-        for(int i=0; i < w0.n1(); i++)
-        {
-            for(int j=0; j < w0.n2();j++)
+    // when streaming, a copy of the last 100 examples read, for eval_performance
+    //   (row i of the data goes to row i%100)
+    const int n_tail = 100;
+    mdoub x_tail(n_tail, n_input), y_tail(n_tail);
+
+    // NN_HOGWILD=<p> trains on p threads at once, each on its own shard of
+    //   the data, all updating w0 and w1 without locks (see train_hogwild());
+    //   NN_HOGWILD=scale trains from the same starting weights on 1, 2, 4, ...
+    //   threads up to NN_THREADS (or every hardware thread) and reports the
+    //   examples/s and validation mse of each, keeping the last
+    const char *hogwild_env = getenv("NN_HOGWILD");
+    if (hogwild_env != NULL)
+    {
+        if (streaming || mixed_precision || batch > 1 || opt.kind != OPT_SGD){
+            cout << "NN_HOGWILD trains example by example with SGD in double on data in memory,"
+                << " not with NN_STREAM_MB, NN_PRECISION=mixed, NN_BATCH or NN_OPTIMIZER" << endl;
+            exit(EXIT_FAILURE);
+        }
+        vector<int> counts;
+        if (string(hogwild_env) == "scale"){
+            const int max_threads = default_num_threads();
+            for(int p=1; ; p = (2*p < max_threads) ? 2*p : max_threads)
             {
-                w0_grad(i,j) = delta * leaky_ReLU_deriv(in_h(j)) * inputb(i);
+                counts.push_back(p);
+                if (p == max_threads) break;
             }
         }
-        w0_grad = alpha*w0_grad; // (scalar multiplication)
-        w0 = w0 - w0_grad;
-
-        // compute mse
-        double ex_mse = mse(pred, ex_y);
-        mse_tracker.push_back(ex_mse);
+        else counts.push_back(max(atoi(hogwild_env), 1));
 
-        //cout << ex_y << "   " << pred << "   " << ex_mse << endl;
+        const mdoub w0_init(w0), w1_init(w1);
+        cout << "hogwild: " << setw(8) << "threads" << setw(14) << "examples/s"
+            << setw(10) << "speedup" << setw(16) << "validation mse" << endl;
+        double rate1 = 0.0;
+        for(size_t k=0; k < counts.size(); k++)
+        {
+            w0 = w0_init;
+            w1 = w1_init;
+            mse_tracker.clear();
+            long examples;
+            const double t = train_hogwild(xTr, yTr, counts[k], epochs, shuffle, seed, examples);
+            const double rate = examples/(t > 0 ? t : 1e-9);
+            if (k == 0) rate1 = rate;
+            net_from_w();
+            const double valid = eval_performance(xTr, yTr, true);
+            cout << "         " << setw(8) << counts[k] << fixed << setprecision(0) << setw(14) << rate
+                << setprecision(2) << setw(9) << rate/rate1 << "x" << defaultfloat << setprecision(6)
+                << setw(16) << valid << endl;
+        }
+        print(w0);
+        print(w1);
+        write_mse();
+        if (normalize && x_stats.save(norm_file)) cout << "wrote " << norm_file << endl;
+        eval_performance(xTr, yTr);
+        return(EXIT_SUCCESS);
+    }
 
-        bool done = stop(w0_grad, w1_grad);
-        if (done){
-            cout << "stopping at iteration " << index << endl;
-            print(w0);
-            print(w1);
-            break;
+    // NN_PS=<p> trains in p worker processes around a parameter server (this
+    //   process, see train_ps()): each worker trains on its own shard of the
+    //   data and every step (NN_BATCH examples) pushes its gradient through
+    //   shared memory and pulls the new weights. Synchronous updates, with
+    //   the mean gradient of all the workers, unless NN_PS_STALENESS=<s>:
+    //   then asynchronous, each gradient applied as it comes, with no worker
+    //   more than s steps ahead of the slowest
+    const char *ps_env = getenv("NN_PS");
+    if (ps_env != NULL && atoi(ps_env) > 0)
+    {
+#ifdef PARAM_SERVER_POSIX
+        if (streaming || mixed_precision || sync > 0 || opt.kind != OPT_SGD){
+            cout << "NN_PS trains with SGD in double on data in memory,"
+                << " not with NN_STREAM_MB, NN_PRECISION=mixed, NN_SYNC or NN_OPTIMIZER" << endl;
+            exit(EXIT_FAILURE);
         }
+        const int n_workers = atoi(ps_env);
+        const char *staleness_env = getenv("NN_PS_STALENESS");
+        const int staleness = (staleness_env != NULL) ? max(atoi(staleness_env), 0) : -1;
+        cout << "parameter server with " << n_workers << " worker processes, ";
+        if (staleness < 0) cout << "synchronous updates" << endl;
+        else cout << "asynchronous updates at most " << staleness << " steps apart" << endl;
+
+        long examples = 0;
+        const chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
+        if (!train_ps(xTr, yTr, n_workers, staleness, epochs, shuffle, seed, batch, examples)) exit(EXIT_FAILURE);
+        const double t = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        cout << "trained on " << examples << " examples, " << t << " s ("
+            << examples/(t > 0 ? t : 1e-9) << " examples/s)" << endl;
+        print(w0);
+        print(w1);
+        write_mse();
+        if (normalize && x_stats.save(norm_file)) cout << "wrote " << norm_file << endl;
+        net_from_w();
+        eval_performance(xTr, yTr);
+        return(EXIT_SUCCESS);
+#else
+        cout << "NN_PS needs POSIX shared memory and sockets" << endl;
+        exit(EXIT_FAILURE);
+#endif
+    }
 
-        if (index ==xTr.n1()-1)
+    // LOOP
+    // over chunks of the data, all of xTr in one chunk unless streaming
+    arrayt_view<double> x_chunk, y_chunk;
+    int index = 0;  // examples so far
+    int steps = 0;  // weight updates so far
+    bool stopped = false, first_chunk = true;
+    const chrono::steady_clock::time_point t_train = chrono::steady_clock::now();
+    for(int epoch=0; epoch < epochs && !stopped; epoch++)
+    {
+        if (streaming && epoch > 0 && !open_stream(stream, chunk_rows)) exit(EXIT_FAILURE);
+        const int epoch_start = index;
+        first_chunk = true;
+        while (!stopped)
         {
-            cout << "stopping at iteration " << index << endl;
-            print(w0);
-            print(w1);
-            break;
-        }
+            if (streaming){
+                if (!stream.next(x_chunk, y_chunk)) break;
+            }
+            else{
+                if (!first_chunk) break;
+                x_chunk = xTr;
+                y_chunk = yTr;
+            }
+            first_chunk = false;
+            if (mixed_precision && (streaming || epoch == 0)) convert(x_chunk, view_rows(x_chunk_f, 0, x_chunk.n1()));
+
+            // the order of this epoch (or chunk), NULL for file order
+            if (shuffle > 0) shuffle_rows(order, x_chunk.n1(), shuffle, rng);
+            const int *rows = (shuffle > 0) ? order.data() : NULL;
 
-        /*
-        cout << "iteration " << index << endl;
-        cout << "w0_grad" << endl;
-        print(w0_grad);
-        cout << "w1_grad" << endl;
-        print(w1_grad);
-        cout << "mse = " << ex_mse << "\n" << endl;
-        */
+            const int chunk_start = index;
+            int nb = 1; // examples in this step
+            for(int r=0; r < x_chunk.n1(); r += nb, index += nb, steps++)
+            {
+                nb = min(batch, x_chunk.n1() - r);
+                step_arena.reset();
+                arrayt_use_allocator use_arena(step_arena);
+                if (steps == 1) heap_allocs_warm = arrayt_stats().heap_allocs;
+
+                bool done;
+                if (use_net){
+                    // rows r to r+nb-1 of the chunk (views, no copy), or in
+                    //   a shuffled order: one row is still a view, more are
+                    //   gathered into one block
+                    arrayt_view<double> x_batch = view_rows(x_chunk, r, nb);
+                    arrayt_view<double> y_batch = view_rows(y_chunk, r, nb);
+                    if (rows != NULL && nb == 1){
+                        x_batch = view_rows(x_chunk, rows[r], 1);
+                        y_batch = view_rows(y_chunk, rows[r], 1);
+                    }
+                    else if (rows != NULL){
+                        x_batch = view_rows(bb.X, 0, nb);
+                        y_batch = view_rows(bb.y, 0, nb);
+                        gather_rows(x_chunk, rows + r, x_batch);
+                        gather_rows(y_chunk, rows + r, y_batch);
+                    }
+
+                    // forward and back prop through every layer, in net's
+                    //   own buffers, then the update in one pass over all
+                    //   the weights
+                    arrayt_view<double> pred = net.train_step(x_batch, y_batch);
+                    if (pred.n1() != nb) exit(EXIT_FAILURE);    // forward() said why
+                    for(int i=0; i < nb; i++) mse_tracker.push_back(mse(pred(i,0), y_batch(i)));
+                    opt.step(net.params(), net.grads());
+                    done = stop(net.grads(), alpha);
+                }
+                else{
+                    // w0 and w1, forward and back prop in float (mixed
+                    //   precision) or in slices on the threads (NN_SYNC)
+                    mdoub w1_grad(w1.n1(), w1.n2()), w0_grad(w0.n1(), w0.n2());
+                    if (mixed_precision){
+                        // this step's float copy of the weights
+                        convert(w0, w0_f);
+                        convert(w1, w1_f);
+                    }
+                    if (batch == 1){
+                        // get y example
+                        const int row = (rows != NULL) ? rows[r] : r;
+                        double ex_y = y_chunk(row, 0);
+
+                        const double pred = backprop(w0_f, w1_f, view_row(x_chunk_f, row), ex_y, in_h_f, H_f, Y_f, w0_grad, w1_grad);
+
+                        // compute mse
+                        double ex_mse = mse(pred, ex_y);
+                        mse_tracker.push_back(ex_mse);
+
+                        //cout << ex_y << "   " << pred << "   " << ex_mse << endl;
+                    }
+                    else if (sync > 0){
+                        // the slices of the batch on the threads, their
+                        //   gradients summed in a fixed order
+                        if (mixed_precision){
+                            backprop_sync(w0_f, w1_f, view_rows(x_chunk_f, 0, x_chunk.n1()), y_chunk, rows, r, nb, sb_f);
+                            convert(sb_f.part[0].w0_grad, w0_grad);
+                            convert(sb_f.part[0].w1_grad, w1_grad);
+                            for(int i=0; i < nb; i++) mse_tracker.push_back(mse(sb_f.pred(i), y_chunk(rows != NULL ? rows[r+i] : r+i, 0)));
+                        }
+                        else{
+                            backprop_sync(w0, w1, x_chunk, y_chunk, rows, r, nb, sb);
+                            w0_grad = sb.part[0].w0_grad;
+                            w1_grad = sb.part[0].w1_grad;
+                            for(int i=0; i < nb; i++) mse_tracker.push_back(mse(sb.pred(i), y_chunk(rows != NULL ? rows[r+i] : r+i, 0)));
+                        }
+                    }
+                    else{
+                        // rows r to r+nb-1 of the chunk (views, no copy), or in
+                        //   a shuffled order gathered into one block
+                        arrayt_view<double> y_batch = view_rows(y_chunk, r, nb);
+                        arrayt_view<float> x_batch = view_rows(x_chunk_f, r, nb);
+                        if (rows != NULL){
+                            y_batch = view_rows(bb_f.y, 0, nb);
+                            x_batch = view_rows(bb_f.X, 0, nb);
+                            gather_rows(y_chunk, rows + r, y_batch);
+                            gather_rows(arrayt_view<float>(x_chunk_f), rows + r, x_batch);
+                        }
+                        backprop_batch(w0_f, w1_f, x_batch, y_batch, bb_f,
+                            bb_f.w0_grad, bb_f.w1_grad);
+                        convert(bb_f.w0_grad, w0_grad);
+                        convert(bb_f.w1_grad, w1_grad);
+                        for(int i=0; i < nb; i++) mse_tracker.push_back(mse(bb_f.Y(i,0), y_batch(i)));
+                    }
+
+                    // update weights (in double), going backwards from output,
+                    //   each in one pass (no temporaries)
+                    opt_w1.step(w1, w1_grad);
+                    opt_w0.step(w0, w0_grad);
+
+                    // stop when alpha times every gradient is below threshold
+                    done = stop(w0_grad, alpha) && stop(w1_grad, alpha);
+                }
+                if (done){
+                    cout << "stopping at iteration " << index << endl;
+                    stopped = true;
+                    index += nb;
+                    steps++;
+                    break;
+                }
+
+                /*
+                cout << "iteration " << index << endl;
+                cout << "w0_grad" << endl;
+                print(w0_grad);
+                cout << "w1_grad" << endl;
+                print(w1_grad);
+                cout << "mse = " << ex_mse << "\n" << endl;
+                */
 
+            }
+
+            if (streaming){
+                for(int i = max(chunk_start, index - n_tail); i < index; i++)
+                {
+                    for(int j=0; j < n_input; j++) x_tail(i % n_tail, j) = x_chunk(i - chunk_start, j);
+                    y_tail(i % n_tail) = y_chunk(i - chunk_start, 0);
+                }
+            }
+        }
+        if (streaming && stream.failed()) exit(EXIT_FAILURE);
+        if (epochs > 1){
+            double sum = 0;
+            for(int i=epoch_start; i < index; i++) sum += mse_tracker[i];
+            cout << "epoch " << epoch+1 << ": mean training mse = " << sum/max(index - epoch_start, 1) << endl;
+        }
+    }
+    const double t_loop = chrono::duration<double>(chrono::steady_clock::now() - t_train).count();
+    const long heap_allocs_loop = arrayt_stats().heap_allocs - heap_allocs_warm;
+    if (streaming){
+        // statistics of the examples read (the reader is stopped first), for
+        //   the ones not chosen before training: with NN_NORMALIZE the model
+        //   was trained on chunks standardized with x_stats, so those go to
+        //   norm_file, not the last (maybe partial) pass
+        stream.close();
+        if (!normalize) x_stats = stream.x_stats();
+        if (y_stats.empty()) y_stats = stream.y_stats();
     }
+    if (!stopped) cout << "stopping at iteration " << index-1 << endl;
+    if (!use_net) net_from_w();
+    print_weights();
+    cout << "trained on " << index << " examples in " << steps << " steps, " << t_loop << " s ("
+        << index/(t_loop > 0 ? t_loop : 1e-9) << " examples/s)" << endl;
+    if (streaming) cout << "waited " << stream.wait_seconds() << " s for data" << endl;
+    cout << "heap allocations in training loop after first step = "
+        << heap_allocs_loop
+        << " (arena allocations = " << arrayt_stats().arena_allocs << ")" << endl;
     
     write_mse();
-
-    eval_performance(xTr, yTr);
+    if (normalize && x_stats.save(norm_file)) cout << "wrote " << norm_file << endl;
+
+    if (streaming && min(index, n_tail) == 0) cout << "no examples read, nothing to validate on" << endl;
+    else if (streaming){
+        // the last examples in order, oldest first (eval_performance() takes
+        //   at most the last 100 of them)
+        const int n = min(index, n_tail);
+        mdoub x_last(n, n_input), y_last(n);
+        for(int k=0; k < n; k++)
+        {
+            const int i = (index - n + k) % n_tail;
+            for(int j=0; j < n_input; j++) x_last(k, j) = x_tail(i, j);
+            y_last(k) = y_tail(i);
+        }
+        eval_performance(x_last, y_last);
+    }
+    else eval_performance(xTr, yTr);
 
     return(EXIT_SUCCESS); 
 }
\ No newline at end of file
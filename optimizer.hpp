@@ -0,0 +1,418 @@
+/*
+optimizer.hpp
+
+Update rules for the weights, each one a fused kernel: a single pass over the
+weights that reads the gradient and the optimizer's state and writes the new
+state and the new weights, element by element, with nothing in between.
+
+    optimizer<double> opt(OPT_ADAM, lr);    // or opt.set_kind("adam")
+    opt.init(n)                 // state for n weights (before training, the
+                                //   only allocation)
+    opt.step(w, g)              // w, g: n weights and their gradient
+
+    OPT_SGD         w = w - lr*g
+    OPT_MOMENTUM    m = mu*m + g,  w = w - lr*m
+    OPT_RMSPROP     v = rho*v + (1-rho)*g*g,  w = w - lr*g/(sqrt(v) + eps)
+    OPT_ADAM        m = b1*m + (1-b1)*g,  v = b2*v + (1-b2)*g*g,
+                    w = w - a_t*m/(sqrt(v) + eps_t)
+                    with the bias corrections of step t folded into
+                    a_t = lr*sqrt(1-b2^t)/(1-b1^t), eps_t = eps*sqrt(1-b2^t)
+                    (Kingma and Ba, section 2)
+    OPT_ADAMW       Adam, then the decoupled weight decay w = w - lr*wd*w
+                    (Loshchilov and Hutter)
+
+The state (m, v) is kept in arrays of the same length as the weights, so with
+network::params() and network::grads() (network.hpp) every array in the pass
+is contiguous and read once from the start.
+
+The kernels come in the same instruction sets as simd.hpp (scalar, SSE2,
+AVX2, AVX-512, picked at startup, NN_SIMD lowers the level) and, like those,
+do the same IEEE operations in the same order on every element, so all the
+levels give the same bits.
+Arrays of more than PARALLEL_THRESHOLD weights are split over the thread pool.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef OPTIMIZER
+#define OPTIMIZER
+
+#include <cmath>
+#include <string>
+#include <iostream>
+#include "arrayt.hpp"
+#include "simd.hpp"
+#include "threadpool.hpp"
+
+using namespace std;
+
+// every product is its own statement and GCC is told not to contract here, so
+//   no level turns a multiply and an add into a fused multiply-add (AVX-512
+//   and the FMA extension have one, with a different rounding)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+// ------------------------------ scalar ---------------------------------------
+
+template <class T>
+inline void sgd_scalar(const int n, const T lr, T *w, const T *g)
+{
+    for(int i=0; i < n; i++)
+    {
+        const T u = lr*g[i];
+        w[i] = w[i] - u;
+    }
+}
+
+template <class T>
+inline void momentum_scalar(const int n, const T lr, const T mu, T *w, const T *g, T *m)
+{
+    for(int i=0; i < n; i++)
+    {
+        const T a = mu*m[i];
+        m[i] = a + g[i];
+        const T u = lr*m[i];
+        w[i] = w[i] - u;
+    }
+}
+
+template <class T>
+inline void rmsprop_scalar(const int n, const T lr, const T rho, const T eps, T *w, const T *g, T *v)
+{
+    const T c = 1 - rho;
+    for(int i=0; i < n; i++)
+    {
+        const T gg = g[i]*g[i];
+        const T a = rho*v[i], b = c*gg;
+        v[i] = a + b;
+        const T u = lr*g[i];
+        w[i] = w[i] - u/(sqrt(v[i]) + eps);
+    }
+}
+
+template <class T>
+inline void adam_scalar(const int n, const T a, const T b1, const T b2, const T eps, const T d,
+    T *w, const T *g, T *m, T *v)
+{
+    // d = lr*weight decay (0 for Adam)
+    const T c1 = 1 - b1, c2 = 1 - b2;
+    for(int i=0; i < n; i++)
+    {
+        const T gg = g[i]*g[i];
+        const T m0 = b1*m[i], m1 = c1*g[i];
+        const T v0 = b2*v[i], v1 = c2*gg;
+        m[i] = m0 + m1;
+        v[i] = v0 + v1;
+        const T am = a*m[i], dw = d*w[i];
+        const T u = am/(sqrt(v[i]) + eps);
+        w[i] = (w[i] - u) - dw;
+    }
+}
+
+#ifdef SIMD_X86
+
+// one macro per kernel, as in simd.hpp: T = element type, W = elements per
+//   register, the remainder goes to the scalar version
+#define OPT_SGD_KERNEL(fname, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    SIMD_TARGET(isa) inline void fname(const int n, const T lr, T *w, const T *g)        \
+    {                                                                                  \
+        const vtype vlr = set1(lr);                                                    \
+        int i = 0;                                                                     \
+        for(; i + W <= n; i += W)                                                      \
+        {                                                                              \
+            const vtype u = vmul(vlr, load(g + i));                                    \
+            store(w + i, vsub(load(w + i), u));                                        \
+        }                                                                              \
+        sgd_scalar<T>(n - i, lr, w + i, g + i);                                        \
+    }
+
+#define OPT_MOMENTUM_KERNEL(fname, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    SIMD_TARGET(isa) inline void fname(const int n, const T lr, const T mu, T *w,        \
+        const T *g, T *m)                                                              \
+    {                                                                                  \
+        const vtype vlr = set1(lr), vmu = set1(mu);                                    \
+        int i = 0;                                                                     \
+        for(; i + W <= n; i += W)                                                      \
+        {                                                                              \
+            const vtype a = vmul(vmu, load(m + i));                                    \
+            const vtype mi = vadd(a, load(g + i));                                     \
+            store(m + i, mi);                                                          \
+            const vtype u = vmul(vlr, mi);                                             \
+            store(w + i, vsub(load(w + i), u));                                        \
+        }                                                                              \
+        momentum_scalar<T>(n - i, lr, mu, w + i, g + i, m + i);                        \
+    }
+
+#define OPT_RMSPROP_KERNEL(fname, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    SIMD_TARGET(isa) inline void fname(const int n, const T lr, const T rho, const T eps, \
+        T *w, const T *g, T *v)                                                        \
+    {                                                                                  \
+        const vtype vlr = set1(lr), vrho = set1(rho), vc = set1(1 - rho);              \
+        const vtype veps = set1(eps);                                                  \
+        int i = 0;                                                                     \
+        for(; i + W <= n; i += W)                                                      \
+        {                                                                              \
+            const vtype gi = load(g + i);                                              \
+            const vtype gg = vmul(gi, gi);                                             \
+            const vtype a = vmul(vrho, load(v + i)), b = vmul(vc, gg);                 \
+            const vtype vi = vadd(a, b);                                               \
+            store(v + i, vi);                                                          \
+            const vtype u = vmul(vlr, gi);                                             \
+            store(w + i, vsub(load(w + i), vdiv(u, vadd(vsqrt(vi), veps))));           \
+        }                                                                              \
+        rmsprop_scalar<T>(n - i, lr, rho, eps, w + i, g + i, v + i);                   \
+    }
+
+#define OPT_ADAM_KERNEL(fname, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    SIMD_TARGET(isa) inline void fname(const int n, const T a, const T b1, const T b2,   \
+        const T eps, const T d, T *w, const T *g, T *m, T *v)                          \
+    {                                                                                  \
+        const vtype va = set1(a), vb1 = set1(b1), vb2 = set1(b2);                      \
+        const vtype vc1 = set1(1 - b1), vc2 = set1(1 - b2);                            \
+        const vtype veps = set1(eps), vd = set1(d);                                    \
+        int i = 0;                                                                     \
+        for(; i + W <= n; i += W)                                                      \
+        {                                                                              \
+            const vtype gi = load(g + i), wi = load(w + i);                            \
+            const vtype gg = vmul(gi, gi);                                             \
+            const vtype m0 = vmul(vb1, load(m + i)), m1 = vmul(vc1, gi);               \
+            const vtype v0 = vmul(vb2, load(v + i)), v1 = vmul(vc2, gg);               \
+            const vtype mi = vadd(m0, m1), vi = vadd(v0, v1);                          \
+            store(m + i, mi);                                                          \
+            store(v + i, vi);                                                          \
+            const vtype am = vmul(va, mi), dw = vmul(vd, wi);                          \
+            const vtype u = vdiv(am, vadd(vsqrt(vi), veps));                           \
+            store(w + i, vsub(vsub(wi, u), dw));                                       \
+        }                                                                              \
+        adam_scalar<T>(n - i, a, b1, b2, eps, d, w + i, g + i, m + i, v + i);          \
+    }
+
+#define OPT_KERNELS(suffix, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    OPT_SGD_KERNEL(sgd_##suffix, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    OPT_MOMENTUM_KERNEL(momentum_##suffix, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    OPT_RMSPROP_KERNEL(rmsprop_##suffix, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt) \
+    OPT_ADAM_KERNEL(adam_##suffix, isa, T, W, vtype, load, store, set1, vadd, vsub, vmul, vdiv, vsqrt)
+
+OPT_KERNELS(sse2, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_set1_pd,
+    _mm_add_pd, _mm_sub_pd, _mm_mul_pd, _mm_div_pd, _mm_sqrt_pd)
+OPT_KERNELS(f_sse2, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_set1_ps,
+    _mm_add_ps, _mm_sub_ps, _mm_mul_ps, _mm_div_ps, _mm_sqrt_ps)
+OPT_KERNELS(avx2, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd,
+    _mm256_add_pd, _mm256_sub_pd, _mm256_mul_pd, _mm256_div_pd, _mm256_sqrt_pd)
+OPT_KERNELS(f_avx2, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps,
+    _mm256_add_ps, _mm256_sub_ps, _mm256_mul_ps, _mm256_div_ps, _mm256_sqrt_ps)
+// GCC's _mm512_sqrt_pd/_ps start from an undefined register and draw
+//   -Wmaybe-uninitialized; the zero-masked form with every lane set is the
+//   same instruction without it
+SIMD_TARGET("avx512f") inline __m512d opt_sqrt_avx512(const __m512d x) { return _mm512_maskz_sqrt_pd(0xff, x); }
+SIMD_TARGET("avx512f") inline __m512 opt_sqrt_f_avx512(const __m512 x) { return _mm512_maskz_sqrt_ps(0xffff, x); }
+
+OPT_KERNELS(avx512, "avx512f", double, 8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd,
+    _mm512_add_pd, _mm512_sub_pd, _mm512_mul_pd, _mm512_div_pd, opt_sqrt_avx512)
+OPT_KERNELS(f_avx512, "avx512f", float, 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps,
+    _mm512_add_ps, _mm512_sub_ps, _mm512_mul_ps, _mm512_div_ps, opt_sqrt_f_avx512)
+
+#undef OPT_SGD_KERNEL
+#undef OPT_MOMENTUM_KERNEL
+#undef OPT_RMSPROP_KERNEL
+#undef OPT_ADAM_KERNEL
+#undef OPT_KERNELS
+
+#endif  // SIMD_X86
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+// ------------------------------ dispatch -------------------------------------
+
+template <class T>
+struct optimizer_kernels
+{
+    void (*sgd)(const int n, const T lr, T *w, const T *g);
+    void (*momentum)(const int n, const T lr, const T mu, T *w, const T *g, T *m);
+    void (*rmsprop)(const int n, const T lr, const T rho, const T eps, T *w, const T *g, T *v);
+    void (*adam)(const int n, const T a, const T b1, const T b2, const T eps, const T d,
+        T *w, const T *g, T *m, T *v);
+};
+
+inline void optimizer_table(const simd_level level, optimizer_kernels<double>& k, optimizer_kernels<float>& kf)
+{
+    // kernel tables for a given level (scalar if it isn't compiled in)
+    optimizer_kernels<double> d = { sgd_scalar<double>, momentum_scalar<double>,
+        rmsprop_scalar<double>, adam_scalar<double> };
+    optimizer_kernels<float> f = { sgd_scalar<float>, momentum_scalar<float>,
+        rmsprop_scalar<float>, adam_scalar<float> };
+#ifdef SIMD_X86
+    if (level == SIMD_SSE2){
+        optimizer_kernels<double> ds = { sgd_sse2, momentum_sse2, rmsprop_sse2, adam_sse2 };
+        optimizer_kernels<float> fs = { sgd_f_sse2, momentum_f_sse2, rmsprop_f_sse2, adam_f_sse2 };
+        d = ds;
+        f = fs;
+    } else if (level == SIMD_AVX2){
+        optimizer_kernels<double> ds = { sgd_avx2, momentum_avx2, rmsprop_avx2, adam_avx2 };
+        optimizer_kernels<float> fs = { sgd_f_avx2, momentum_f_avx2, rmsprop_f_avx2, adam_f_avx2 };
+        d = ds;
+        f = fs;
+    } else if (level == SIMD_AVX512){
+        optimizer_kernels<double> ds = { sgd_avx512, momentum_avx512, rmsprop_avx512, adam_avx512 };
+        optimizer_kernels<float> fs = { sgd_f_avx512, momentum_f_avx512, rmsprop_f_avx512, adam_f_avx512 };
+        d = ds;
+        f = fs;
+    }
+#endif
+    k = d;
+    kf = f;
+}
+
+template <class T>
+optimizer_kernels<T>& opt_kernels();
+
+template <>
+inline optimizer_kernels<double>& opt_kernels<double>()
+{
+    // the kernels in use, chosen on first call (from any thread: the
+    //   static is initialized once, by the first caller)
+    static optimizer_kernels<double> k = []
+    {
+        optimizer_kernels<double> d;
+        optimizer_kernels<float> f;
+        optimizer_table(simd_startup_level(), d, f);
+        return d;
+    }();
+    return k;
+}
+
+template <>
+inline optimizer_kernels<float>& opt_kernels<float>()
+{
+    static optimizer_kernels<float> kf = []
+    {
+        optimizer_kernels<double> d;
+        optimizer_kernels<float> f;
+        optimizer_table(simd_startup_level(), d, f);
+        return f;
+    }();
+    return kf;
+}
+
+inline void optimizer_set_level(simd_level level)
+{
+    // like simd_set_level(), for the optimizer kernels
+    if (level > simd_cpu_level()) level = simd_cpu_level();
+    optimizer_table(level, opt_kernels<double>(), opt_kernels<float>());
+}
+
+// ------------------------------ the optimizer --------------------------------
+
+enum optimizer_kind { OPT_SGD, OPT_MOMENTUM, OPT_RMSPROP, OPT_ADAM, OPT_ADAMW };
+
+template <class T>
+class optimizer
+{
+public:
+    optimizer_kind kind;
+    double lr;              // learning rate
+    double momentum;        // mu for OPT_MOMENTUM
+    double rho;             // decay of the squared gradients for OPT_RMSPROP
+    double beta1, beta2;    // decays of the two moments for Adam
+    double eps;             // added to the root mean square (RMSProp, Adam)
+    double weight_decay;    // wd for OPT_ADAMW
+
+    explicit optimizer(const optimizer_kind k = OPT_SGD, const double lr = 0.001)
+        : kind(k), lr(lr), momentum(0.9), rho(0.9), beta1(0.9), beta2(0.999), eps(1e-8),
+          weight_decay(0.01), t(0) {}
+
+    bool set_kind(const string& name);
+    const char* name() const;
+
+    void init(const int n);
+    long steps() const { return t; }
+    void step(arrayt<T>& w, const arrayt<T>& g);
+
+private:
+    arrayt<T> m, v;     // first and second moments, parallel to the weights
+    long t;             // steps taken
+};
+
+template <class T>
+bool optimizer<T>::set_kind(const string& s)
+{
+    // from its name: sgd, momentum, rmsprop, adam or adamw
+    if (s == "sgd") kind = OPT_SGD;
+    else if (s == "momentum") kind = OPT_MOMENTUM;
+    else if (s == "rmsprop") kind = OPT_RMSPROP;
+    else if (s == "adam") kind = OPT_ADAM;
+    else if (s == "adamw") kind = OPT_ADAMW;
+    else return false;
+    return true;
+}
+
+template <class T>
+const char* optimizer<T>::name() const
+{
+    const char *names[] = { "sgd", "momentum", "rmsprop", "adam", "adamw" };
+    return names[kind];
+}
+
+template <class T>
+void optimizer<T>::init(const int n)
+{
+    // zero state for n weights, and the step count back to 0
+    //   (SGD needs none, momentum and RMSProp one array, Adam two)
+    const int n_m = (kind == OPT_SGD || kind == OPT_RMSPROP) ? 0 : n;
+    const int n_v = (kind == OPT_RMSPROP || kind == OPT_ADAM || kind == OPT_ADAMW) ? n : 0;
+    m.resize(n_m > 0 ? n_m : 1);
+    v.resize(n_v > 0 ? n_v : 1);
+    for(int i=0; i < m.n(); i++) m.data()[i] = 0;
+    for(int i=0; i < v.n(); i++) v.data()[i] = 0;
+    t = 0;
+}
+
+template <class T>
+void optimizer<T>::step(arrayt<T>& w, const arrayt<T>& g)
+{
+    /*
+    Inputs:
+        w: the weights, updated in place
+        g: their gradient, the same size
+    Description:
+        One fused pass of the kernel for kind, over ranges of the
+        weights on the thread pool for big arrays. Nothing is allocated.
+    */
+    const int n = w.n();
+    const bool needs_m = (kind == OPT_MOMENTUM || kind == OPT_ADAM || kind == OPT_ADAMW);
+    const bool needs_v = (kind == OPT_RMSPROP || kind == OPT_ADAM || kind == OPT_ADAMW);
+    if (g.n() != n || (needs_m && m.n() != n) || (needs_v && v.n() != n)){
+        cout << "optimizer::step needs init(" << n << ") and a gradient of the same size" << endl;
+        return;
+    }
+    t++;
+    T *pw = w.data(), *pm = m.data(), *pv = v.data();
+    const T *pg = g.data();
+    const optimizer_kernels<T>& k = opt_kernels<T>();
+    if (kind == OPT_SGD){
+        const T a = (T) lr;
+        parallel_elements(n, [=](int i0, int i1) { k.sgd(i1 - i0, a, pw + i0, pg + i0); });
+    }
+    else if (kind == OPT_MOMENTUM){
+        const T a = (T) lr, mu = (T) momentum;
+        parallel_elements(n, [=](int i0, int i1) { k.momentum(i1 - i0, a, mu, pw + i0, pg + i0, pm + i0); });
+    }
+    else if (kind == OPT_RMSPROP){
+        const T a = (T) lr, r = (T) rho, e = (T) eps;
+        parallel_elements(n, [=](int i0, int i1) { k.rmsprop(i1 - i0, a, r, e, pw + i0, pg + i0, pv + i0); });
+    }
+    else{
+        // bias corrections folded into the step size and epsilon
+        const double c1 = 1 - pow(beta1, (double) t), c2 = sqrt(1 - pow(beta2, (double) t));
+        const T a = (T) (lr*c2/c1), e = (T) (eps*c2), b1 = (T) beta1, b2 = (T) beta2;
+        const T d = (T) ((kind == OPT_ADAMW) ? lr*weight_decay : 0.0);
+        parallel_elements(n, [=](int i0, int i1) { k.adam(i1 - i0, a, b1, b2, e, d, pw + i0, pg + i0, pm + i0, pv + i0); });
+    }
+}
+
+#endif
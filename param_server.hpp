@@ -0,0 +1,482 @@
+/*
+param_server.hpp
+
+Training in several processes on one machine around a parameter server: the
+server process owns the weights, each worker process trains on its own shard
+of the data, pushes its gradients to the server and pulls the new weights.
+Separate processes can sit on separate NUMA nodes (with numactl or the OS
+scheduler), where the threads of one process share one node's memory.
+
+The numbers go through one POSIX shared memory segment (shm_open), made by
+the server and mapped by every worker:
+
+    header | weights | gradient slot of worker 0 | of worker 1 | ... | mse
+
+A worker writes its gradient into its own slot and copies the weights
+straight out of the segment, nothing big goes through the kernel. Only the
+control messages (a few bytes: "my gradient of step k is in my slot",
+"go on", "finished") go through a Unix domain socket, one connection per
+worker, so a worker waiting for the server sleeps in read() instead of
+spinning.
+
+    ps_segment seg;
+    seg.create(name, n_workers, n_params, n_mse)    // the server
+    seg.attach(name)                                // a worker
+    seg.grad(w), seg.mse()                          // worker w's slot, the
+                                                    //   training mse area
+    seg.read_weights(out)       // a consistent copy, even while the server
+                                //   is writing them (a seqlock)
+    seg.set_weights(src), seg.update_weights(g, step)   // the server only
+
+    ps_listen(path), ps_connect(path)               // the control socket
+    ps_send(fd, msg), ps_recv(fd, msg)
+    ps_serve(listen_fd, seg, alpha, staleness, done)    // the server's loop
+
+Updates:
+    staleness < 0, synchronous: the server waits for the gradient of step k
+        from every worker still training, adds them up in worker order,
+        steps with their mean and only then lets the workers go on to step
+        k+1. The result doesn't depend on which worker is fastest.
+    staleness s >= 0, asynchronous with bounded staleness (stale synchronous
+        parallel): every gradient is applied as soon as it arrives and its
+        worker goes on right away, unless it is more than s steps ahead of
+        the slowest worker still training; then it waits for that one to
+        catch up. The weights a worker pulls are never more than s steps of
+        each other worker behind.
+
+POSIX only (Linux, macOS). Link with -lrt for shm_open on glibc before 2.34.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef PARAM_SERVER
+#define PARAM_SERVER
+
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+#include "hogwild.hpp"  // relaxed_load, relaxed_store
+
+#if defined(__unix__) || defined(__APPLE__)
+#define PARAM_SERVER_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+using namespace std;
+
+#ifdef PARAM_SERVER_POSIX
+
+// seconds the server waits for all the workers to connect
+#ifndef PS_CONNECT_TIMEOUT
+#define PS_CONNECT_TIMEOUT 30
+#endif
+
+struct ps_header
+{
+    uint64_t magic;
+    int n_workers, n_params;
+    long n_mse;     // doubles in the mse area
+    long seq;       // odd while the server writes the weights
+    long version;   // updates applied to the weights
+};
+
+enum ps_message_type { PS_HELLO, PS_PUSH, PS_DONE, PS_GO };
+
+struct ps_message
+{
+    int type;           // ps_message_type
+    int worker;
+    long step;          // PS_PUSH: steps the worker has pushed, this one too
+    double loss;        // PS_DONE: sum of the worker's training mse
+    long examples;      //   over this many examples
+};
+
+class ps_segment
+{
+public:
+    ps_segment() : h(NULL), bytes(0), slot(0), w(NULL), g(NULL), m(NULL) {}
+    ~ps_segment() { close(); }
+
+    bool create(const char *name, const int n_workers, const int n_params, const long n_mse);
+    bool attach(const char *name);
+    void close();
+    static void unlink(const char *name) { shm_unlink(name); }
+
+    int workers() const { return h->n_workers; }
+    int params() const { return h->n_params; }
+    long version() const { return __atomic_load_n(&h->version, __ATOMIC_ACQUIRE); }
+
+    double* grad(const int worker) { return g + worker*slot; }
+    double* mse() { return m; }
+
+    void read_weights(double *out) const;
+    void set_weights(const double *src);
+    void update_weights(const double *grad, const double step);
+
+private:
+    static const uint64_t magic = 0x6e6e5f70735f3031ull;   // "nn_ps_01"
+    static const size_t header_bytes = 64;
+
+    ps_header *h;
+    size_t bytes;
+    long slot;          // doubles per gradient slot, a whole number of cache lines
+    double *w, *g, *m;  // weights, gradient slots, mse
+
+    bool map(const int fd, const size_t n);
+    void layout();
+
+    ps_segment(const ps_segment&);
+    ps_segment& operator=(const ps_segment&);
+};
+
+inline bool ps_segment::map(const int fd, const size_t n)
+{
+    void *p = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);    // the mapping stays valid
+    if (p == MAP_FAILED){
+        perror("ps_segment: mmap");
+        return false;
+    }
+    h = (ps_header*) p;
+    bytes = n;
+    return true;
+}
+
+inline void ps_segment::layout()
+{
+    slot = (h->n_params + 7)/8*8;
+    w = (double*) ((char*) h + header_bytes);
+    g = w + slot;
+    m = g + h->n_workers*slot;
+}
+
+inline bool ps_segment::create(const char *name, const int n_workers, const int n_params, const long n_mse)
+{
+    // a new segment, zeroed, for the server
+    close();
+    const long sl = (n_params + 7)/8*8;
+    const size_t n = header_bytes + sizeof(double)*((1 + n_workers)*sl + n_mse);
+    const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0){
+        perror("ps_segment: shm_open");
+        return false;
+    }
+    if (ftruncate(fd, n) != 0){
+        perror("ps_segment: ftruncate");
+        ::close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    if (!map(fd, n)){
+        shm_unlink(name);
+        return false;
+    }
+    h->n_workers = n_workers;
+    h->n_params = n_params;
+    h->n_mse = n_mse;
+    __atomic_store_n(&h->magic, magic, __ATOMIC_RELEASE);
+    layout();
+    return true;
+}
+
+inline bool ps_segment::attach(const char *name)
+{
+    // the server's segment, for a worker
+    close();
+    const int fd = shm_open(name, O_RDWR, 0600);
+    if (fd < 0){
+        perror("ps_segment: shm_open");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) header_bytes){
+        cout << "ps_segment: " << name << " is too small" << endl;
+        ::close(fd);
+        return false;
+    }
+    if (!map(fd, st.st_size)) return false;
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != magic){
+        cout << "ps_segment: " << name << " isn't a parameter server segment" << endl;
+        close();
+        return false;
+    }
+    layout();
+    return true;
+}
+
+inline void ps_segment::close()
+{
+    if (h != NULL) munmap(h, bytes);
+    h = NULL;
+    bytes = 0;
+}
+
+inline void ps_segment::read_weights(double *out) const
+{
+    // copy, and again if the server wrote the weights meanwhile
+    //   (its writes are short, a few hundred doubles)
+    const int n = h->n_params;
+    for(;;)
+    {
+        const long s0 = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (s0 & 1) continue;
+        for(int i=0; i < n; i++) out[i] = relaxed_load(w + i);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == s0) return;
+    }
+}
+
+inline void ps_segment::set_weights(const double *src)
+{
+    const long s0 = h->seq;     // only the server writes seq
+    __atomic_store_n(&h->seq, s0 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(int i=0; i < h->n_params; i++) relaxed_store(w + i, src[i]);
+    __atomic_store_n(&h->seq, s0 + 2, __ATOMIC_RELEASE);
+}
+
+inline void ps_segment::update_weights(const double *grad, const double step)
+{
+    // weights = weights - step*grad
+    const long s0 = h->seq;
+    __atomic_store_n(&h->seq, s0 + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(int i=0; i < h->n_params; i++) relaxed_store(w + i, w[i] - step*grad[i]);
+    __atomic_store_n(&h->seq, s0 + 2, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->version, 1, __ATOMIC_RELEASE);
+}
+
+// ------------------------------ control socket ------------------------------
+
+inline bool ps_address(const char *path, sockaddr_un& a)
+{
+    memset(&a, 0, sizeof(a));
+    a.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(a.sun_path)){
+        cout << "socket path too long: " << path << endl;
+        return false;
+    }
+    strcpy(a.sun_path, path);
+    return true;
+}
+
+inline int ps_listen(const char *path)
+{
+    // the server's end, -1 on failure (a stale socket file is replaced)
+    sockaddr_un a;
+    if (!ps_address(path, a)) return -1;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0){
+        perror("ps_listen: socket");
+        return -1;
+    }
+    ::unlink(path);
+    if (bind(fd, (sockaddr*) &a, sizeof(a)) != 0 || listen(fd, SOMAXCONN) != 0){
+        perror("ps_listen");
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int ps_connect(const char *path)
+{
+    // a worker's end, -1 on failure
+    sockaddr_un a;
+    if (!ps_address(path, a)) return -1;
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0){
+        perror("ps_connect: socket");
+        return -1;
+    }
+    if (connect(fd, (sockaddr*) &a, sizeof(a)) != 0){
+        perror("ps_connect");
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline bool ps_send(const int fd, const ps_message& msg)
+{
+    const char *p = (const char*) &msg;
+    size_t left = sizeof(msg);
+    while (left > 0)
+    {
+        const ssize_t k = write(fd, p, left);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        left -= k;
+    }
+    return true;
+}
+
+inline bool ps_recv(const int fd, ps_message& msg)
+{
+    // false if the other end has gone
+    char *p = (char*) &msg;
+    size_t left = sizeof(msg);
+    while (left > 0)
+    {
+        const ssize_t k = read(fd, p, left);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        left -= k;
+    }
+    return true;
+}
+
+// ------------------------------ the server ------------------------------
+
+inline bool ps_accept(const int listen_fd, vector<int>& fd)
+{
+    // one connection from each worker, each says who it is
+    const int n = (int) fd.size();
+    for(int k=0; k < n; )
+    {
+        pollfd pf = { listen_fd, POLLIN, 0 };
+        const int r = poll(&pf, 1, PS_CONNECT_TIMEOUT*1000);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0){
+            cout << "parameter server: only " << k << " of " << n << " workers connected" << endl;
+            return false;
+        }
+        const int c = accept(listen_fd, NULL, NULL);
+        if (c < 0){
+            if (errno == EINTR) continue;
+            perror("parameter server: accept");
+            return false;
+        }
+        ps_message msg;
+        if (!ps_recv(c, msg) || msg.type != PS_HELLO || msg.worker < 0 || msg.worker >= n || fd[msg.worker] >= 0){
+            cout << "parameter server: bad hello from a worker" << endl;
+            ::close(c);
+            return false;
+        }
+        fd[msg.worker] = c;
+        k++;
+    }
+    return true;
+}
+
+inline bool ps_serve(const int listen_fd, ps_segment& seg, const double alpha, const int staleness,
+    vector<ps_message>& done)
+{
+    /*
+    Inputs:
+        listen_fd: from ps_listen(), the workers connect to it
+        seg: the segment, made with create() and holding the first weights
+        alpha: learning rate, each update is weights -= alpha*gradient
+            (the mean gradient of all the workers when synchronous)
+        staleness: < 0 for synchronous updates, otherwise the most steps a
+            worker may be ahead of the slowest one
+        done: receives the PS_DONE message of each worker
+    Output:
+        true when every worker has finished, false if one was lost
+    */
+    const int n = seg.workers(), np = seg.params();
+    vector<int> fd(n, -1);
+    bool ok = ps_accept(listen_fd, fd);
+
+    vector<long> clock(n, 0);   // steps each worker has pushed
+    vector<char> active(n, 1), waiting(n, 0);
+    vector<double> sum(np);
+    vector<pollfd> pf;
+    vector<int> who;
+    done.assign(n, ps_message());
+    int n_active = ok ? n : 0;
+    const ps_message go = { PS_GO, 0, 0, 0.0, 0 };
+
+    while (n_active > 0 && ok)
+    {
+        pf.clear();
+        who.clear();
+        for(int k=0; k < n; k++)
+        {
+            if (!active[k] || waiting[k]) continue;
+            const pollfd p = { fd[k], POLLIN, 0 };
+            pf.push_back(p);
+            who.push_back(k);
+        }
+        if (!pf.empty() && poll(pf.data(), pf.size(), -1) < 0){
+            if (errno == EINTR) continue;
+            perror("parameter server: poll");
+            ok = false;
+            break;
+        }
+
+        for(size_t i=0; i < pf.size() && ok; i++)
+        {
+            if (pf[i].revents == 0) continue;
+            const int k = who[i];
+            ps_message msg;
+            if (!ps_recv(fd[k], msg)){
+                cout << "parameter server: lost worker " << k << endl;
+                ok = false;
+            }
+            else if (msg.type == PS_PUSH){
+                clock[k] = msg.step;
+                waiting[k] = 1;
+                if (staleness >= 0) seg.update_weights(seg.grad(k), alpha);
+            }
+            else if (msg.type == PS_DONE){
+                done[k] = msg;
+                active[k] = 0;
+                n_active--;
+            }
+        }
+        if (!ok || n_active == 0) break;
+
+        if (staleness < 0){
+            // one step with the mean gradient once every worker still
+            //   training has pushed, the gradients added in worker order
+            int n_pushed = 0;
+            for(int k=0; k < n; k++) if (active[k] && waiting[k]) n_pushed++;
+            if (n_pushed < n_active) continue;
+            for(int j=0; j < np; j++) sum[j] = 0.0;
+            for(int k=0; k < n; k++)
+            {
+                if (!active[k]) continue;
+                const double *gk = seg.grad(k);
+                for(int j=0; j < np; j++) sum[j] += gk[j];
+            }
+            seg.update_weights(sum.data(), alpha/n_pushed);
+            for(int k=0; k < n && ok; k++)
+            {
+                if (!active[k]) continue;
+                waiting[k] = 0;
+                ok = ps_send(fd[k], go);
+            }
+        }
+        else{
+            // the workers no more than staleness steps ahead of the slowest go on
+            long slowest = -1;
+            for(int k=0; k < n; k++)
+                if (active[k] && (slowest < 0 || clock[k] < slowest)) slowest = clock[k];
+            for(int k=0; k < n && ok; k++)
+            {
+                if (!active[k] || !waiting[k] || clock[k] - slowest > staleness) continue;
+                waiting[k] = 0;
+                ok = ps_send(fd[k], go);
+            }
+        }
+    }
+    for(int k=0; k < n; k++) if (fd[k] >= 0) ::close(fd[k]);
+    return ok;
+}
+
+#endif
+
+#endif
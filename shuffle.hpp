@@ -0,0 +1,105 @@
+/*
+shuffle.hpp
+
+Random orders in which to visit the rows of the data, one per epoch, as a
+permutation of the row indices. The data itself is never moved or copied:
+training reads row order[r] instead of row r.
+
+    shuffle_rng rng(seed);
+    vector<int> order;
+    shuffle_rows(order, n, block, rng):
+        block <= 1: order is a uniformly random permutation of 0..n-1
+            (Fisher-Yates), any row can follow any other
+        block > 1: the rows are cut into runs of block consecutive rows,
+            the runs are visited in a random order and the rows inside
+            each run in a random order too. Every row is still visited
+            once per epoch, but the data is read a run at a time, so with
+            runs of a few pages the accesses stay mostly sequential (the
+            hardware prefetcher and the OS read-ahead of a mapped file
+            keep working) and a run stays in cache while it is used.
+            The price is that rows in the same run are always close
+            together in an epoch.
+
+shuffle_rng is splitmix64, so the orders are the same on every platform for
+a given seed.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef SHUFFLE
+#define SHUFFLE
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+struct shuffle_rng
+{
+    uint64_t state;
+
+    explicit shuffle_rng(const uint64_t seed) : state(seed) {}
+
+    uint64_t next()
+    {
+        // splitmix64
+        uint64_t z = (state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    int below(const int n)
+    {
+        // an integer in [0, n), from the high 32 bits (the bias is at most
+        //   n/2^32, nothing for the sizes here)
+        return (int) (((next() >> 32)*(uint64_t) n) >> 32);
+    }
+};
+
+inline void shuffle_range(int *p, const int n, shuffle_rng& rng)
+{
+    // Fisher-Yates shuffle of p[0..n-1]
+    for(int i=n-1; i > 0; i--)
+    {
+        const int j = rng.below(i+1);
+        const int t = p[i];
+        p[i] = p[j];
+        p[j] = t;
+    }
+}
+
+inline void shuffle_rows(vector<int>& order, const int n, const int block, shuffle_rng& rng)
+{
+    /*
+    Inputs:
+        order: resized to n and filled with a permutation of 0..n-1
+        n: number of rows
+        block: rows per run for block-wise shuffling, or <= 1 for a full
+            shuffle
+        rng: advanced, so consecutive calls give different epochs
+    */
+    order.resize(n);
+    if (block <= 1 || block >= n){
+        for(int i=0; i < n; i++) order[i] = i;
+        shuffle_range(order.data(), n, rng);
+        return;
+    }
+
+    // the runs in a random order, then the rows within each
+    const int n_runs = (n + block - 1)/block;
+    vector<int> runs(n_runs);
+    for(int k=0; k < n_runs; k++) runs[k] = k;
+    shuffle_range(runs.data(), n_runs, rng);
+    int r = 0;
+    for(int k=0; k < n_runs; k++)
+    {
+        const int i0 = runs[k]*block, i1 = (i0 + block < n) ? i0 + block : n;
+        for(int i=i0; i < i1; i++) order[r + i - i0] = i;
+        shuffle_range(order.data() + r, i1 - i0, rng);
+        r += i1 - i0;
+    }
+}
+
+#endif
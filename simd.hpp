@@ -0,0 +1,227 @@
+/*
+simd.hpp
+
+Vectorized element-wise kernels on raw double and float buffers, used by the
+element-wise operations in matrix.hpp. One set of kernels is compiled for each instruction set
+(scalar, SSE2, AVX2, AVX-512) and the best one the CPU supports is picked the
+first time simd() is called, so a single binary runs on old and new machines.
+
+Kernels (n elements, c may alias a or b):
+    add:   c = a + b
+    sub:   c = a - b
+    mul:   c = a * b
+    scale: c = s * a
+addf, subf, mulf and scalef are the same on floats, twice as many per register.
+simd_add() etc. pick the double or float kernel from the pointer types.
+
+Every kernel performs exactly one IEEE operation per element, so all
+instruction sets give bit-identical results to the scalar version.
+simd_set_level() forces a given level, e.g. SIMD_SCALAR for testing.
+The environment variable NN_SIMD (scalar, sse2, avx2, avx512) does the
+same at startup.
+
+Only GCC compatible compilers on x86 get the vector versions,
+everything else uses the scalar kernels.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef SIMD
+#define SIMD
+
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_X86
+#include <immintrin.h>
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+enum simd_level { SIMD_SCALAR = 0, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 };
+
+struct simd_kernels
+{
+    const char *name;
+    void (*add)(const int n, const double *a, const double *b, double *c);
+    void (*sub)(const int n, const double *a, const double *b, double *c);
+    void (*mul)(const int n, const double *a, const double *b, double *c);
+    void (*scale)(const int n, const double s, const double *a, double *c);
+    void (*addf)(const int n, const float *a, const float *b, float *c);
+    void (*subf)(const int n, const float *a, const float *b, float *c);
+    void (*mulf)(const int n, const float *a, const float *b, float *c);
+    void (*scalef)(const int n, const float s, const float *a, float *c);
+};
+
+// ------------------------------ scalar ---------------------------------------
+
+template <class T>
+inline void add_scalar(const int n, const T *a, const T *b, T *c)
+{ for(int i=0; i < n; i++) c[i] = a[i] + b[i]; }
+
+template <class T>
+inline void sub_scalar(const int n, const T *a, const T *b, T *c)
+{ for(int i=0; i < n; i++) c[i] = a[i] - b[i]; }
+
+template <class T>
+inline void mul_scalar(const int n, const T *a, const T *b, T *c)
+{ for(int i=0; i < n; i++) c[i] = a[i] * b[i]; }
+
+template <class T>
+inline void scale_scalar(const int n, const T s, const T *a, T *c)
+{ for(int i=0; i < n; i++) c[i] = s * a[i]; }
+
+#ifdef SIMD_X86
+
+// one macro per instruction set writes the four kernels, T = element type,
+//   W = elements per register, the remainder is done one at a time
+#define SIMD_BINARY(fname, isa, T, W, vtype, load, store, vop, op)              \
+    SIMD_TARGET(isa) inline void fname(const int n, const T *a,                \
+        const T *b, T *c)                                                      \
+    {                                                                          \
+        int i = 0;                                                             \
+        for(; i + 2*W <= n; i += 2*W)                                          \
+        {                                                                      \
+            vtype x0 = vop(load(a + i), load(b + i));                          \
+            vtype x1 = vop(load(a + i + W), load(b + i + W));                  \
+            store(c + i, x0);                                                  \
+            store(c + i + W, x1);                                              \
+        }                                                                      \
+        for(; i < n; i++) c[i] = a[i] op b[i];                                 \
+    }
+
+#define SIMD_SCALE(fname, isa, T, W, vtype, load, store, vmul, set1)            \
+    SIMD_TARGET(isa) inline void fname(const int n, const T s,                 \
+        const T *a, T *c)                                                      \
+    {                                                                          \
+        const vtype vs = set1(s);                                              \
+        int i = 0;                                                             \
+        for(; i + 2*W <= n; i += 2*W)                                          \
+        {                                                                      \
+            vtype x0 = vmul(vs, load(a + i));                                  \
+            vtype x1 = vmul(vs, load(a + i + W));                              \
+            store(c + i, x0);                                                  \
+            store(c + i + W, x1);                                              \
+        }                                                                      \
+        for(; i < n; i++) c[i] = s * a[i];                                     \
+    }
+
+SIMD_BINARY(add_sse2, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, +)
+SIMD_BINARY(sub_sse2, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, -)
+SIMD_BINARY(mul_sse2, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, *)
+SIMD_SCALE(scale_sse2, "sse2", double, 2, __m128d, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, _mm_set1_pd)
+SIMD_BINARY(addf_sse2, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_add_ps, +)
+SIMD_BINARY(subf_sse2, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_sub_ps, -)
+SIMD_BINARY(mulf_sse2, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_mul_ps, *)
+SIMD_SCALE(scalef_sse2, "sse2", float, 4, __m128, _mm_loadu_ps, _mm_storeu_ps, _mm_mul_ps, _mm_set1_ps)
+
+SIMD_BINARY(add_avx2, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+SIMD_BINARY(sub_avx2, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+SIMD_BINARY(mul_avx2, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+SIMD_SCALE(scale_avx2, "avx2", double, 4, __m256d, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, _mm256_set1_pd)
+SIMD_BINARY(addf_avx2, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, +)
+SIMD_BINARY(subf_avx2, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_sub_ps, -)
+SIMD_BINARY(mulf_avx2, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps, *)
+SIMD_SCALE(scalef_avx2, "avx2", float, 8, __m256, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps, _mm256_set1_ps)
+
+SIMD_BINARY(add_avx512, "avx512f", double, 8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, +)
+SIMD_BINARY(sub_avx512, "avx512f", double, 8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, -)
+SIMD_BINARY(mul_avx512, "avx512f", double, 8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, *)
+SIMD_SCALE(scale_avx512, "avx512f", double, 8, __m512d, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, _mm512_set1_pd)
+SIMD_BINARY(addf_avx512, "avx512f", float, 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps, +)
+SIMD_BINARY(subf_avx512, "avx512f", float, 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_sub_ps, -)
+SIMD_BINARY(mulf_avx512, "avx512f", float, 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_mul_ps, *)
+SIMD_SCALE(scalef_avx512, "avx512f", float, 16, __m512, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_mul_ps, _mm512_set1_ps)
+
+#undef SIMD_BINARY
+#undef SIMD_SCALE
+
+#endif  // SIMD_X86
+
+// ------------------------------ dispatch -------------------------------------
+
+inline simd_kernels simd_table(const simd_level level)
+{
+    // kernel table for a given level (falls back to scalar if not compiled in)
+    simd_kernels k = { "scalar", add_scalar<double>, sub_scalar<double>, mul_scalar<double>,
+        scale_scalar<double>, add_scalar<float>, sub_scalar<float>, mul_scalar<float>,
+        scale_scalar<float> };
+#ifdef SIMD_X86
+    if (level == SIMD_SSE2){
+        simd_kernels s = { "sse2", add_sse2, sub_sse2, mul_sse2, scale_sse2,
+            addf_sse2, subf_sse2, mulf_sse2, scalef_sse2 };
+        k = s;
+    } else if (level == SIMD_AVX2){
+        simd_kernels s = { "avx2", add_avx2, sub_avx2, mul_avx2, scale_avx2,
+            addf_avx2, subf_avx2, mulf_avx2, scalef_avx2 };
+        k = s;
+    } else if (level == SIMD_AVX512){
+        simd_kernels s = { "avx512", add_avx512, sub_avx512, mul_avx512, scale_avx512,
+            addf_avx512, subf_avx512, mulf_avx512, scalef_avx512 };
+        k = s;
+    }
+#endif
+    return k;
+}
+
+inline simd_level simd_cpu_level()
+{
+    // highest level supported by this CPU, from CPUID (checked once, by the
+    //   first caller, whatever thread that is)
+    static const simd_level level = []
+    {
+        simd_level l = SIMD_SCALAR;
+#ifdef SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("sse2")) l = SIMD_SSE2;
+        if (__builtin_cpu_supports("avx2")) l = SIMD_AVX2;
+        if (__builtin_cpu_supports("avx512f")) l = SIMD_AVX512;
+#endif
+        return l;
+    }();
+    return level;
+}
+
+inline simd_level simd_startup_level()
+{
+    // CPU level, lowered by NN_SIMD if it is set
+    simd_level level = simd_cpu_level();
+    const char *env = getenv("NN_SIMD");
+    if (env != NULL){
+        simd_level want = level;
+        if (strcmp(env, "scalar") == 0) want = SIMD_SCALAR;
+        else if (strcmp(env, "sse2") == 0) want = SIMD_SSE2;
+        else if (strcmp(env, "avx2") == 0) want = SIMD_AVX2;
+        else if (strcmp(env, "avx512") == 0) want = SIMD_AVX512;
+        if (want < level) level = want;
+    }
+    return level;
+}
+
+inline simd_kernels& simd()
+{
+    // the kernels in use, chosen on first call
+    static simd_kernels current = simd_table(simd_startup_level());
+    return current;
+}
+
+inline void simd_set_level(simd_level level)
+{
+    // force a level, e.g. SIMD_SCALAR to check results against the vector kernels
+    //   (never above what the CPU supports)
+    if (level > simd_cpu_level()) level = simd_cpu_level();
+    simd() = simd_table(level);
+}
+
+// kernels in use, chosen by element type
+inline void simd_add(const int n, const double *a, const double *b, double *c) { simd().add(n, a, b, c); }
+inline void simd_add(const int n, const float *a, const float *b, float *c) { simd().addf(n, a, b, c); }
+inline void simd_sub(const int n, const double *a, const double *b, double *c) { simd().sub(n, a, b, c); }
+inline void simd_sub(const int n, const float *a, const float *b, float *c) { simd().subf(n, a, b, c); }
+inline void simd_mul(const int n, const double *a, const double *b, double *c) { simd().mul(n, a, b, c); }
+inline void simd_mul(const int n, const float *a, const float *b, float *c) { simd().mulf(n, a, b, c); }
+inline void simd_scale(const int n, const double s, const double *a, double *c) { simd().scale(n, s, a, c); }
+inline void simd_scale(const int n, const float s, const float *a, float *c) { simd().scalef(n, s, a, c); }
+
+#endif
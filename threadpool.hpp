@@ -0,0 +1,269 @@
+/*
+threadpool.hpp
+
+A persistent pool of worker threads shared by the kernels in matrix.hpp and
+gemm.hpp. The threads are started once and sleep between jobs, so a parallel
+loop costs a wake-up, not a thread creation.
+
+    parallel_for(n, grain, body):
+        calls body(begin, end) on disjoint ranges covering [0, n), spread
+        over the pool. The calling thread works too. Ranges are at least
+        grain long, loops shorter than 2*grain just run body(0, n) here.
+    parallel_elements(n, body):
+        the same for a loop over n array elements, serial for fewer than
+        PARALLEL_THRESHOLD elements
+
+Thread count:
+    the number of hardware threads by default, or the environment variable
+    NN_THREADS at startup, or set_num_threads(n) at any time
+    (set_num_threads(1) runs everything on the calling thread),
+    restart_pool_after_fork(n) in a child process
+
+Every range is computed exactly as it would be on one thread, so kernels that
+write each output element from one range only (all of the ones in matrix.hpp)
+give the same bits for any thread count.
+
+A parallel_for called from inside another one (or from a second thread while
+the pool is busy) runs on the calling thread.
+
+Link with -pthread on Linux.
+
+AEP 4380
+Author: Collin Farquhar
+*/
+
+#ifndef THREADPOOL
+#define THREADPOOL
+
+#include <cstdlib>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// element-wise loops (and transpose) shorter than this stay on one thread
+#ifndef PARALLEL_THRESHOLD
+#define PARALLEL_THRESHOLD (1 << 16)
+#endif
+
+class thread_pool
+{
+public:
+    explicit thread_pool(const int n_threads);
+    ~thread_pool();
+
+    int size() const { return n_threads; }
+
+    template <class F>
+    void parallel_for(const int n, const int grain, F body);
+
+private:
+    // a job is a plain function plus a pointer to its state, so starting
+    //   one doesn't allocate
+    typedef void (*task_fn)(void *ctx, int begin, int end);
+
+    template <class F>
+    static void call(void *ctx, int begin, int end) { (*(F*) ctx)(begin, end); }
+
+    void run(task_fn fn, void *ctx, const int n, const int chunk);
+    void work();
+    void worker_loop();
+
+    int n_threads;
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::atomic<bool> busy;  // a job is running
+    std::condition_variable wake, done;
+    long generation;    // counts jobs, workers wait for it to change
+    int pending;        // workers that haven't finished the current job
+    bool stop;
+
+    // current job
+    task_fn job_fn;
+    void *job_ctx;
+    int job_n, job_chunk;
+    std::atomic<int> next;   // start of the next range to hand out
+
+    thread_pool(const thread_pool&);
+    thread_pool& operator=(const thread_pool&);
+};
+
+inline bool& thread_pool_in_worker()
+{
+    // true on the pool's own threads (nested loops run serially there)
+    static thread_local bool in_worker = false;
+    return in_worker;
+}
+
+inline thread_pool::thread_pool(const int n)
+    : n_threads(n < 1 ? 1 : n), busy(false), generation(0), pending(0), stop(false),
+      job_fn(NULL), job_ctx(NULL), job_n(0), job_chunk(1), next(0)
+{
+    for(int i=1; i < n_threads; i++) workers.push_back(std::thread(&thread_pool::worker_loop, this));
+}
+
+inline thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stop = true;
+    }
+    wake.notify_all();
+    for(size_t i=0; i < workers.size(); i++) workers[i].join();
+}
+
+template <class F>
+void thread_pool::parallel_for(const int n, const int grain, F body)
+{
+    /*
+    Inputs:
+        n: loop length
+        grain: smallest range worth handing to a thread
+        body: called as body(begin, end), must be safe to run concurrently
+            on disjoint ranges
+    Description:
+        Splits [0, n) into about 4 ranges per thread (never shorter than
+        grain) which the threads take in turn, so uneven ranges balance out.
+    */
+    if (n <= 0) return;
+    const int g = (grain < 1) ? 1 : grain;
+    if (n_threads == 1 || n < 2*g || thread_pool_in_worker()){
+        body(0, n);
+        return;
+    }
+    int chunk = (n + 4*n_threads - 1)/(4*n_threads);
+    if (chunk < g) chunk = g;
+    run(&call<F>, &body, n, chunk);
+}
+
+inline void thread_pool::run(task_fn fn, void *ctx, const int n, const int chunk)
+{
+    // one job at a time, anyone else gets the serial loop
+    bool idle = false;
+    if (!busy.compare_exchange_strong(idle, true)){
+        fn(ctx, 0, n);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m);
+        job_fn = fn;
+        job_ctx = ctx;
+        job_n = n;
+        job_chunk = chunk;
+        next = 0;
+        pending = (int) workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    work();
+
+    {
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [this]{ return pending == 0; });
+    }
+    busy = false;
+}
+
+inline void thread_pool::work()
+{
+    // take ranges until there are none left
+    for(;;)
+    {
+        const int begin = next.fetch_add(job_chunk);
+        if (begin >= job_n) return;
+        const int end = (job_n - begin < job_chunk) ? job_n : begin + job_chunk;
+        job_fn(job_ctx, begin, end);
+    }
+}
+
+inline void thread_pool::worker_loop()
+{
+    thread_pool_in_worker() = true;
+    long seen = 0;
+    std::unique_lock<std::mutex> lock(m);
+    for(;;)
+    {
+        wake.wait(lock, [&]{ return stop || generation != seen; });
+        if (stop) return;
+        seen = generation;
+        lock.unlock();
+        work();
+        lock.lock();
+        if (--pending == 0) done.notify_one();
+    }
+}
+
+// ------------------------------ the shared pool ------------------------------
+
+inline int default_num_threads()
+{
+    // NN_THREADS if set, otherwise every hardware thread
+    const char *env = getenv("NN_THREADS");
+    if (env != NULL && atoi(env) > 0) return atoi(env);
+    const int n = (int) std::thread::hardware_concurrency();
+    return (n > 0) ? n : 1;
+}
+
+inline thread_pool*& thread_pool_ptr()
+{
+    static thread_pool *p = NULL;
+    return p;
+}
+
+inline thread_pool& pool()
+{
+    // the pool used by matrix.hpp, started on first use
+    //   (left running until the program exits); the first use may come
+    //   from several threads at once (Hogwild workers, the data_stream
+    //   reader), call_once makes sure only one of them starts it
+    static std::once_flag started;
+    std::call_once(started, []
+    {
+        thread_pool*& p = thread_pool_ptr();
+        if (p == NULL) p = new thread_pool(default_num_threads());
+    });
+    return *thread_pool_ptr();
+}
+
+inline void set_num_threads(const int n)
+{
+    // replace the shared pool with one of n threads (including the caller),
+    //   must not be called while a parallel loop is running
+    thread_pool*& p = thread_pool_ptr();
+    delete p;
+    p = new thread_pool(n);
+}
+
+inline void restart_pool_after_fork(const int n)
+{
+    // in the child of a fork(): only the thread that called fork() exists
+    //   here, so the inherited pool can't be shut down (its workers would
+    //   never answer); it is left alone and a new pool of n threads takes
+    //   its place
+    thread_pool_ptr() = new thread_pool(n);
+}
+
+inline int num_threads() { return pool().size(); }
+
+template <class F>
+inline void parallel_for(const int n, const int grain, F body)
+{
+    // parallel_for on the shared pool (short loops don't start it)
+    if (n < 2*grain){
+        if (n > 0) body(0, n);
+        return;
+    }
+    pool().parallel_for(n, grain, body);
+}
+
+template <class F>
+inline void parallel_elements(const int n, F body)
+{
+    // body(begin, end) over n array elements, on one thread
+    //   below PARALLEL_THRESHOLD
+    parallel_for(n, PARALLEL_THRESHOLD/2, body);
+}
+
+#endif